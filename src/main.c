@@ -3,10 +3,13 @@
 #include <systemd/sd-daemon.h>
 #include "uresourced-config.h"
 #include "r-manager.h"
+#include "r-replay.h"
+#include "r-trace.h"
 
 #ifdef HAVE_APP_MANAGEMENT
 #include "r-app-monitor.h"
 #include "r-app-policy.h"
+#include "r-app-service.h"
 #include "r-pw-monitor.h"
 #include "r-game-monitor.h"
 #endif
@@ -28,41 +31,43 @@ quit_mainloop (GMainLoop *loop)
 }
 
 static gboolean
-idle_system_daemon_update (gpointer user_data G_GNUC_UNUSED)
+reload_manager (RManager *manager)
 {
-  g_autoptr(GError) error = NULL;
-  g_autoptr(GDBusConnection) bus = NULL;
-  g_autoptr(GVariant) res = NULL;
+  r_manager_reload (manager);
 
-  /* The daemon is idle anyway, no need to bother with async routines. */
-  bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
-  if (!bus)
-    {
-      g_warning ("Could not get system bus: %s", error->message);
-      return G_SOURCE_REMOVE;
-    }
+  return G_SOURCE_CONTINUE;
+}
 
-  res = g_dbus_connection_call_sync (bus,
-                                     "org.freedesktop.UResourced",
-                                     "/org/freedesktop/UResourced",
-                                     "org.freedesktop.UResourced",
-                                     "Update",
-                                     NULL,
-                                     NULL,
-                                     G_DBUS_CALL_FLAGS_NO_AUTO_START,
-                                     1000,
-                                     NULL,
-                                     &error);
-
-  if (!res)
-    {
-      g_warning ("Could not call system daemon update routine: %s", error->message);
-      return G_SOURCE_REMOVE;
-    }
+#ifdef HAVE_APP_MANAGEMENT
+static gboolean
+reload_app_policy (RAppPolicy *app_policy)
+{
+  r_app_policy_reload (app_policy);
 
-  return G_SOURCE_REMOVE;
+  return G_SOURCE_CONTINUE;
 }
 
+static void
+trace_app_changed (RTraceWriter *trace, RAppInfo *app)
+{
+  r_trace_writer_add_app (trace, app->path, app->timestamp, app->boosted);
+}
+
+static void
+trace_app_removed (RTraceWriter *trace, RAppInfo *app)
+{
+  r_trace_writer_add_app_removed (trace, app->path);
+}
+#else
+static gboolean
+ignore_reload (gpointer user_data G_GNUC_UNUSED)
+{
+  g_debug ("Nothing to reload without app management");
+
+  return G_SOURCE_CONTINUE;
+}
+#endif
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -70,18 +75,28 @@ main (gint   argc,
   g_autoptr(GOptionContext) context = NULL;
   g_autoptr(GError) error = NULL;
   g_autoptr(GMainLoop) loop = NULL;
+  g_autoptr(RTraceWriter) trace = NULL;
   g_autoptr(RManager) manager = NULL;
 #ifdef HAVE_APP_MANAGEMENT
   g_autoptr(RAppPolicy) app_policy = NULL;
+  g_autoptr(RAppService) app_service = NULL;
   g_autoptr(RPwMonitor) pw_monitor = NULL;
   g_autoptr(RGameMonitor) game_monitor = NULL;
   RAppMonitor *app_monitor = NULL;
 #endif
   gboolean user_mode = FALSE;
   gboolean version = FALSE;
+  g_autofree gchar *replay_file = NULL;
+  g_autofree gchar *config_file = NULL;
+  gdouble replay_speed = 1.0;
+  g_autofree gchar *trace_file = NULL;
   GOptionEntry main_entries[] = {
     { "version", 0, 0, G_OPTION_ARG_NONE, &version, "Show program version", NULL },
     { "user", 0, 0, G_OPTION_ARG_NONE, &user_mode, "Run user session part", NULL },
+    { "replay", 0, 0, G_OPTION_ARG_FILENAME, &replay_file, "Replay a trace against a mock systemd and print the calls", "TRACE" },
+    { "replay-speed", 0, 0, G_OPTION_ARG_DOUBLE, &replay_speed, "Replay FACTOR times faster than recorded, 0 for as fast as possible", "FACTOR" },
+    { "config", 0, 0, G_OPTION_ARG_FILENAME, &config_file, "Configuration file for --replay, the built-in defaults are used otherwise", "FILE" },
+    { "record-trace", 0, 0, G_OPTION_ARG_FILENAME, &trace_file, "Record the allocation inputs into a trace", "TRACE" },
     { NULL }
   };
 
@@ -100,6 +115,33 @@ main (gint   argc,
       return EXIT_SUCCESS;
     }
 
+  if ((config_file || replay_speed != 1.0) && !replay_file)
+    {
+      g_printerr ("--config and --replay-speed are only supported with --replay\n");
+      return EXIT_FAILURE;
+    }
+
+  if (replay_file)
+    {
+      if (!r_replay_run (replay_file, config_file, replay_speed, user_mode, &error))
+        {
+          g_printerr ("%s\n", error->message);
+          return EXIT_FAILURE;
+        }
+
+      return EXIT_SUCCESS;
+    }
+
+  if (trace_file)
+    {
+      trace = r_trace_writer_new (trace_file, &error);
+      if (!trace)
+        {
+          g_printerr ("%s\n", error->message);
+          return EXIT_FAILURE;
+        }
+    }
+
   loop = g_main_loop_new (NULL, FALSE);
 
   /* Gracefully shutdown on SIGTERM and SIGINT */
@@ -110,36 +152,51 @@ main (gint   argc,
                      G_SOURCE_FUNC (quit_mainloop),
                      loop);
 
-  /* In user session mode the daemon currently signals to the system
-   * daemon that it is running. This resolves a race condition where the
-   * cgroup of the user daemon was not yet active when the user became active
-   * after login.
-   */
-
   if (!user_mode)
     {
       manager = r_manager_new ();
       g_signal_connect_swapped (manager, "quit", G_CALLBACK (quit_mainloop), loop);
+      r_manager_record_trace (manager, trace);
 
       r_manager_start (manager);
+
+      /* Reload configuration on SIGHUP */
+      g_unix_signal_add (SIGHUP,
+                         G_SOURCE_FUNC (reload_manager),
+                         manager);
     }
   else
     {
-      /* Register an idle handler to poke the system daemon. */
-      g_idle_add (idle_system_daemon_update, NULL);
-
 #ifdef HAVE_APP_MANAGEMENT
       app_monitor = r_app_monitor_get_default ();
       r_app_monitor_start (app_monitor);
 
+      /* Connected first so the trace has the state the policy acts on. */
+      if (trace)
+        {
+          g_signal_connect_swapped (app_monitor, "changed", G_CALLBACK (trace_app_changed), trace);
+          g_signal_connect_swapped (app_monitor, "removed", G_CALLBACK (trace_app_removed), trace);
+        }
+
       app_policy = r_app_policy_new ();
       r_app_policy_start (app_policy, app_monitor);
 
+      app_service = r_app_service_new ();
+      r_app_service_start (app_service, app_monitor, app_policy);
+
+      /* Reload configuration on SIGHUP */
+      g_unix_signal_add (SIGHUP,
+                         G_SOURCE_FUNC (reload_app_policy),
+                         app_policy);
+
       pw_monitor = r_pw_monitor_new ();
       r_pw_monitor_start (pw_monitor, app_monitor);
 
       game_monitor = r_game_monitor_new ();
       r_game_monitor_start (game_monitor, app_monitor);
+#else
+      /* The user unit has ExecReload, SIGHUP must not terminate us. */
+      g_unix_signal_add (SIGHUP, ignore_reload, NULL);
 #endif
     }
 
@@ -159,9 +216,12 @@ main (gint   argc,
     {
       r_game_monitor_stop (game_monitor);
       r_pw_monitor_stop (pw_monitor);
+      r_app_service_stop (app_service);
       r_app_policy_stop (app_policy);
       r_app_monitor_stop (app_monitor);
 
+      if (trace)
+        g_signal_handlers_disconnect_by_data (app_monitor, trace);
       g_object_unref (app_monitor);
     }
 #endif
@@ -288,6 +288,70 @@ r_app_monitor_get_app_info_from_path (RAppMonitor *app_monitor, gchar *app_path)
   return app;
 }
 
+/**
+ * r_app_monitor_lookup_app:
+ * @self: RAppMonitor
+ * @app_path: Application Path
+ *
+ * Unlike r_app_monitor_get_app_info_from_path() this neither touches the
+ * filesystem nor creates a new RAppInfo.
+ *
+ * Returns: (nullable): The tracked RAppInfo for the path
+ */
+RAppInfo *
+r_app_monitor_lookup_app (RAppMonitor *self, const gchar *app_path)
+{
+  return g_hash_table_lookup (self->app_info_map, app_path);
+}
+
+/**
+ * r_app_monitor_add_app:
+ * @self: RAppMonitor
+ * @app_path: Application Path
+ *
+ * Like r_app_monitor_get_app_info_from_path() but without touching the
+ * filesystem, the application starts out with the default values. Used for
+ * replaying traces.
+ *
+ * Returns: The RAppInfo for the path
+ */
+RAppInfo *
+r_app_monitor_add_app (RAppMonitor *self, const gchar *app_path)
+{
+  RAppInfo *app;
+
+  app = g_hash_table_lookup (self->app_info_map, app_path);
+  if (app)
+    return app;
+
+  app = create_app_info_default ();
+  app->path = g_strdup (app_path);
+  app->name = get_unit_name_from_path (app_path);
+  if (!app->name)
+    app->name = g_path_get_basename (app_path);
+  g_hash_table_replace (self->app_info_map, g_strdup (app_path), app);
+
+  return app;
+}
+
+/**
+ * r_app_monitor_remove_app:
+ * @self: RAppMonitor
+ * @app_path: Application Path
+ *
+ * Emits "removed" and stops tracking the application.
+ */
+void
+r_app_monitor_remove_app (RAppMonitor *self, const gchar *app_path)
+{
+  RAppInfo *app;
+
+  app = g_hash_table_lookup (self->app_info_map, app_path);
+  if (app)
+    g_signal_emit_by_name (self, "removed", app);
+  g_hash_table_remove (self->app_info_map, app_path);
+}
+
 static void
 reset_app_info (G_GNUC_UNUSED gpointer key,
                 gpointer value, gpointer data)
@@ -295,7 +359,7 @@ reset_app_info (G_GNUC_UNUSED gpointer key,
   RAppMonitor *self = (RAppMonitor *) data;
   RAppInfo *app = (RAppInfo *) value;
 
-  if (app->timestamp == -1 || app->boosted != 0)
+  if (app->timestamp == -1 || app->boosted != 0 || app->idle || app->frozen)
     {
       app->timestamp = g_get_monotonic_time ();
       app->boosted = BOOST_NONE;
@@ -304,6 +368,31 @@ reset_app_info (G_GNUC_UNUSED gpointer key,
     }
 }
 
+/**
+ * r_app_monitor_get_apps:
+ * @self: RAppMonitor
+ *
+ * Returns: (transfer container): A list of all tracked RAppInfo
+ */
+GList *
+r_app_monitor_get_apps (RAppMonitor *self)
+{
+  return g_hash_table_get_values (self->app_info_map);
+}
+
+/**
+ * r_app_monitor_get_cgroup_paths:
+ * @self: RAppMonitor
+ *
+ * Returns: (transfer container): The paths of all watched cgroups in
+ *   app.slice, including app.slice itself
+ */
+GList *
+r_app_monitor_get_cgroup_paths (RAppMonitor *self)
+{
+  return g_hash_table_get_keys (self->path_to_wd_map);
+}
+
 void
 r_app_monitor_reset_all_apps (RAppMonitor *self)
 {
@@ -374,7 +463,8 @@ handle_inotify_event (RAppMonitor *self, struct inotify_event *i)
       wd_temp = g_hash_table_lookup (self->path_to_wd_map, app_path);
       g_hash_table_remove (self->path_to_wd_map, app_path);
       g_hash_table_remove (self->wd_to_path_map, wd_temp);
-      g_hash_table_remove (self->app_info_map, app_path);
+
+      r_app_monitor_remove_app (self, app_path);
 
       inotify_rm_watch (self->inotify_fd, GPOINTER_TO_INT (wd_temp));
     }
@@ -456,6 +546,10 @@ r_app_monitor_class_init (RAppMonitorClass *klass)
 
   g_signal_new ("changed", R_TYPE_APP_MONITOR, G_SIGNAL_RUN_LAST, 0, NULL,
                 NULL, NULL, G_TYPE_NONE, 1, G_TYPE_POINTER);
+
+  /* Emitted right before the RAppInfo of a removed application is freed */
+  g_signal_new ("removed", R_TYPE_APP_MONITOR, G_SIGNAL_RUN_LAST, 0, NULL,
+                NULL, NULL, G_TYPE_NONE, 1, G_TYPE_POINTER);
 }
 
 static void
@@ -11,9 +11,14 @@ G_BEGIN_DECLS
 typedef enum {
   BOOST_NONE = 0,
   BOOST_AUDIO = (1 << 0),
-  BOOST_GAME = (1 << 1)
+  BOOST_GAME = (1 << 1),
+  BOOST_VIDEO = (1 << 2),
+  BOOST_CAPTURE = (1 << 3),
+  BOOST_XRUN = (1 << 4)
 } AppBoostFlags;
 
+#define BOOST_N_FLAGS 5
+
 typedef struct
 {
   gchar        *name;
@@ -22,6 +27,13 @@ typedef struct
   guint64       io_weight;
   gint64        timestamp;
   AppBoostFlags boosted;
+  gboolean      idle;
+  gboolean      frozen;
+  gdouble       uclamp_min;
+  gboolean      confined;
+  gboolean      io_capped;
+  /* The weights were set by the policy at least once */
+  gboolean      weights_set;
 } RAppInfo;
 
 G_DECLARE_FINAL_TYPE (RAppMonitor, r_app_monitor, R, APP_MONITOR, GObject)
@@ -34,6 +46,14 @@ void r_app_monitor_stop (RAppMonitor *self);
 
 RAppInfo *r_app_monitor_get_app_info_from_path (RAppMonitor *app_monitor,
                                                 gchar       *app_path);
+RAppInfo *r_app_monitor_lookup_app (RAppMonitor *self,
+                                    const gchar *app_path);
+RAppInfo *r_app_monitor_add_app (RAppMonitor *self,
+                                 const gchar *app_path);
+void r_app_monitor_remove_app (RAppMonitor *self,
+                               const gchar *app_path);
+GList *r_app_monitor_get_apps (RAppMonitor *self);
+GList *r_app_monitor_get_cgroup_paths (RAppMonitor *self);
 void r_app_monitor_reset_all_apps (RAppMonitor *self);
 
 void r_app_monitor_app_info_changed (RAppMonitor *self,
@@ -7,6 +7,29 @@
 #include "uresourced-config.h"
 #include "r-app-monitor.h"
 #include "r-app-policy.h"
+#include "r-app-rules.h"
+#include "r-cpu-topology.h"
+#include "r-timer-wheel.h"
+#include "utils.h"
+
+/* Tier transitions are minutes apart, a coarse tick is good enough. */
+#define TIER_WHEEL_TICK_MS 5000
+
+/* Names used for the per flag Boost<Name>CPUWeightInc keys, by flag bit */
+static const char *boost_flag_names[BOOST_N_FLAGS] = {
+  "Audio",
+  "Game",
+  "Video",
+  "Capture",
+  "Xrun",
+};
+
+typedef struct
+{
+  gint64 after_usec;
+  gint   cpu_weight;
+  gint   io_weight;
+} RDecayTier;
 
 struct _RAppPolicy
 {
@@ -23,14 +46,103 @@ struct _RAppPolicy
 
   gint         boost_cpu_weight_inc;
   gint         boost_io_weight_inc;
+
+  /* Per boost flag increments, indexed by flag bit */
+  gint         boost_cpu_weight_incs[BOOST_N_FLAGS];
+  gint         boost_io_weight_incs[BOOST_N_FLAGS];
+  gdouble      boost_uclamp_mins[BOOST_N_FLAGS];
+  gdouble      max_uclamp_min;
+  /* Ancestors of app cgroups whose cpu.uclamp.min was raised */
+  GHashTable  *uclamp_parents;
+
+  gint64       idle_after_usec;
+  GArray      *decay_tiers;
+  gint64       freeze_after_usec;
+  RAppRules   *freeze_allowlist;
+  RAppRules   *rules;
+  RTimerWheel *tier_wheel;
+
+  /* AllowedCPUs of other applications while a game runs, NULL if disabled */
+  GBytes      *background_cpus;
+  gchar       *background_cpu_list;
+  /* Paths of applications with BOOST_GAME */
+  GHashTable  *game_apps;
+
+  /* io.max of other applications while a game or audio boost exists */
+  gchar       *io_device;
+  guint64      read_bandwidth_max;
+  guint64      write_bandwidth_max;
+  /* Paths of applications with BOOST_GAME or BOOST_AUDIO */
+  GHashTable  *io_boost_apps;
+
+  GFileMonitor *config_monitor;
+  GFileMonitor *user_config_monitor;
+  guint         config_reload_id;
+
+  /* Replays only read @config_path (if any) and do not follow changes */
+  gboolean      static_config;
+  gchar        *config_path;
 };
 
 G_DEFINE_TYPE (RAppPolicy, r_app_policy, G_TYPE_OBJECT);
 
+static void systemd_bus_proxy_ready_cb (GObject      *source,
+                                        GAsyncResult *res,
+                                        gpointer      data);
+
 RAppPolicy *
 r_app_policy_new (void)
 {
-  return g_object_new (R_TYPE_APP_POLICY, NULL);
+  RAppPolicy *self;
+
+  self = g_object_new (R_TYPE_APP_POLICY, NULL);
+
+  g_dbus_proxy_new_for_bus (G_BUS_TYPE_SESSION,
+                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES
+                            | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS
+                            | G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+                            NULL, "org.freedesktop.systemd1",
+                            "/org/freedesktop/systemd1",
+                            "org.freedesktop.systemd1.Manager", NULL,
+                            systemd_bus_proxy_ready_cb, self);
+
+  return self;
+}
+
+/**
+ * r_app_policy_new_for_connection:
+ * @connection: A peer-to-peer connection to a (mock) systemd
+ * @config_path: (nullable): The configuration file, %NULL to use the
+ *   built-in defaults
+ *
+ * Used for replaying traces, the connection is not a message bus
+ * connection so the proxy is created without a name. The user and system
+ * configuration are not used.
+ *
+ * Returns: (transfer full): A new RAppPolicy
+ */
+RAppPolicy *
+r_app_policy_new_for_connection (GDBusConnection *connection,
+                                 const gchar     *config_path)
+{
+  g_autoptr(GError) error = NULL;
+  RAppPolicy *self;
+
+  self = g_object_new (R_TYPE_APP_POLICY, NULL);
+  self->static_config = TRUE;
+  self->config_path = g_strdup (config_path);
+
+  self->proxy = g_dbus_proxy_new_sync (connection,
+                                       G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES
+                                       | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                       NULL, NULL,
+                                       "/org/freedesktop/systemd1",
+                                       "org.freedesktop.systemd1.Manager", NULL,
+                                       &error);
+  if (!self->proxy)
+    g_error ("Failed to create GDBusProxy: %s\n", error->message);
+
+  return self;
 }
 
 static void
@@ -38,6 +150,20 @@ r_app_policy_finalize (GObject *object)
 {
   RAppPolicy *self = (RAppPolicy *) object;
 
+  g_clear_pointer (&self->tier_wheel, r_timer_wheel_free);
+  g_clear_pointer (&self->uclamp_parents, g_hash_table_destroy);
+  g_clear_pointer (&self->background_cpus, g_bytes_unref);
+  g_clear_pointer (&self->background_cpu_list, g_free);
+  g_clear_pointer (&self->game_apps, g_hash_table_destroy);
+  g_clear_pointer (&self->io_device, g_free);
+  g_clear_pointer (&self->io_boost_apps, g_hash_table_destroy);
+  g_clear_handle_id (&self->config_reload_id, g_source_remove);
+  g_clear_object (&self->config_monitor);
+  g_clear_object (&self->user_config_monitor);
+  g_clear_pointer (&self->config_path, g_free);
+  g_clear_pointer (&self->decay_tiers, g_array_unref);
+  g_clear_pointer (&self->freeze_allowlist, r_app_rules_free);
+  g_clear_pointer (&self->rules, r_app_rules_free);
   g_clear_object (&self->proxy);
 
   G_OBJECT_CLASS (r_app_policy_parent_class)->finalize (object);
@@ -74,36 +200,793 @@ set_application_resources (RAppPolicy *self, RAppInfo *app)
 
   g_info ("Setting resources on %s (CPUWeight: %ld, IOWeight: %ld)", app->name,
           app->cpu_weight, app->io_weight);
+  app->weights_set = TRUE;
 
   g_dbus_proxy_call (self->proxy, "SetUnitProperties",
                      g_variant_builder_end (&builder), G_DBUS_CALL_FLAGS_NONE,
                      1000, NULL, set_application_resources_cb, self);
 }
 
+/**
+ * set_application_idle:
+ * @app: Application
+ * @idle: Whether the application should only run on otherwise idle CPUs
+ *
+ * systemd does not expose cpu.idle as a unit property (and resets it when
+ * applying CPUWeight=), so it is written to cgroupfs directly. While an
+ * application is idle no weights are sent to systemd.
+ */
 static void
-app_info_changed (gpointer *data, gpointer arg, G_GNUC_UNUSED GObject *object)
+set_application_idle (RAppInfo *app, gboolean idle)
 {
-  RAppPolicy *policy = R_APP_POLICY (data);
-  RAppInfo *app = (RAppInfo *) arg;
+  g_info ("Setting resources on %s (CPUIdle: %d)", app->name, idle);
 
-  g_debug ("App Info changed: %s", app->name);
-  g_debug ("Timestamp: %ld, Boosted: %d", app->timestamp, (int) app->boosted);
+  write_cgroup_attribute (app->path, "cpu.idle", idle ? "1" : "0");
+}
+
+static const RAppRule *
+lookup_rule (RAppPolicy *self, RAppInfo *app)
+{
+  if (!self->rules)
+    return NULL;
+
+  return r_app_rules_lookup (self->rules, app->name);
+}
+
+/**
+ * set_application_allowed_cpus:
+ * @self: RAppPolicy
+ * @app: Application
+ * @confined: Whether to confine the application to the background CPUs
+ *
+ * An empty AllowedCPUs resets the application to all CPUs.
+ */
+static void
+set_application_allowed_cpus (RAppPolicy *self, RAppInfo *app, gboolean confined)
+{
+  GVariantBuilder builder
+    = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("(sba(sv))"));
+  GVariant *cpus;
+
+  app->confined = confined;
+  if (!self->proxy)
+    return;
+
+  if (confined)
+    cpus = g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                      g_bytes_get_data (self->background_cpus, NULL),
+                                      g_bytes_get_size (self->background_cpus),
+                                      sizeof (guint8));
+  else
+    cpus = g_variant_new_array (G_VARIANT_TYPE_BYTE, NULL, 0);
+
+  g_variant_builder_add (&builder, "s", app->name);
+  g_variant_builder_add (&builder, "b", TRUE);
+  g_variant_builder_open (&builder, G_VARIANT_TYPE ("a(sv)"));
+  g_variant_builder_add (&builder, "(sv)", "AllowedCPUs", cpus);
+  g_variant_builder_close (&builder);
+
+  g_info ("Setting resources on %s (AllowedCPUs: %s)", app->name,
+          confined ? self->background_cpu_list : "all");
+
+  g_dbus_proxy_call (self->proxy, "SetUnitProperties",
+                     g_variant_builder_end (&builder), G_DBUS_CALL_FLAGS_NONE,
+                     1000, NULL, set_application_resources_cb, self);
+}
+
+static gboolean
+app_should_be_confined (RAppPolicy *self, RAppInfo *app)
+{
+  const RAppRule *rule;
+
+  rule = lookup_rule (self, app);
+  return self->background_cpus &&
+         g_hash_table_size (self->game_apps) > 0 &&
+         !(app->boosted & BOOST_GAME) &&
+         !(rule && rule->exempt) &&
+         strstr (app->path, "/app.slice/") != NULL;
+}
+
+static void
+update_app_cpus (RAppPolicy *self, RAppInfo *app)
+{
+  gboolean confined;
+
+  confined = app_should_be_confined (self, app);
+  if (confined != app->confined)
+    set_application_allowed_cpus (self, app, confined);
+}
+
+static void
+update_all_app_cpus (RAppPolicy *self)
+{
+  g_autoptr(GList) apps = NULL;
+  GList *l;
+
+  apps = r_app_monitor_get_apps (self->app_monitor);
+  for (l = apps; l; l = l->next)
+    update_app_cpus (self, l->data);
+}
+
+/**
+ * update_game_isolation:
+ * @self: RAppPolicy
+ * @app: Application that changed
+ *
+ * While any game is running, all other applications in app.slice are
+ * confined to the background CPUs, leaving the remaining cores to the games.
+ * Everything is restored when the last game is gone.
+ */
+static void
+update_game_isolation (RAppPolicy *self, RAppInfo *app)
+{
+  gboolean was_active;
+
+  was_active = g_hash_table_size (self->game_apps) > 0;
+
+  if (app->boosted & BOOST_GAME)
+    g_hash_table_add (self->game_apps, g_strdup (app->path));
+  else
+    g_hash_table_remove (self->game_apps, app->path);
+
+  if (was_active == (g_hash_table_size (self->game_apps) > 0))
+    {
+      update_app_cpus (self, app);
+      return;
+    }
+
+  if (self->background_cpus)
+    g_info ("%s game isolation", was_active ? "Stopping" : "Starting");
+
+  update_all_app_cpus (self);
+}
+
+static void
+add_bandwidth_max (GVariantBuilder *builder,
+                   const gchar     *property,
+                   const gchar     *device,
+                   guint64          bandwidth)
+{
+  GVariantBuilder limits = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a(st)"));
+
+  /* An empty list removes all limits */
+  if (device && bandwidth > 0)
+    g_variant_builder_add (&limits, "(st)", device, bandwidth);
+
+  g_variant_builder_add (builder, "(sv)", property, g_variant_builder_end (&limits));
+}
+
+/**
+ * set_application_io_capped:
+ * @self: RAppPolicy
+ * @app: Application
+ * @capped: Whether to cap the I/O bandwidth of the application
+ *
+ * Unlike IOWeight, io.max is enforced independent of the I/O scheduler
+ * and of contention.
+ */
+static void
+set_application_io_capped (RAppPolicy *self, RAppInfo *app, gboolean capped)
+{
+  GVariantBuilder builder
+    = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("(sba(sv))"));
+
+  app->io_capped = capped;
+  if (!self->proxy)
+    return;
+
+  g_variant_builder_add (&builder, "s", app->name);
+  g_variant_builder_add (&builder, "b", TRUE);
+  g_variant_builder_open (&builder, G_VARIANT_TYPE ("a(sv)"));
+  add_bandwidth_max (&builder, "IOReadBandwidthMax", capped ? self->io_device : NULL,
+                     self->read_bandwidth_max);
+  add_bandwidth_max (&builder, "IOWriteBandwidthMax", capped ? self->io_device : NULL,
+                     self->write_bandwidth_max);
+  g_variant_builder_close (&builder);
+
+  if (capped)
+    g_info ("Setting resources on %s (IOReadBandwidthMax: %s %" G_GUINT64_FORMAT ", IOWriteBandwidthMax: %s %" G_GUINT64_FORMAT ")",
+            app->name,
+            self->io_device, self->read_bandwidth_max,
+            self->io_device, self->write_bandwidth_max);
+  else
+    g_info ("Setting resources on %s (IOReadBandwidthMax: -, IOWriteBandwidthMax: -)", app->name);
+
+  g_dbus_proxy_call (self->proxy, "SetUnitProperties",
+                     g_variant_builder_end (&builder), G_DBUS_CALL_FLAGS_NONE,
+                     1000, NULL, set_application_resources_cb, self);
+}
+
+static gboolean
+app_should_be_io_capped (RAppPolicy *self, RAppInfo *app)
+{
+  const RAppRule *rule;
+
+  /* The focused application is not background I/O either. */
+  rule = lookup_rule (self, app);
+  return self->io_device &&
+         g_hash_table_size (self->io_boost_apps) > 0 &&
+         app->boosted == BOOST_NONE &&
+         app->timestamp != -1 &&
+         !(rule && rule->exempt);
+}
+
+static void
+update_app_io_caps (RAppPolicy *self, RAppInfo *app)
+{
+  gboolean capped;
+
+  capped = app_should_be_io_capped (self, app);
+  if (capped != app->io_capped)
+    set_application_io_capped (self, app, capped);
+}
+
+static void
+update_all_app_io_caps (RAppPolicy *self)
+{
+  g_autoptr(GList) apps = NULL;
+  GList *l;
+
+  apps = r_app_monitor_get_apps (self->app_monitor);
+  for (l = apps; l; l = l->next)
+    update_app_io_caps (self, l->data);
+}
+
+/**
+ * update_io_throttle:
+ * @self: RAppPolicy
+ * @app: Application that changed
+ *
+ * While any application is boosted for a game or audio, the I/O bandwidth of
+ * all other (non-boosted, unfocused) applications on the device of the home
+ * directory is capped. The caps are removed when the last boost ends.
+ */
+static void
+update_io_throttle (RAppPolicy *self, RAppInfo *app)
+{
+  gboolean was_active;
+
+  was_active = g_hash_table_size (self->io_boost_apps) > 0;
+
+  if (app->boosted & (BOOST_GAME | BOOST_AUDIO))
+    g_hash_table_add (self->io_boost_apps, g_strdup (app->path));
+  else
+    g_hash_table_remove (self->io_boost_apps, app->path);
+
+  if (was_active == (g_hash_table_size (self->io_boost_apps) > 0))
+    {
+      update_app_io_caps (self, app);
+      return;
+    }
+
+  if (self->io_device)
+    g_info ("%s background I/O throttling", was_active ? "Stopping" : "Starting");
+
+  update_all_app_io_caps (self);
+}
+
+static void
+write_uclamp_min (const gchar *path, gdouble uclamp_min)
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  write_cgroup_attribute (path, "cpu.uclamp.min",
+                          g_ascii_formatd (buf, sizeof (buf), "%.2f", uclamp_min));
+}
+
+/**
+ * set_uclamp_parents:
+ * @self: RAppPolicy
+ * @uclamp_min: New floor for all raised ancestors
+ *
+ * The effective cpu.uclamp.min of a cgroup is capped by its ancestors, so
+ * slices below the user manager are raised to the largest configured floor.
+ * Slices have no processes of their own, this does not affect anything else.
+ * A floor of 0 restores and forgets all raised ancestors.
+ */
+static void
+set_uclamp_parents (RAppPolicy *self, gdouble uclamp_min)
+{
+  GHashTableIter iter;
+  gpointer path;
+
+  g_hash_table_iter_init (&iter, self->uclamp_parents);
+  while (g_hash_table_iter_next (&iter, &path, NULL))
+    write_uclamp_min (path, uclamp_min);
+
+  if (uclamp_min <= 0)
+    g_hash_table_remove_all (self->uclamp_parents);
+}
+
+/**
+ * set_application_uclamp_min:
+ * @self: RAppPolicy
+ * @app: Application
+ * @uclamp_min: Minimum utilisation in percent, 0 to remove the floor
+ *
+ * Boosted applications can get a utilisation clamp so that the CPU does not
+ * stay at a low frequency while they run. systemd does not expose uclamp as
+ * a unit property, so cgroupfs is written directly. The ancestors up to the
+ * user manager are delegated to the user, the system daemon raises the ones
+ * above.
+ */
+static void
+set_application_uclamp_min (RAppPolicy *self, RAppInfo *app, gdouble uclamp_min)
+{
+  g_autofree gchar *parent = NULL;
+
+  g_info ("Setting resources on %s (CPUUClampMin: %.2f)", app->name, uclamp_min);
+
+  if (uclamp_min > 0)
+    {
+      parent = g_path_get_dirname (app->path);
+      while (g_str_has_suffix (parent, ".slice"))
+        {
+          gchar *next;
+
+          if (!g_hash_table_contains (self->uclamp_parents, parent))
+            {
+              write_uclamp_min (parent, self->max_uclamp_min);
+              g_hash_table_add (self->uclamp_parents, g_strdup (parent));
+            }
+
+          next = g_path_get_dirname (parent);
+          g_free (parent);
+          parent = next;
+        }
+    }
+
+  write_uclamp_min (app->path, uclamp_min);
+  app->uclamp_min = uclamp_min;
+}
+
+typedef struct
+{
+  gchar   *path;
+  gboolean frozen;
+} FreezeData;
+
+static void
+freeze_application_cb (GObject *source_object, GAsyncResult *res,
+                       gpointer user_data)
+{
+  GDBusProxy *proxy = G_DBUS_PROXY (source_object);
+  FreezeData *data = user_data;
+
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) var = NULL;
+
+  var = g_dbus_proxy_call_finish (proxy, res, &error);
+  if (error)
+    {
+      /* systemd before v246 has no FreezeUnit/ThawUnit. */
+      if (g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+        write_cgroup_attribute (data->path, "cgroup.freeze", data->frozen ? "1" : "0");
+      else
+        g_debug ("Failed to %s app: %s", data->frozen ? "freeze" : "thaw", error->message);
+    }
+
+  g_free (data->path);
+  g_free (data);
+}
+
+static void
+set_application_frozen (RAppPolicy *self, RAppInfo *app, gboolean frozen)
+{
+  FreezeData *data;
+
+  app->frozen = frozen;
+
+  g_info ("%s %s", frozen ? "Freezing" : "Thawing", app->name);
+
+  if (!self->proxy)
+    {
+      write_cgroup_attribute (app->path, "cgroup.freeze", frozen ? "1" : "0");
+      return;
+    }
+
+  data = g_new0 (FreezeData, 1);
+  data->path = g_strdup (app->path);
+  data->frozen = frozen;
+
+  g_dbus_proxy_call (self->proxy, frozen ? "FreezeUnit" : "ThawUnit",
+                     g_variant_new ("(s)", app->name), G_DBUS_CALL_FLAGS_NONE,
+                     1000, NULL, freeze_application_cb, data);
+}
+
+/**
+ * get_freeze_deadline:
+ * @self: RAppPolicy
+ * @app: Application
+ *
+ * Focused and boosted (e.g. audio or game) applications as well as those on
+ * the allowlist are never frozen.
+ *
+ * Returns: The monotonic time at which the application is frozen, or
+ *          G_MAXINT64 if it currently never will be
+ */
+static gint64
+get_freeze_deadline (RAppPolicy *self, RAppInfo *app)
+{
+  if (self->freeze_after_usec <= 0 || app->timestamp == -1 || app->boosted != BOOST_NONE)
+    return G_MAXINT64;
+
+  if (r_app_rules_lookup (self->freeze_allowlist, app->name))
+    return G_MAXINT64;
+
+  return app->timestamp + self->freeze_after_usec;
+}
+
+#define RULE_VALUE(rule, field, fallback) \
+  (((rule) && (rule)->field != R_APP_RULE_UNSET) ? (rule)->field : (fallback))
+
+/**
+ * get_idle_deadline:
+ * @self: RAppPolicy
+ * @app: Application
+ * @rule: (nullable): Matching application rule
+ *
+ * Returns: The monotonic time at which the application enters the idle
+ *          tier, or G_MAXINT64 if it currently never will
+ */
+static gint64
+get_idle_deadline (RAppPolicy *self, RAppInfo *app, const RAppRule *rule)
+{
+  gint64 idle_after_usec;
+
+  if (app->timestamp == -1 || app->boosted != BOOST_NONE)
+    return G_MAXINT64;
+
+  if (rule && rule->idle_after_sec != R_APP_RULE_UNSET)
+    idle_after_usec = (gint64) rule->idle_after_sec * G_USEC_PER_SEC;
+  else
+    idle_after_usec = self->idle_after_usec;
+
+  if (idle_after_usec <= 0)
+    return G_MAXINT64;
+
+  return app->timestamp + idle_after_usec;
+}
+
+/**
+ * get_decay_tier:
+ * @self: RAppPolicy
+ * @app: Application
+ * @now: Current monotonic time
+ * @next_deadline: (out): Time at which the next tier is reached, or
+ *                 G_MAXINT64
+ *
+ * Boosted applications do not decay, like they are never idle or frozen.
+ *
+ * Returns: (nullable): The decay tier the inactive application is in
+ */
+static const RDecayTier *
+get_decay_tier (RAppPolicy *self, RAppInfo *app, gint64 now, gint64 *next_deadline)
+{
+  const RDecayTier *tier = NULL;
+  gint64 age;
+  guint i;
+
+  *next_deadline = G_MAXINT64;
+
+  if (app->timestamp == -1 || app->boosted != BOOST_NONE)
+    return NULL;
+
+  age = now - app->timestamp;
+  for (i = 0; i < self->decay_tiers->len; i++)
+    {
+      const RDecayTier *t = &g_array_index (self->decay_tiers, RDecayTier, i);
+
+      if (t->after_usec > age)
+        {
+          *next_deadline = app->timestamp + t->after_usec;
+          break;
+        }
+
+      tier = t;
+    }
+
+  return tier;
+}
+
+static gboolean update_app (RAppPolicy *policy,
+                            RAppInfo   *app,
+                            gboolean    force);
+
+/**
+ * tier_timer_cb:
+ * @key: Application path
+ * @user_data: RAppPolicy
+ *
+ * All tier transitions (decay and idle) share one timer wheel, so the cost
+ * stays flat no matter how many applications are open.
+ */
+static void
+tier_timer_cb (const gchar *key, gpointer user_data)
+{
+  RAppPolicy *self = R_APP_POLICY (user_data);
+  RAppInfo *app;
+
+  app = r_app_monitor_lookup_app (self->app_monitor, key);
+  if (!app)
+    return;
+
+  g_debug ("App %s reached its next inactivity tier", app->name);
+  update_app (self, app, FALSE);
+}
+
+/* Multiple boosts do not add up, the largest increment wins. */
+static gint
+get_boost_inc (const gint *incs, AppBoostFlags boosted)
+{
+  gint inc = 0;
+  guint i;
+
+  for (i = 0; i < BOOST_N_FLAGS; i++)
+    {
+      if (boosted & (1 << i))
+        inc = MAX (inc, incs[i]);
+    }
+
+  return inc;
+}
+
+static gdouble
+get_boost_uclamp_min (RAppPolicy *policy, AppBoostFlags boosted)
+{
+  gdouble uclamp_min = 0;
+  guint i;
+
+  for (i = 0; i < BOOST_N_FLAGS; i++)
+    {
+      if (boosted & (1 << i))
+        uclamp_min = MAX (uclamp_min, policy->boost_uclamp_mins[i]);
+    }
+
+  return uclamp_min;
+}
+
+static void
+get_app_weights (RAppPolicy       *policy,
+                 RAppInfo         *app,
+                 const RAppRule   *rule,
+                 const RDecayTier *tier,
+                 guint64          *cpu_weight,
+                 guint64          *io_weight)
+{
+  if (app->timestamp == -1)
+    {
+      *cpu_weight = RULE_VALUE (rule, active_cpu_weight, policy->active_cpu_weight);
+      *io_weight = RULE_VALUE (rule, active_io_weight, policy->active_io_weight);
+    }
+  else
+    {
+      *cpu_weight = policy->default_cpu_weight;
+      *io_weight = policy->default_io_weight;
+      if (tier && tier->cpu_weight > 0)
+        *cpu_weight = tier->cpu_weight;
+      if (tier && tier->io_weight > 0)
+        *io_weight = tier->io_weight;
+
+      *cpu_weight = RULE_VALUE (rule, default_cpu_weight, *cpu_weight);
+      *io_weight = RULE_VALUE (rule, default_io_weight, *io_weight);
+    }
+
+  if (app->boosted != 0)
+    {
+      *cpu_weight += RULE_VALUE (rule, boost_cpu_weight_inc,
+                                 get_boost_inc (policy->boost_cpu_weight_incs, app->boosted));
+      *io_weight += RULE_VALUE (rule, boost_io_weight_inc,
+                                get_boost_inc (policy->boost_io_weight_incs, app->boosted));
+      *cpu_weight = MIN (*cpu_weight, 10000);
+      *io_weight = MIN (*io_weight, 10000);
+    }
+}
+
+/**
+ * update_app_allocation:
+ * @policy: RAppPolicy
+ * @app: Application
+ * @force: Push the allocation even if it did not change
+ *
+ * Recomputes the allocation of an application and pushes it to systemd.
+ *
+ * Returns: %TRUE if anything was pushed
+ */
+static gboolean
+update_app_allocation (RAppPolicy *policy, RAppInfo *app, gboolean force)
+{
+  const RAppRule *rule;
+  const RDecayTier *tier;
+  gboolean was_idle;
+  gboolean should_freeze;
+  gboolean changed = FALSE;
+  gint64 idle_deadline;
+  gint64 tier_deadline;
+  gint64 freeze_deadline;
+  gint64 next_deadline = G_MAXINT64;
+  gint64 now;
+  guint64 cpu_weight;
+  guint64 io_weight;
+  gdouble uclamp_min;
+
+  rule = lookup_rule (policy, app);
+  if (rule && rule->exempt)
+    {
+      g_debug ("App %s is exempt by rule %s", app->name, rule->pattern);
+      r_timer_wheel_cancel (policy->tier_wheel, app->path);
+
+      /* The app may have become exempt through a reload, undo everything
+       * that was applied before (100 is the systemd default weight).
+       * Weights are only reset if they were ever set, untouched units stay
+       * untouched. */
+      if (app->frozen)
+        {
+          set_application_frozen (policy, app, FALSE);
+          changed = TRUE;
+        }
+
+      if (app->idle)
+        {
+          app->idle = FALSE;
+          set_application_idle (app, FALSE);
+          changed = TRUE;
+        }
+
+      if (app->weights_set && (app->cpu_weight != 100 || app->io_weight != 100))
+        {
+          app->cpu_weight = 100;
+          app->io_weight = 100;
+          if (policy->proxy)
+            set_application_resources (policy, app);
+          changed = TRUE;
+        }
+
+      if (app->uclamp_min != 0)
+        {
+          set_application_uclamp_min (policy, app, 0);
+          changed = TRUE;
+        }
+
+      update_game_isolation (policy, app);
+      update_io_throttle (policy, app);
+
+      return changed;
+    }
 
   /*
    * Timestamp is used for determining if an application's window is focused.
    * `boosted` is used by other sources like audio or games, to give an additional
    * boost irrespective of the application being focused.
+   * Inactive applications decay through the configured tiers and, after
+   * IdleAfterSec, are moved into the idle tier until they are focused or
+   * boosted again. If enabled, they are frozen after FreezeAfterSec.
+   * A matching [AppRule] overrides any of the global values, a rule setting
+   * the default weight pins it (i.e. it does not decay).
    */
-  app->cpu_weight = (app->timestamp == -1) ? policy->active_cpu_weight : policy->default_cpu_weight;
-  app->io_weight = (app->timestamp == -1) ? policy->active_io_weight : policy->default_io_weight;
-  if (app->boosted != 0)
+  now = g_get_monotonic_time ();
+
+  /* Thaw right away, before anything else is pushed. */
+  freeze_deadline = get_freeze_deadline (policy, app);
+  should_freeze = freeze_deadline <= now;
+  if (app->frozen && !should_freeze)
+    {
+      set_application_frozen (policy, app, FALSE);
+      changed = TRUE;
+    }
+
+  was_idle = app->idle;
+  idle_deadline = get_idle_deadline (policy, app, rule);
+  app->idle = idle_deadline <= now;
+  tier = get_decay_tier (policy, app, now, &tier_deadline);
+
+  if (idle_deadline > now)
+    next_deadline = MIN (next_deadline, idle_deadline);
+  if (!app->idle)
+    next_deadline = MIN (next_deadline, tier_deadline);
+  if (freeze_deadline > now)
+    next_deadline = MIN (next_deadline, freeze_deadline);
+
+  if (next_deadline != G_MAXINT64)
+    r_timer_wheel_schedule (policy->tier_wheel, app->path, next_deadline);
+  else
+    r_timer_wheel_cancel (policy->tier_wheel, app->path);
+
+  if (app->idle)
+    {
+      if (!was_idle)
+        {
+          set_application_idle (app, TRUE);
+          changed = TRUE;
+        }
+    }
+  else
+    {
+      if (was_idle)
+        set_application_idle (app, FALSE);
+
+      get_app_weights (policy, app, rule, tier, &cpu_weight, &io_weight);
+
+      if (force || was_idle || app->cpu_weight != cpu_weight || app->io_weight != io_weight)
+        {
+          app->cpu_weight = cpu_weight;
+          app->io_weight = io_weight;
+
+          if (policy->proxy)
+            set_application_resources (policy, app);
+          changed = TRUE;
+        }
+    }
+
+  uclamp_min = get_boost_uclamp_min (policy, app->boosted);
+  if (uclamp_min != app->uclamp_min)
+    {
+      set_application_uclamp_min (policy, app, uclamp_min);
+      changed = TRUE;
+    }
+
+  update_game_isolation (policy, app);
+  update_io_throttle (policy, app);
+
+  if (should_freeze && !app->frozen)
+    {
+      set_application_frozen (policy, app, TRUE);
+      changed = TRUE;
+    }
+
+  return changed;
+}
+
+/* Emits "app-updated" whenever the state of the application may have changed,
+ * a forced update means the monitor changed the application. */
+static gboolean
+update_app (RAppPolicy *policy, RAppInfo *app, gboolean force)
+{
+  gboolean changed;
+
+  changed = update_app_allocation (policy, app, force);
+  if (changed || force)
+    g_signal_emit_by_name (policy, "app-updated", app);
+
+  return changed;
+}
+
+static void
+app_info_changed (gpointer *data, gpointer arg, G_GNUC_UNUSED GObject *object)
+{
+  RAppPolicy *policy = R_APP_POLICY (data);
+  RAppInfo *app = (RAppInfo *) arg;
+
+  g_debug ("App Info changed: %s", app->name);
+  g_debug ("Timestamp: %ld, Boosted: %d", app->timestamp, (int) app->boosted);
+
+  update_app (policy, app, TRUE);
+}
+
+static void
+app_removed (gpointer *data, gpointer arg, G_GNUC_UNUSED GObject *object)
+{
+  RAppPolicy *policy = R_APP_POLICY (data);
+  RAppInfo *app = (RAppInfo *) arg;
+
+  r_timer_wheel_cancel (policy->tier_wheel, app->path);
+
+  /* A game exited without being unregistered first. */
+  app->confined = FALSE;
+  if (g_hash_table_remove (policy->game_apps, app->path) &&
+      g_hash_table_size (policy->game_apps) == 0)
     {
-      app->cpu_weight += policy->boost_cpu_weight_inc;
-      app->io_weight += policy->boost_io_weight_inc;
+      g_info ("Stopping game isolation");
+      update_all_app_cpus (policy);
     }
 
-  if (policy->proxy)
-    set_application_resources (policy, app);
+  app->io_capped = FALSE;
+  if (g_hash_table_remove (policy->io_boost_apps, app->path) &&
+      g_hash_table_size (policy->io_boost_apps) == 0)
+    {
+      g_info ("Stopping background I/O throttling");
+      update_all_app_io_caps (policy);
+    }
 }
 
 static inline void
@@ -127,12 +1010,82 @@ set_integer_from_key_file (GKeyFile *file,
   *out = value;
 }
 
+static guint64
+get_size_from_key_file (GKeyFile    *file,
+                        const gchar *group,
+                        const gchar *key)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *value = NULL;
+  guint64 size;
+
+  value = g_key_file_get_string (file, group, key, NULL);
+  if (!value)
+    return 0;
+
+  size = parse_size (value, 0, &error);
+  if (error)
+    g_warning ("Could not parse key %s in group %s: %s", key, group, error->message);
+
+  return size;
+}
+
+static gint
+decay_tier_cmp (gconstpointer a, gconstpointer b)
+{
+  const RDecayTier *ta = a;
+  const RDecayTier *tb = b;
+
+  return (ta->after_usec > tb->after_usec) - (ta->after_usec < tb->after_usec);
+}
+
+static void
+read_decay_tiers (RAppPolicy *self, GKeyFile *file)
+{
+  g_autofree gint *after = NULL;
+  g_autofree gint *cpu = NULL;
+  g_autofree gint *io = NULL;
+  gsize n_after = 0, n_cpu = 0, n_io = 0;
+  gsize i;
+
+  after = g_key_file_get_integer_list (file, "AppBoost", "DecayAfterSec", &n_after, NULL);
+  if (!after)
+    return;
+
+  cpu = g_key_file_get_integer_list (file, "AppBoost", "DecayCPUWeight", &n_cpu, NULL);
+  io = g_key_file_get_integer_list (file, "AppBoost", "DecayIOWeight", &n_io, NULL);
+
+  if ((cpu && n_cpu != n_after) || (io && n_io != n_after))
+    {
+      g_warning ("DecayCPUWeight and DecayIOWeight need one entry per DecayAfterSec entry, ignoring decay tiers");
+      return;
+    }
+
+  for (i = 0; i < n_after; i++)
+    {
+      RDecayTier tier;
+
+      tier.after_usec = (gint64) MAX (after[i], 0) * G_USEC_PER_SEC;
+      /* 0 keeps the default weight */
+      tier.cpu_weight = cpu ? CLAMP (cpu[i], 0, 10000) : 0;
+      tier.io_weight = io ? CLAMP (io[i], 0, 10000) : 0;
+
+      g_array_append_val (self->decay_tiers, tier);
+    }
+
+  g_array_sort (self->decay_tiers, decay_tier_cmp);
+}
+
 static void
 read_config (RAppPolicy *self)
 {
   g_autoptr(GKeyFile) file = NULL;
-  g_autoptr(GError) error = NULL;
-  g_autofree char *user_config_path = NULL;
+  g_auto(GStrv) freeze_allowlist = NULL;
+  gchar **pattern;
+  guint i;
+  gint idle_after_sec = 0;
+  gint freeze_after_sec = 0;
+  gint background_cores = 2;
 
   self->default_cpu_weight = 100;
   self->default_io_weight = 100;
@@ -140,20 +1093,40 @@ read_config (RAppPolicy *self)
   self->active_io_weight = 100;
   self->boost_cpu_weight_inc = 0;
   self->boost_io_weight_inc = 0;
+  for (i = 0; i < BOOST_N_FLAGS; i++)
+    {
+      self->boost_cpu_weight_incs[i] = 0;
+      self->boost_io_weight_incs[i] = 0;
+      self->boost_uclamp_mins[i] = 0;
+    }
+  self->max_uclamp_min = 0;
+  self->idle_after_usec = 0;
+  self->freeze_after_usec = 0;
+  g_array_set_size (self->decay_tiers, 0);
+  g_clear_pointer (&self->background_cpus, g_bytes_unref);
+  g_clear_pointer (&self->background_cpu_list, g_free);
+  g_clear_pointer (&self->io_device, g_free);
+  self->read_bandwidth_max = 0;
+  self->write_bandwidth_max = 0;
+  g_clear_pointer (&self->freeze_allowlist, r_app_rules_free);
+  self->freeze_allowlist = r_app_rules_new ();
 
   file = g_key_file_new ();
-  user_config_path = g_strdup_printf ("%s/uresourced.conf", g_get_user_config_dir ());
-
-  if (!g_key_file_load_from_file (file, user_config_path, G_KEY_FILE_NONE, NULL))
+  if (self->static_config)
     {
-      g_debug ("Could not read %s, trying default location", user_config_path);
+      g_autoptr(GError) error = NULL;
+
+      if (!self->config_path)
+        goto out;
 
-      if (!g_key_file_load_from_file (file, SYSCONFDIR "/uresourced.conf", G_KEY_FILE_NONE, &error))
+      if (!g_key_file_load_from_file (file, self->config_path, G_KEY_FILE_NONE, &error))
         {
-          g_warning ("Could not read default configuration file: %s", error->message);
+          g_warning ("Could not read configuration file: %s", error->message);
           goto out;
         }
     }
+  else if (!load_user_config (file))
+    goto out;
 
   set_integer_from_key_file (file, "AppBoost", "DefaultCPUWeight", &self->default_cpu_weight);
   self->default_cpu_weight = CLAMP (self->default_cpu_weight, 1, 10000);
@@ -173,7 +1146,77 @@ read_config (RAppPolicy *self)
   set_integer_from_key_file (file, "AppBoost", "BoostIOWeightInc", &self->boost_io_weight_inc);
   self->boost_io_weight_inc = CLAMP (self->boost_io_weight_inc, 0, 10000 - self->active_io_weight);
 
+  for (i = 0; i < BOOST_N_FLAGS; i++)
+    {
+      g_autofree char *cpu_key = g_strdup_printf ("Boost%sCPUWeightInc", boost_flag_names[i]);
+      g_autofree char *io_key = g_strdup_printf ("Boost%sIOWeightInc", boost_flag_names[i]);
+      g_autofree char *uclamp_key = g_strdup_printf ("Boost%sUClampMin", boost_flag_names[i]);
+
+      self->boost_cpu_weight_incs[i] = self->boost_cpu_weight_inc;
+      self->boost_io_weight_incs[i] = self->boost_io_weight_inc;
+
+      /* An escalation after xruns should be stronger than a normal boost. */
+      if ((1 << i) == BOOST_XRUN)
+        {
+          self->boost_cpu_weight_incs[i] *= 2;
+          self->boost_io_weight_incs[i] *= 2;
+        }
+
+      set_integer_from_key_file (file, "AppBoost", cpu_key, &self->boost_cpu_weight_incs[i]);
+      self->boost_cpu_weight_incs[i] = CLAMP (self->boost_cpu_weight_incs[i], 0, 10000 - self->active_cpu_weight);
+
+      set_integer_from_key_file (file, "AppBoost", io_key, &self->boost_io_weight_incs[i]);
+      self->boost_io_weight_incs[i] = CLAMP (self->boost_io_weight_incs[i], 0, 10000 - self->active_io_weight);
+
+      self->boost_uclamp_mins[i] = CLAMP (g_key_file_get_double (file, "AppBoost", uclamp_key, NULL), 0, 100);
+      self->max_uclamp_min = MAX (self->max_uclamp_min, self->boost_uclamp_mins[i]);
+    }
+
+  set_integer_from_key_file (file, "AppBoost", "IdleAfterSec", &idle_after_sec);
+  self->idle_after_usec = (gint64) MAX (idle_after_sec, 0) * G_USEC_PER_SEC;
+
+  read_decay_tiers (self, file);
+
+  set_integer_from_key_file (file, "AppFreeze", "FreezeAfterSec", &freeze_after_sec);
+  self->freeze_after_usec = (gint64) MAX (freeze_after_sec, 0) * G_USEC_PER_SEC;
+
+  freeze_allowlist = g_key_file_get_string_list (file, "AppFreeze", "Allowlist", NULL, NULL);
+  for (pattern = freeze_allowlist; pattern && *pattern; pattern++)
+    r_app_rules_add_pattern (self->freeze_allowlist, *pattern);
+
+  if (g_key_file_get_boolean (file, "GameBoost", "Isolate", NULL))
+    {
+      g_autoptr(GArray) cpus = NULL;
+
+      set_integer_from_key_file (file, "GameBoost", "BackgroundCores", &background_cores);
+      cpus = r_cpu_topology_pick_cores (MAX (background_cores, 1));
+      if (cpus)
+        {
+          self->background_cpus = r_cpu_mask_new (cpus);
+          self->background_cpu_list = r_cpu_list_format (cpus);
+        }
+      else
+        {
+          g_warning ("Cannot isolate games, could not pick %d background cores", background_cores);
+        }
+    }
+
+  self->read_bandwidth_max = get_size_from_key_file (file, "BackgroundIO", "ReadBandwidthMax");
+  self->write_bandwidth_max = get_size_from_key_file (file, "BackgroundIO", "WriteBandwidthMax");
+  if (self->read_bandwidth_max > 0 || self->write_bandwidth_max > 0)
+    {
+      self->io_device = g_key_file_get_string (file, "BackgroundIO", "Device", NULL);
+      if (!self->io_device)
+        self->io_device = get_block_device_for_path (g_get_home_dir ());
+      if (!self->io_device)
+        g_warning ("Cannot throttle background I/O, could not find the device of %s",
+                   g_get_home_dir ());
+    }
+
 out:
+  g_clear_pointer (&self->rules, r_app_rules_free);
+  self->rules = r_app_rules_new_from_key_file (file);
+
   g_info ("CPU Configuration: Default CPUWeight: %d, Active CPUWeight: %d, Boost CPUWeight: %d",
           self->default_cpu_weight,
           self->active_cpu_weight,
@@ -182,23 +1225,172 @@ out:
           self->default_io_weight,
           self->active_io_weight,
           self->boost_io_weight_inc);
+  for (i = 0; i < BOOST_N_FLAGS; i++)
+    g_info ("%s Boost: CPUWeight increment: %d, IOWeight increment: %d, CPU UClampMin: %.2f",
+            boost_flag_names[i],
+            self->boost_cpu_weight_incs[i],
+            self->boost_io_weight_incs[i],
+            self->boost_uclamp_mins[i]);
+  g_info ("Idle Configuration: Idle after: %" G_GINT64_FORMAT "s, %u decay tiers",
+          self->idle_after_usec / G_USEC_PER_SEC,
+          self->decay_tiers->len);
+  g_info ("Freeze Configuration: Freeze after: %" G_GINT64_FORMAT "s, %u allowlisted patterns",
+          self->freeze_after_usec / G_USEC_PER_SEC,
+          r_app_rules_get_n_rules (self->freeze_allowlist));
+  g_info ("Background I/O: device: %s, ReadBandwidthMax: %" G_GUINT64_FORMAT ", WriteBandwidthMax: %" G_GUINT64_FORMAT,
+          self->io_device ? self->io_device : "disabled",
+          self->read_bandwidth_max,
+          self->write_bandwidth_max);
+  g_info ("Game isolation: background CPUs: %s",
+          self->background_cpu_list ? self->background_cpu_list : "disabled");
+  g_info ("Loaded %u application rules", r_app_rules_get_n_rules (self->rules));
+}
+
+/**
+ * r_app_policy_reload:
+ * @self: RAppPolicy
+ *
+ * Re-reads the configuration and pushes new allocations for the
+ * applications whose allocation changed.
+ */
+void
+r_app_policy_reload (RAppPolicy *self)
+{
+  g_autoptr(GList) apps = NULL;
+  g_autoptr(GBytes) old_background_cpus = NULL;
+  g_autofree gchar *old_io_device = NULL;
+  guint64 old_read_bandwidth_max, old_write_bandwidth_max;
+  gboolean cpus_changed, io_device_changed, io_limits_changed;
+  guint updated = 0;
+  GList *l;
+
+  g_clear_handle_id (&self->config_reload_id, g_source_remove);
+
+  g_message ("Reloading configuration");
+  old_background_cpus = self->background_cpus ? g_bytes_ref (self->background_cpus) : NULL;
+  old_io_device = g_strdup (self->io_device);
+  old_read_bandwidth_max = self->read_bandwidth_max;
+  old_write_bandwidth_max = self->write_bandwidth_max;
+  read_config (self);
+
+  cpus_changed = (old_background_cpus == NULL) != (self->background_cpus == NULL) ||
+                 (old_background_cpus && !g_bytes_equal (old_background_cpus, self->background_cpus));
+  io_device_changed = g_strcmp0 (old_io_device, self->io_device) != 0;
+  io_limits_changed = old_read_bandwidth_max != self->read_bandwidth_max ||
+                      old_write_bandwidth_max != self->write_bandwidth_max;
+
+  /* Re-armed as needed while updating the applications. */
+  r_timer_wheel_clear (self->tier_wheel);
+  set_uclamp_parents (self, self->max_uclamp_min);
+
+  apps = r_app_monitor_get_apps (self->app_monitor);
+  for (l = apps; l; l = l->next)
+    {
+      RAppInfo *app = l->data;
+
+      /* Confined apps need the new background CPUs, with one call. */
+      if (cpus_changed && app->confined)
+        set_application_allowed_cpus (self, app, app_should_be_confined (self, app));
+
+      /* Lifting the caps also drops the limits on the old device. */
+      if (io_device_changed && app->io_capped)
+        set_application_io_capped (self, app, FALSE);
+      else if (io_limits_changed && app->io_capped)
+        set_application_io_capped (self, app, app_should_be_io_capped (self, app));
+
+      if (update_app (self, app, FALSE))
+        updated++;
+    }
+
+  g_message ("Configuration reloaded, updated %u of %u applications",
+             updated, g_list_length (apps));
+}
+
+static gboolean
+config_reload_cb (gpointer user_data)
+{
+  RAppPolicy *self = R_APP_POLICY (user_data);
+
+  self->config_reload_id = 0;
+  r_app_policy_reload (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+config_file_changed_cb (G_GNUC_UNUSED GFileMonitor *monitor,
+                        G_GNUC_UNUSED GFile        *file,
+                        G_GNUC_UNUSED GFile        *other_file,
+                        GFileMonitorEvent           event_type,
+                        gpointer                    user_data)
+{
+  RAppPolicy *self = R_APP_POLICY (user_data);
+
+  if (event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+      event_type != G_FILE_MONITOR_EVENT_CREATED &&
+      event_type != G_FILE_MONITOR_EVENT_DELETED &&
+      event_type != G_FILE_MONITOR_EVENT_MOVED_IN &&
+      event_type != G_FILE_MONITOR_EVENT_RENAMED)
+    return;
+
+  /* Editors tend to generate several events, wait for things to settle. */
+  g_clear_handle_id (&self->config_reload_id, g_source_remove);
+  self->config_reload_id = g_timeout_add (200, config_reload_cb, self);
+}
+
+static GFileMonitor *
+monitor_config_file (RAppPolicy *self, const char *path)
+{
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+  GFileMonitor *monitor;
+
+  file = g_file_new_for_path (path);
+  monitor = g_file_monitor_file (file, G_FILE_MONITOR_WATCH_MOVES, NULL, &error);
+  if (!monitor)
+    {
+      g_debug ("Could not monitor %s: %s", path, error->message);
+      return NULL;
+    }
+
+  g_signal_connect_object (monitor, "changed", G_CALLBACK (config_file_changed_cb),
+                           self, 0);
+
+  return monitor;
 }
 
 void
 r_app_policy_start (RAppPolicy *self, RAppMonitor *monitor)
 {
+  g_autofree char *user_config_path = NULL;
+
   self->app_monitor = monitor;
 
   read_config (self);
 
   g_signal_connect_object (monitor, "changed", G_CALLBACK (app_info_changed),
                            self, G_CONNECT_SWAPPED);
+  g_signal_connect_object (monitor, "removed", G_CALLBACK (app_removed),
+                           self, G_CONNECT_SWAPPED);
+
+  if (self->static_config)
+    return;
+
+  user_config_path = g_strdup_printf ("%s/uresourced.conf", g_get_user_config_dir ());
+  self->user_config_monitor = monitor_config_file (self, user_config_path);
+  self->config_monitor = monitor_config_file (self, SYSCONFDIR "/uresourced.conf");
 }
 
 void
 r_app_policy_stop (RAppPolicy *self)
 {
+  g_clear_object (&self->user_config_monitor);
+  g_clear_object (&self->config_monitor);
+  g_clear_handle_id (&self->config_reload_id, g_source_remove);
+
   r_app_monitor_reset_all_apps (self->app_monitor);
+  r_timer_wheel_clear (self->tier_wheel);
+  set_uclamp_parents (self, 0);
 
   g_dbus_connection_flush_sync (g_dbus_proxy_get_connection (self->proxy),
                                 NULL, NULL);
@@ -233,17 +1425,22 @@ r_app_policy_class_init (RAppPolicyClass *klass)
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
   object_class->finalize = r_app_policy_finalize;
+
+  /* Emitted with the RAppInfo after its allocation was updated */
+  g_signal_new ("app-updated",
+                R_TYPE_APP_POLICY, G_SIGNAL_RUN_LAST,
+                0,
+                NULL, NULL,
+                NULL,
+                G_TYPE_NONE, 1, G_TYPE_POINTER);
 }
 
 static void
 r_app_policy_init (RAppPolicy *self)
 {
-  g_dbus_proxy_new_for_bus (G_BUS_TYPE_SESSION,
-                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES
-                            | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS
-                            | G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
-                            NULL, "org.freedesktop.systemd1",
-                            "/org/freedesktop/systemd1",
-                            "org.freedesktop.systemd1.Manager", NULL,
-                            systemd_bus_proxy_ready_cb, self);
+  self->decay_tiers = g_array_new (FALSE, FALSE, sizeof (RDecayTier));
+  self->tier_wheel = r_timer_wheel_new (TIER_WHEEL_TICK_MS, tier_timer_cb, self);
+  self->uclamp_parents = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->game_apps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->io_boost_apps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 }
@@ -2,7 +2,7 @@
 
 #pragma once
 
-#include <glib-object.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
@@ -11,9 +11,12 @@ G_BEGIN_DECLS
 G_DECLARE_FINAL_TYPE (RAppPolicy, r_app_policy, R, APP_POLICY, GObject)
 
 RAppPolicy *r_app_policy_new (void);
+RAppPolicy *r_app_policy_new_for_connection (GDBusConnection *connection,
+                                             const gchar     *config_path);
 
 void r_app_policy_start (RAppPolicy  *self,
                          RAppMonitor *monitor);
 void r_app_policy_stop (RAppPolicy *self);
+void r_app_policy_reload (RAppPolicy *self);
 
 G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,346 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <string.h>
+
+#include "r-app-rules.h"
+
+/* Matching against generic globs is linear in the number of glob rules, so
+ * results are cached by unit name. Scope names contain a random part, the
+ * cache is simply dropped when it grows beyond this size. */
+#define RULE_CACHE_MAX_SIZE 1024
+
+typedef struct _TrieNode TrieNode;
+
+struct _TrieNode
+{
+  gchar     c;
+  TrieNode *child;
+  TrieNode *sibling;
+  RAppRule *rule;
+};
+
+struct _RAppRules
+{
+  GPtrArray  *rules;
+  GHashTable *exact;
+  TrieNode   *prefixes;
+  GPtrArray  *globs;
+  GPtrArray  *glob_rules;
+  GHashTable *cache;
+};
+
+static RAppRule no_match;
+
+static void
+rule_free (RAppRule *rule)
+{
+  g_free (rule->pattern);
+  g_free (rule);
+}
+
+static void
+trie_free (TrieNode *node)
+{
+  while (node)
+    {
+      TrieNode *sibling = node->sibling;
+
+      trie_free (node->child);
+      g_free (node);
+      node = sibling;
+    }
+}
+
+static void
+trie_insert (TrieNode *root, const gchar *prefix, gsize len, RAppRule *rule)
+{
+  TrieNode *node = root;
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    {
+      TrieNode *child;
+
+      for (child = node->child; child; child = child->sibling)
+        if (child->c == prefix[i])
+          break;
+
+      if (!child)
+        {
+          child = g_new0 (TrieNode, 1);
+          child->c = prefix[i];
+          child->sibling = node->child;
+          node->child = child;
+        }
+
+      node = child;
+    }
+
+  /* The first rule for a given prefix wins. */
+  if (!node->rule)
+    node->rule = rule;
+}
+
+/* Returns the rule with the longest matching prefix. */
+static RAppRule *
+trie_lookup (TrieNode *root, const gchar *name)
+{
+  TrieNode *node = root;
+  RAppRule *match = root->rule;
+  const gchar *p;
+
+  for (p = name; *p; p++)
+    {
+      TrieNode *child;
+
+      for (child = node->child; child; child = child->sibling)
+        if (child->c == *p)
+          break;
+
+      if (!child)
+        break;
+
+      node = child;
+      if (node->rule)
+        match = node->rule;
+    }
+
+  return match;
+}
+
+static gint
+get_rule_integer (GKeyFile    *file,
+                  const gchar *group,
+                  const gchar *key,
+                  gint         min,
+                  gint         max)
+{
+  g_autoptr(GError) error = NULL;
+  gint value;
+
+  value = g_key_file_get_integer (file, group, key, &error);
+  if (error)
+    {
+      if (!g_error_matches (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND))
+        g_warning ("Could not parse key %s in group %s: %s", key, group, error->message);
+      return R_APP_RULE_UNSET;
+    }
+
+  return CLAMP (value, min, max);
+}
+
+static RAppRule *
+rule_new_from_group (GKeyFile *file, const gchar *group)
+{
+  RAppRule *rule;
+
+  rule = g_new0 (RAppRule, 1);
+  rule->pattern = g_strstrip (g_strdup (group + strlen (R_APP_RULE_GROUP_PREFIX)));
+  rule->exempt = g_key_file_get_boolean (file, group, "Exempt", NULL);
+  rule->default_cpu_weight = get_rule_integer (file, group, "DefaultCPUWeight", 1, 10000);
+  rule->default_io_weight = get_rule_integer (file, group, "DefaultIOWeight", 1, 10000);
+  rule->active_cpu_weight = get_rule_integer (file, group, "ActiveCPUWeight", 1, 10000);
+  rule->active_io_weight = get_rule_integer (file, group, "ActiveIOWeight", 1, 10000);
+  rule->boost_cpu_weight_inc = get_rule_integer (file, group, "BoostCPUWeightInc", 0, 10000);
+  rule->boost_io_weight_inc = get_rule_integer (file, group, "BoostIOWeightInc", 0, 10000);
+  rule->idle_after_sec = get_rule_integer (file, group, "IdleAfterSec", 0, G_MAXINT);
+
+  return rule;
+}
+
+static void
+rules_add (RAppRules *rules, RAppRule *rule)
+{
+  gsize len, literal;
+
+  g_ptr_array_add (rules->rules, rule);
+
+  len = strlen (rule->pattern);
+  literal = strcspn (rule->pattern, "*?");
+
+  if (literal == len)
+    {
+      if (!g_hash_table_contains (rules->exact, rule->pattern))
+        g_hash_table_insert (rules->exact, rule->pattern, rule);
+    }
+  else if (literal == len - 1 && rule->pattern[literal] == '*')
+    {
+      trie_insert (rules->prefixes, rule->pattern, literal, rule);
+    }
+  else
+    {
+      g_ptr_array_add (rules->globs, g_pattern_spec_new (rule->pattern));
+      g_ptr_array_add (rules->glob_rules, rule);
+    }
+}
+
+RAppRules *
+r_app_rules_new (void)
+{
+  RAppRules *rules;
+
+  rules = g_new0 (RAppRules, 1);
+  rules->rules = g_ptr_array_new_with_free_func ((GDestroyNotify) rule_free);
+  rules->exact = g_hash_table_new (g_str_hash, g_str_equal);
+  rules->prefixes = g_new0 (TrieNode, 1);
+  rules->globs = g_ptr_array_new_with_free_func ((GDestroyNotify) g_pattern_spec_free);
+  rules->glob_rules = g_ptr_array_new ();
+  rules->cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  return rules;
+}
+
+/**
+ * r_app_rules_add_pattern:
+ * @rules: The compiled rules
+ * @pattern: Unit name pattern
+ *
+ * Adds a rule that only consists of the pattern (i.e. all values unset).
+ * This is useful for plain lists of patterns.
+ */
+void
+r_app_rules_add_pattern (RAppRules *rules, const gchar *pattern)
+{
+  RAppRule *rule;
+
+  rule = g_new0 (RAppRule, 1);
+  rule->pattern = g_strstrip (g_strdup (pattern));
+  rule->default_cpu_weight = R_APP_RULE_UNSET;
+  rule->default_io_weight = R_APP_RULE_UNSET;
+  rule->active_cpu_weight = R_APP_RULE_UNSET;
+  rule->active_io_weight = R_APP_RULE_UNSET;
+  rule->boost_cpu_weight_inc = R_APP_RULE_UNSET;
+  rule->boost_io_weight_inc = R_APP_RULE_UNSET;
+  rule->idle_after_sec = R_APP_RULE_UNSET;
+
+  if (!*rule->pattern)
+    {
+      rule_free (rule);
+      return;
+    }
+
+  rules_add (rules, rule);
+}
+
+/**
+ * r_app_rules_new_from_key_file:
+ * @file: The loaded configuration
+ *
+ * Compiles all [AppRule PATTERN] groups. Patterns without wildcards go into
+ * a hash table, patterns with a single trailing '*' into a prefix trie and
+ * everything else is matched as a glob.
+ *
+ * Returns: (transfer full): The compiled rules
+ */
+RAppRules *
+r_app_rules_new_from_key_file (GKeyFile *file)
+{
+  g_auto(GStrv) groups = NULL;
+  RAppRules *rules;
+  gchar **group;
+
+  rules = r_app_rules_new ();
+
+  groups = g_key_file_get_groups (file, NULL);
+  for (group = groups; group && *group; group++)
+    {
+      RAppRule *rule;
+
+      if (!g_str_has_prefix (*group, R_APP_RULE_GROUP_PREFIX))
+        continue;
+
+      rule = rule_new_from_group (file, *group);
+      if (!*rule->pattern)
+        {
+          g_warning ("Ignoring application rule with empty pattern");
+          rule_free (rule);
+          continue;
+        }
+
+      rules_add (rules, rule);
+    }
+
+  g_debug ("Loaded %u application rules (%u exact, %u globs)",
+           rules->rules->len,
+           g_hash_table_size (rules->exact),
+           rules->globs->len);
+
+  return rules;
+}
+
+void
+r_app_rules_free (RAppRules *rules)
+{
+  g_clear_pointer (&rules->cache, g_hash_table_destroy);
+  g_clear_pointer (&rules->glob_rules, g_ptr_array_unref);
+  g_clear_pointer (&rules->globs, g_ptr_array_unref);
+  g_clear_pointer (&rules->prefixes, trie_free);
+  g_clear_pointer (&rules->exact, g_hash_table_destroy);
+  g_clear_pointer (&rules->rules, g_ptr_array_unref);
+  g_free (rules);
+}
+
+guint
+r_app_rules_get_n_rules (RAppRules *rules)
+{
+  return rules->rules->len;
+}
+
+static gboolean
+glob_match (GPatternSpec *spec, const gchar *name, gsize len)
+{
+#if GLIB_CHECK_VERSION (2, 70, 0)
+  return g_pattern_spec_match (spec, len, name, NULL);
+#else
+  return g_pattern_match (spec, len, name, NULL);
+#endif
+}
+
+/**
+ * r_app_rules_lookup:
+ * @rules: The compiled rules
+ * @name: Unit name of the application
+ *
+ * Exact matches take precedence over the longest matching prefix, which in
+ * turn takes precedence over the first matching glob.
+ *
+ * Returns: (nullable): The matching rule
+ */
+const RAppRule *
+r_app_rules_lookup (RAppRules *rules, const gchar *name)
+{
+  gpointer cached;
+  RAppRule *rule;
+  gsize len;
+  guint i;
+
+  if (!name || rules->rules->len == 0)
+    return NULL;
+
+  rule = g_hash_table_lookup (rules->exact, name);
+  if (rule)
+    return rule;
+
+  rule = trie_lookup (rules->prefixes, name);
+  if (rule || rules->globs->len == 0)
+    return rule;
+
+  if (g_hash_table_lookup_extended (rules->cache, name, NULL, &cached))
+    return cached == &no_match ? NULL : cached;
+
+  len = strlen (name);
+  for (i = 0; i < rules->globs->len; i++)
+    {
+      if (glob_match (g_ptr_array_index (rules->globs, i), name, len))
+        {
+          rule = g_ptr_array_index (rules->glob_rules, i);
+          break;
+        }
+    }
+
+  if (g_hash_table_size (rules->cache) >= RULE_CACHE_MAX_SIZE)
+    g_hash_table_remove_all (rules->cache);
+  g_hash_table_insert (rules->cache, g_strdup (name), rule ? rule : &no_match);
+
+  return rule;
+}
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define R_APP_RULE_GROUP_PREFIX "AppRule "
+#define R_APP_RULE_UNSET -1
+
+/* Values set to R_APP_RULE_UNSET fall back to the [AppBoost] configuration. */
+typedef struct
+{
+  gchar   *pattern;
+  gboolean exempt;
+  gint     default_cpu_weight;
+  gint     default_io_weight;
+  gint     active_cpu_weight;
+  gint     active_io_weight;
+  gint     boost_cpu_weight_inc;
+  gint     boost_io_weight_inc;
+  gint     idle_after_sec;
+} RAppRule;
+
+typedef struct _RAppRules RAppRules;
+
+RAppRules *r_app_rules_new (void);
+RAppRules *r_app_rules_new_from_key_file (GKeyFile *file);
+void r_app_rules_free (RAppRules *rules);
+
+void r_app_rules_add_pattern (RAppRules   *rules,
+                              const gchar *pattern);
+guint r_app_rules_get_n_rules (RAppRules *rules);
+const RAppRule *r_app_rules_lookup (RAppRules   *rules,
+                                    const gchar *name);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RAppRules, r_app_rules_free)
+
+G_END_DECLS
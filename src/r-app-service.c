@@ -0,0 +1,243 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <gio/gio.h>
+
+#include "r-app-monitor.h"
+#include "r-app-policy.h"
+#include "r-app-service.h"
+
+#define APP_SERVICE_PATH "/org/freedesktop/UResourced"
+#define APP_SERVICE_INTERFACE "org.freedesktop.UResourced.Apps"
+
+struct _RAppService
+{
+  GObject          parent_instance;
+
+  RAppMonitor     *app_monitor;
+  RAppPolicy      *app_policy;
+
+  GDBusConnection *connection;
+  guint            bus_name;
+  guint            dbus_obj;
+};
+
+G_DEFINE_TYPE (RAppService, r_app_service, G_TYPE_OBJECT)
+
+RAppService *
+r_app_service_new (void)
+{
+  return g_object_new (R_TYPE_APP_SERVICE, NULL);
+}
+
+static void
+r_app_service_finalize (GObject *object)
+{
+  RAppService *self = (RAppService *) object;
+
+  r_app_service_stop (self);
+
+  G_OBJECT_CLASS (r_app_service_parent_class)->finalize (object);
+}
+
+static void
+r_app_service_class_init (RAppServiceClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = r_app_service_finalize;
+}
+
+static void
+r_app_service_init (RAppService *self G_GNUC_UNUSED)
+{
+}
+
+static GVariant *
+app_info_to_variant (const RAppInfo *app)
+{
+  return g_variant_new ("(ssttxubb)",
+                        app->path,
+                        app->name ? app->name : "",
+                        app->cpu_weight,
+                        app->io_weight,
+                        app->timestamp,
+                        (guint32) app->boosted,
+                        app->idle,
+                        app->frozen);
+}
+
+static void
+emit_app_signal (RAppService *self, const char *signal_name, GVariant *parameters)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!self->dbus_obj)
+    {
+      g_variant_unref (g_variant_ref_sink (parameters));
+      return;
+    }
+
+  if (!g_dbus_connection_emit_signal (self->connection,
+                                      NULL,
+                                      APP_SERVICE_PATH,
+                                      APP_SERVICE_INTERFACE,
+                                      signal_name,
+                                      parameters,
+                                      &error))
+    g_debug ("Could not emit %s: %s", signal_name, error->message);
+}
+
+static void
+app_updated_cb (RAppService *self, RAppInfo *app)
+{
+  emit_app_signal (self, "AppChanged", g_variant_new ("(@(ssttxubb))", app_info_to_variant (app)));
+}
+
+static void
+app_removed_cb (RAppService *self, RAppInfo *app)
+{
+  emit_app_signal (self, "AppRemoved", g_variant_new ("(s)", app->path));
+}
+
+static void
+handle_dbus_method_call (GDBusConnection       *connection G_GNUC_UNUSED,
+                         const char            *sender G_GNUC_UNUSED,
+                         const char            *object_path G_GNUC_UNUSED,
+                         const char            *interface_name G_GNUC_UNUSED,
+                         const char            *method_name,
+                         GVariant              *parameters,
+                         GDBusMethodInvocation *invocation,
+                         gpointer               user_data)
+{
+  RAppService *self = R_APP_SERVICE (user_data);
+
+  /* Just trust that GDBus already ensures the correct method calls and types. */
+  if (g_str_equal (method_name, "GetApp"))
+    {
+      const char *path;
+      RAppInfo *app;
+
+      g_variant_get (parameters, "(&s)", &path);
+
+      app = r_app_monitor_lookup_app (self->app_monitor, path);
+      if (!app)
+        {
+          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                                 "Unknown application %s", path);
+          return;
+        }
+
+      g_dbus_method_invocation_return_value (invocation,
+                                             g_variant_new ("(@(ssttxubb))", app_info_to_variant (app)));
+    }
+  else
+    {
+      g_autoptr(GList) apps = NULL;
+      GVariantBuilder builder;
+      GList *l;
+
+      g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssttxubb)"));
+
+      apps = r_app_monitor_get_apps (self->app_monitor);
+      for (l = apps; l; l = l->next)
+        g_variant_builder_add_value (&builder, app_info_to_variant (l->data));
+
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(a(ssttxubb))", &builder));
+    }
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+  .method_call = handle_dbus_method_call,
+  .get_property = NULL,
+  .set_property = NULL,
+};
+
+static void
+bus_acquired_cb (GDBusConnection *connection,
+                 const gchar     *name G_GNUC_UNUSED,
+                 gpointer         user_data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GDBusNodeInfo) introspection_data = NULL;
+  RAppService *self = R_APP_SERVICE (user_data);
+
+  self->connection = g_object_ref (connection);
+
+  bytes = g_resources_lookup_data ("/uresourced/org.freedesktop.UResourced.Apps.xml",
+                                   G_RESOURCE_LOOKUP_FLAGS_NONE,
+                                   NULL);
+  introspection_data = g_dbus_node_info_new_for_xml (g_bytes_get_data (bytes, NULL), NULL);
+  g_assert (introspection_data);
+
+  self->dbus_obj = g_dbus_connection_register_object (connection,
+                                                      APP_SERVICE_PATH,
+                                                      introspection_data->interfaces[0],
+                                                      &interface_vtable,
+                                                      self,
+                                                      NULL,
+                                                      &error);
+  if (!self->dbus_obj)
+    g_warning ("Failed to register application object: %s", error->message);
+}
+
+static void
+name_lost_cb (GDBusConnection *connection G_GNUC_UNUSED,
+              const gchar     *name,
+              gpointer         user_data G_GNUC_UNUSED)
+{
+  /* Introspection is optional, keep managing applications without it. */
+  g_debug ("Could not own %s on the session bus", name);
+}
+
+/**
+ * r_app_service_start:
+ * @self: RAppService
+ * @monitor: The application monitor
+ * @policy: The policy applied to the applications
+ *
+ * Exports the state of all applications on the session bus. AppChanged is
+ * emitted every time the policy updated an application, AppRemoved when it
+ * goes away.
+ */
+void
+r_app_service_start (RAppService *self,
+                     RAppMonitor *monitor,
+                     RAppPolicy  *policy)
+{
+  self->app_monitor = g_object_ref (monitor);
+  self->app_policy = g_object_ref (policy);
+
+  g_signal_connect_object (policy, "app-updated", G_CALLBACK (app_updated_cb),
+                           self, G_CONNECT_SWAPPED);
+  g_signal_connect_object (monitor, "removed", G_CALLBACK (app_removed_cb),
+                           self, G_CONNECT_SWAPPED);
+
+  self->bus_name = g_bus_own_name (G_BUS_TYPE_SESSION,
+                                   "org.freedesktop.UResourced",
+                                   G_BUS_NAME_OWNER_FLAGS_NONE,
+                                   bus_acquired_cb,
+                                   NULL,
+                                   name_lost_cb,
+                                   self,
+                                   NULL);
+}
+
+void
+r_app_service_stop (RAppService *self)
+{
+  if (self->dbus_obj)
+    {
+      g_dbus_connection_unregister_object (self->connection, self->dbus_obj);
+      self->dbus_obj = 0;
+    }
+  g_clear_handle_id (&self->bus_name, g_bus_unown_name);
+  g_clear_object (&self->connection);
+
+  if (self->app_policy)
+    g_signal_handlers_disconnect_by_data (self->app_policy, self);
+  if (self->app_monitor)
+    g_signal_handlers_disconnect_by_data (self->app_monitor, self);
+  g_clear_object (&self->app_policy);
+  g_clear_object (&self->app_monitor);
+}
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define R_TYPE_APP_SERVICE (r_app_service_get_type ())
+
+G_DECLARE_FINAL_TYPE (RAppService, r_app_service, R, APP_SERVICE, GObject)
+
+RAppService *r_app_service_new (void);
+
+void r_app_service_start (RAppService *self,
+                          RAppMonitor *monitor,
+                          RAppPolicy  *policy);
+void r_app_service_stop (RAppService *self);
+
+G_END_DECLS
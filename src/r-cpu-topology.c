@@ -0,0 +1,279 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include "r-cpu-topology.h"
+
+#define SYSFS_CPU_PATH "/sys/devices/system/cpu"
+
+/* A physical core, i.e. a set of SMT siblings */
+typedef struct
+{
+  guint   id;
+  guint   l3_id;
+  GArray *cpus;
+} Core;
+
+static void
+core_free (Core *core)
+{
+  g_array_unref (core->cpus);
+  g_free (core);
+}
+
+static gint
+uint_cmp (gconstpointer a, gconstpointer b)
+{
+  guint x = *(const guint *) a;
+  guint y = *(const guint *) b;
+
+  return (x > y) - (x < y);
+}
+
+static gint
+core_cmp (gconstpointer a, gconstpointer b)
+{
+  const Core *x = *(const Core **) a;
+  const Core *y = *(const Core **) b;
+
+  if (x->l3_id != y->l3_id)
+    return (x->l3_id > y->l3_id) - (x->l3_id < y->l3_id);
+
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+/**
+ * r_cpu_list_parse:
+ * @list: A CPU list as used by sysfs and cpusets, e.g. "0-3,8,10-11"
+ *
+ * Returns: (transfer full) (nullable): The sorted CPU numbers, %NULL if the
+ *   list could not be parsed
+ */
+GArray *
+r_cpu_list_parse (const gchar *list)
+{
+  g_autoptr(GArray) cpus = NULL;
+  g_auto(GStrv) ranges = NULL;
+  gchar **range;
+
+  cpus = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  ranges = g_strsplit (list, ",", -1);
+  for (range = ranges; *range; range++)
+    {
+      guint64 first, last;
+      gchar *end = NULL;
+
+      g_strstrip (*range);
+      if (!**range)
+        continue;
+
+      first = g_ascii_strtoull (*range, &end, 10);
+      if (end == *range)
+        return NULL;
+
+      last = first;
+      if (*end == '-')
+        {
+          const gchar *start = end + 1;
+
+          last = g_ascii_strtoull (start, &end, 10);
+          if (end == start || last < first)
+            return NULL;
+        }
+
+      if (*end || last >= G_MAXUINT16)
+        return NULL;
+
+      for (; first <= last; first++)
+        {
+          guint cpu = first;
+
+          g_array_append_val (cpus, cpu);
+        }
+    }
+
+  g_array_sort (cpus, uint_cmp);
+
+  return g_steal_pointer (&cpus);
+}
+
+/**
+ * r_cpu_list_format:
+ * @cpus: Sorted CPU numbers
+ *
+ * Returns: (transfer full): The CPUs in the list format with ranges
+ */
+gchar *
+r_cpu_list_format (GArray *cpus)
+{
+  GString *str;
+  guint i = 0;
+
+  str = g_string_new (NULL);
+
+  while (i < cpus->len)
+    {
+      guint first = g_array_index (cpus, guint, i);
+      guint last = first;
+
+      while (i + 1 < cpus->len && g_array_index (cpus, guint, i + 1) == last + 1)
+        last = g_array_index (cpus, guint, ++i);
+      i++;
+
+      if (str->len > 0)
+        g_string_append_c (str, ',');
+
+      if (first == last)
+        g_string_append_printf (str, "%u", first);
+      else
+        g_string_append_printf (str, "%u-%u", first, last);
+    }
+
+  return g_string_free (str, FALSE);
+}
+
+static GArray *
+read_cpu_list (const gchar *path)
+{
+  g_autofree gchar *contents = NULL;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return NULL;
+
+  return r_cpu_list_parse (contents);
+}
+
+/* Returns the lowest CPU sharing the L3 cache with @cpu, @cpu itself if
+ * there is no L3 cache. */
+static guint
+get_l3_id (guint cpu)
+{
+  guint index;
+
+  for (index = 0;; index++)
+    {
+      g_autofree gchar *level_path = NULL;
+      g_autofree gchar *level = NULL;
+      g_autofree gchar *shared_path = NULL;
+      g_autoptr(GArray) shared = NULL;
+
+      level_path = g_strdup_printf (SYSFS_CPU_PATH "/cpu%u/cache/index%u/level", cpu, index);
+      if (!g_file_get_contents (level_path, &level, NULL, NULL))
+        break;
+
+      if (g_ascii_strtoull (level, NULL, 10) != 3)
+        continue;
+
+      shared_path = g_strdup_printf (SYSFS_CPU_PATH "/cpu%u/cache/index%u/shared_cpu_list", cpu, index);
+      shared = read_cpu_list (shared_path);
+      if (shared && shared->len > 0)
+        return g_array_index (shared, guint, 0);
+    }
+
+  return cpu;
+}
+
+/**
+ * r_cpu_topology_pick_cores:
+ * @n_cores: Number of physical cores to pick
+ *
+ * Picks whole physical cores (all SMT siblings) so that the remaining cores
+ * keep as many complete L3 cache domains as possible. Cores are taken from
+ * the last L3 domain first, the domain of CPU 0 is used last.
+ *
+ * Returns: (transfer full) (nullable): The sorted CPUs of the picked cores,
+ *   %NULL if the topology could not be read or there are not more than
+ *   @n_cores cores
+ */
+GArray *
+r_cpu_topology_pick_cores (guint n_cores)
+{
+  g_autoptr(GArray) online = NULL;
+  g_autoptr(GHashTable) cores_by_id = NULL;
+  g_autoptr(GPtrArray) cores = NULL;
+  g_autoptr(GArray) picked = NULL;
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
+
+  online = read_cpu_list (SYSFS_CPU_PATH "/online");
+  if (!online || online->len == 0)
+    return NULL;
+
+  cores_by_id = g_hash_table_new (NULL, NULL);
+  for (i = 0; i < online->len; i++)
+    {
+      guint cpu = g_array_index (online, guint, i);
+      g_autofree gchar *siblings_path = NULL;
+      g_autoptr(GArray) siblings = NULL;
+      guint core_id = cpu;
+      Core *core;
+
+      siblings_path = g_strdup_printf (SYSFS_CPU_PATH "/cpu%u/topology/thread_siblings_list", cpu);
+      siblings = read_cpu_list (siblings_path);
+      if (siblings && siblings->len > 0)
+        core_id = g_array_index (siblings, guint, 0);
+
+      core = g_hash_table_lookup (cores_by_id, GUINT_TO_POINTER (core_id));
+      if (!core)
+        {
+          core = g_new0 (Core, 1);
+          core->id = core_id;
+          core->l3_id = get_l3_id (cpu);
+          core->cpus = g_array_new (FALSE, FALSE, sizeof (guint));
+          g_hash_table_insert (cores_by_id, GUINT_TO_POINTER (core_id), core);
+        }
+
+      g_array_append_val (core->cpus, cpu);
+    }
+
+  cores = g_ptr_array_new_with_free_func ((GDestroyNotify) core_free);
+  g_hash_table_iter_init (&iter, cores_by_id);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_ptr_array_add (cores, value);
+
+  if (n_cores == 0 || cores->len <= n_cores)
+    return NULL;
+
+  /* Sorted by L3 domain, so picking from the end keeps domains together. */
+  g_ptr_array_sort (cores, core_cmp);
+
+  picked = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (i = 0; i < n_cores; i++)
+    {
+      Core *core = g_ptr_array_index (cores, cores->len - 1 - i);
+
+      g_array_append_vals (picked, core->cpus->data, core->cpus->len);
+    }
+
+  g_array_sort (picked, uint_cmp);
+
+  return g_steal_pointer (&picked);
+}
+
+/**
+ * r_cpu_mask_new:
+ * @cpus: CPU numbers
+ *
+ * Returns: (transfer full): The CPUs as a bitmask in the format of systemd's
+ *   AllowedCPUs property (bit N of byte N / 8 for CPU N)
+ */
+GBytes *
+r_cpu_mask_new (GArray *cpus)
+{
+  guint8 *mask;
+  gsize size = 0;
+  guint i;
+
+  for (i = 0; i < cpus->len; i++)
+    size = MAX (size, g_array_index (cpus, guint, i) / 8 + 1);
+
+  mask = g_malloc0 (MAX (size, 1));
+  for (i = 0; i < cpus->len; i++)
+    {
+      guint cpu = g_array_index (cpus, guint, i);
+
+      mask[cpu / 8] |= 1 << (cpu % 8);
+    }
+
+  return g_bytes_new_take (mask, size);
+}
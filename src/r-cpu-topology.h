@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+GArray *r_cpu_list_parse (const gchar *list);
+gchar *r_cpu_list_format (GArray *cpus);
+
+GArray *r_cpu_topology_pick_cores (guint n_cores);
+GBytes *r_cpu_mask_new (GArray *cpus);
+
+G_END_DECLS
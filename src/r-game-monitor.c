@@ -3,6 +3,8 @@
 #include <gio/gio.h>
 #include <glib-object.h>
 #include <glib.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "r-app-monitor.h"
 #include "r-game-monitor.h"
@@ -10,12 +12,49 @@
 
 struct _RGameMonitor
 {
-  GObject      parent_instance;
+  GObject       parent_instance;
 
-  GDBusProxy  *proxy;
-  RAppMonitor *app_monitor;
+  GDBusProxy   *proxy;
+  GCancellable *cancellable;
+  RAppMonitor  *app_monitor;
+
+  /* pid -> Game of all games registered with GameMode */
+  GHashTable   *games;
+  guint         rescan_id;
 };
 
+/* Helper processes of games (shader compilers, wineserver, ...) are started
+ * after the game registered, so the process tree is scanned periodically.
+ * Only processes in the app.slice cgroups are looked at. */
+#define GAME_RESCAN_INTERVAL_SEC 5
+
+typedef struct
+{
+  pid_t       pid;
+  /* Cgroup paths of the units of the game's processes (set) */
+  GHashTable *app_paths;
+} Game;
+
+typedef struct
+{
+  pid_t  ppid;
+  gchar *comm;
+} ProcInfo;
+
+static void
+game_free (Game *game)
+{
+  g_hash_table_destroy (game->app_paths);
+  g_free (game);
+}
+
+static void
+proc_info_free (ProcInfo *info)
+{
+  g_free (info->comm);
+  g_free (info);
+}
+
 G_DEFINE_TYPE (RGameMonitor, r_game_monitor, G_TYPE_OBJECT);
 
 RGameMonitor *
@@ -29,26 +68,57 @@ r_game_monitor_finalize (GObject *object)
 {
   RGameMonitor *self = (RGameMonitor *) object;
 
+  g_cancellable_cancel (self->cancellable);
+  g_clear_object (&self->cancellable);
   g_clear_object (&self->proxy);
+  g_clear_handle_id (&self->rescan_id, g_source_remove);
+  g_clear_pointer (&self->games, g_hash_table_destroy);
 
   G_OBJECT_CLASS (r_game_monitor_parent_class)->finalize (object);
 }
 
+/**
+ * update_app_boost:
+ * @self: RGameMonitor
+ * @app_path: The cgroup path of the application
+ *
+ * Several games may run in the same application (e.g. a launcher) and a
+ * game may span several applications, the application is boosted as long
+ * as a process of any registered game runs in it.
+ */
 static void
-r_game_monitor_boost_game_from_pid (RGameMonitor *self, pid_t pid, gboolean is_registered)
+update_app_boost (RGameMonitor *self, const gchar *app_path)
 {
-  g_autofree gchar *app_path = NULL;
+  GHashTableIter iter;
+  gpointer value;
+  gboolean boosted = FALSE;
   RAppInfo *app;
 
-  app_path = get_unit_cgroup_path_from_pid (pid);
-  if (!app_path)
+  if (!self->app_monitor)
     return;
 
-  app = r_app_monitor_get_app_info_from_path (self->app_monitor, app_path);
+  g_hash_table_iter_init (&iter, self->games);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Game *game = value;
+
+      if (g_hash_table_contains (game->app_paths, app_path))
+        {
+          boosted = TRUE;
+          break;
+        }
+    }
+
+  app = r_app_monitor_lookup_app (self->app_monitor, app_path);
+  if (!app && boosted)
+    app = r_app_monitor_get_app_info_from_path (self->app_monitor, (gchar *) app_path);
   if (!app)
     return;
 
-  if (is_registered)
+  if (boosted == !!(app->boosted & BOOST_GAME))
+    return;
+
+  if (boosted)
     app->boosted |= BOOST_GAME;
   else
     app->boosted &= ~BOOST_GAME;
@@ -56,6 +126,452 @@ r_game_monitor_boost_game_from_pid (RGameMonitor *self, pid_t pid, gboolean is_r
   r_app_monitor_app_info_changed (self->app_monitor, app);
 }
 
+static void
+read_proc_info (GHashTable *procs, pid_t pid)
+{
+  g_autofree gchar *stat_path = NULL;
+  g_autofree gchar *contents = NULL;
+  const gchar *comm_start, *comm_end;
+  ProcInfo *info;
+
+  stat_path = g_strdup_printf ("/proc/%d/stat", pid);
+  if (!g_file_get_contents (stat_path, &contents, NULL, NULL))
+    return;
+
+  /* "pid (comm) state ppid ...", comm may contain spaces and parens */
+  comm_start = strchr (contents, '(');
+  comm_end = strrchr (contents, ')');
+  if (!comm_start || !comm_end || comm_end < comm_start || strlen (comm_end) < 5)
+    return;
+
+  info = g_new0 (ProcInfo, 1);
+  info->comm = g_strndup (comm_start + 1, comm_end - comm_start - 1);
+  info->ppid = strtol (comm_end + 4, NULL, 10);
+  g_hash_table_insert (procs, GINT_TO_POINTER (pid), info);
+}
+
+/**
+ * read_proc_snapshot:
+ * @self: RGameMonitor
+ *
+ * Only the processes in the cgroups watched by the app monitor are read,
+ * games and their helpers are started as applications.
+ *
+ * Returns: (transfer full): pid -> ProcInfo of the application processes
+ */
+static GHashTable *
+read_proc_snapshot (RGameMonitor *self)
+{
+  g_autoptr(GList) paths = NULL;
+  GHashTable *procs;
+  GList *l;
+
+  procs = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) proc_info_free);
+
+  if (!self->app_monitor)
+    return procs;
+
+  paths = r_app_monitor_get_cgroup_paths (self->app_monitor);
+  for (l = paths; l; l = l->next)
+    {
+      g_autofree gchar *procs_path = NULL;
+      g_autofree gchar *contents = NULL;
+      g_auto(GStrv) lines = NULL;
+      guint i;
+
+      procs_path = g_strdup_printf ("%s/cgroup.procs", (const gchar *) l->data);
+      if (!g_file_get_contents (procs_path, &contents, NULL, NULL))
+        continue;
+
+      lines = g_strsplit (contents, "\n", -1);
+      for (i = 0; lines[i]; i++)
+        {
+          gchar *end;
+          pid_t pid;
+
+          pid = strtol (lines[i], &end, 10);
+          if (*end || pid <= 0)
+            continue;
+
+          read_proc_info (procs, pid);
+        }
+    }
+
+  return procs;
+}
+
+/* Returns the WINEPREFIX of the process, "" if it is not set */
+static gchar *
+get_wine_prefix (pid_t pid)
+{
+  g_autofree gchar *environ_path = NULL;
+  g_autofree gchar *contents = NULL;
+  const gchar *var;
+  gsize len;
+
+  environ_path = g_strdup_printf ("/proc/%d/environ", pid);
+  if (!g_file_get_contents (environ_path, &contents, &len, NULL))
+    return NULL;
+
+  for (var = contents; var < contents + len; var += strlen (var) + 1)
+    {
+      if (g_str_has_prefix (var, "WINEPREFIX="))
+        return g_strdup (var + strlen ("WINEPREFIX="));
+    }
+
+  return g_strdup ("");
+}
+
+/* comm is cut off after 15 characters, so the executable of Windows
+ * programs is matched on argv[0] (e.g. "C:\Games\Game.exe"). */
+static gboolean
+is_wine_process (pid_t pid, const ProcInfo *info)
+{
+  g_autofree gchar *cmdline_path = NULL;
+  g_autofree gchar *contents = NULL;
+  g_autofree gchar *argv0 = NULL;
+
+  if (strstr (info->comm, "wine") != NULL)
+    return TRUE;
+
+  cmdline_path = g_strdup_printf ("/proc/%d/cmdline", pid);
+  if (!g_file_get_contents (cmdline_path, &contents, NULL, NULL))
+    return FALSE;
+
+  /* Arguments are NUL separated, argv[0] is the first string. */
+  argv0 = g_ascii_strdown (contents, -1);
+
+  return g_str_has_suffix (argv0, ".exe");
+}
+
+static void
+add_app_path (GHashTable *app_paths, pid_t pid)
+{
+  gchar *app_path;
+
+  app_path = get_unit_cgroup_path_from_pid (pid);
+  if (app_path)
+    g_hash_table_add (app_paths, app_path);
+}
+
+/**
+ * game_collect_app_paths:
+ * @game: The game
+ * @procs: Snapshot from read_proc_snapshot()
+ *
+ * Collects the units of the game's process tree. The wineserver of a wine
+ * game is not a descendant (it daemonizes), it is found through the
+ * WINEPREFIX of the wine processes in the tree.
+ *
+ * Returns: (transfer full): The set of cgroup paths, empty if the game
+ *   is gone
+ */
+static GHashTable *
+game_collect_app_paths (Game *game, GHashTable *procs)
+{
+  g_autoptr(GHashTable) children = NULL;
+  g_autoptr(GHashTable) wine_prefixes = NULL;
+  g_autoptr(GArray) queue = NULL;
+  GHashTable *app_paths;
+  GHashTableIter iter;
+  gpointer key, value;
+  guint i;
+
+  app_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  /* ppid -> GArray of child pids */
+  children = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) g_array_unref);
+  g_hash_table_iter_init (&iter, procs);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      ProcInfo *info = value;
+      GArray *siblings;
+      pid_t pid = GPOINTER_TO_INT (key);
+
+      siblings = g_hash_table_lookup (children, GINT_TO_POINTER (info->ppid));
+      if (!siblings)
+        {
+          siblings = g_array_new (FALSE, FALSE, sizeof (pid_t));
+          g_hash_table_insert (children, GINT_TO_POINTER (info->ppid), siblings);
+        }
+      g_array_append_val (siblings, pid);
+    }
+
+  wine_prefixes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  queue = g_array_new (FALSE, FALSE, sizeof (pid_t));
+  g_array_append_val (queue, game->pid);
+  for (i = 0; i < queue->len; i++)
+    {
+      pid_t pid = g_array_index (queue, pid_t, i);
+      ProcInfo *info;
+      GArray *child_pids;
+
+      add_app_path (app_paths, pid);
+
+      info = g_hash_table_lookup (procs, GINT_TO_POINTER (pid));
+      if (info && is_wine_process (pid, info))
+        {
+          gchar *prefix = get_wine_prefix (pid);
+
+          if (prefix)
+            g_hash_table_add (wine_prefixes, prefix);
+        }
+
+      child_pids = g_hash_table_lookup (children, GINT_TO_POINTER (pid));
+      if (child_pids)
+        g_array_append_vals (queue, child_pids->data, child_pids->len);
+    }
+
+  if (g_hash_table_size (wine_prefixes) > 0)
+    {
+      g_hash_table_iter_init (&iter, procs);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          ProcInfo *info = value;
+          g_autofree gchar *prefix = NULL;
+
+          if (!g_str_equal (info->comm, "wineserver"))
+            continue;
+
+          prefix = get_wine_prefix (GPOINTER_TO_INT (key));
+          if (prefix && g_hash_table_contains (wine_prefixes, prefix))
+            add_app_path (app_paths, GPOINTER_TO_INT (key));
+        }
+    }
+
+  return app_paths;
+}
+
+static gboolean
+str_set_equal (GHashTable *a, GHashTable *b)
+{
+  GHashTableIter iter;
+  gpointer path;
+
+  if (g_hash_table_size (a) != g_hash_table_size (b))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, a);
+  while (g_hash_table_iter_next (&iter, &path, NULL))
+    {
+      if (!g_hash_table_contains (b, path))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Updates the boost of all applications in either set */
+static void
+update_app_boosts (RGameMonitor *self, GHashTable *a, GHashTable *b)
+{
+  GHashTableIter iter;
+  gpointer path;
+
+  g_hash_table_iter_init (&iter, a);
+  while (g_hash_table_iter_next (&iter, &path, NULL))
+    update_app_boost (self, path);
+
+  g_hash_table_iter_init (&iter, b);
+  while (g_hash_table_iter_next (&iter, &path, NULL))
+    {
+      if (!g_hash_table_contains (a, path))
+        update_app_boost (self, path);
+    }
+}
+
+static gboolean
+rescan_games (gpointer user_data)
+{
+  RGameMonitor *self = R_GAME_MONITOR (user_data);
+  g_autoptr(GHashTable) procs = NULL;
+  GHashTableIter iter;
+  gpointer value;
+
+  procs = read_proc_snapshot (self);
+
+  g_hash_table_iter_init (&iter, self->games);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Game *game = value;
+      g_autoptr(GHashTable) old_paths = NULL;
+      GHashTable *app_paths;
+
+      /* Keep the units of a game that is gone until it unregisters. */
+      app_paths = game_collect_app_paths (game, procs);
+      if (g_hash_table_size (app_paths) == 0 || str_set_equal (app_paths, game->app_paths))
+        {
+          g_hash_table_destroy (app_paths);
+          continue;
+        }
+
+      old_paths = g_steal_pointer (&game->app_paths);
+      game->app_paths = app_paths;
+      update_app_boosts (self, game->app_paths, old_paths);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+r_game_monitor_boost_game_from_pid (RGameMonitor *self, pid_t pid, gboolean is_registered)
+{
+  g_autoptr(GHashTable) procs = NULL;
+  g_autoptr(GHashTable) old_paths = NULL;
+  Game *game;
+
+  if (is_registered)
+    {
+      if (g_hash_table_contains (self->games, GINT_TO_POINTER (pid)))
+        return;
+
+      game = g_new0 (Game, 1);
+      game->pid = pid;
+
+      procs = read_proc_snapshot (self);
+      game->app_paths = game_collect_app_paths (game, procs);
+      if (g_hash_table_size (game->app_paths) == 0)
+        {
+          game_free (game);
+          return;
+        }
+
+      g_debug ("Game %d spans %u application(s)", pid, g_hash_table_size (game->app_paths));
+      g_hash_table_insert (self->games, GINT_TO_POINTER (pid), game);
+
+      if (!self->rescan_id)
+        self->rescan_id = g_timeout_add_seconds (GAME_RESCAN_INTERVAL_SEC, rescan_games, self);
+
+      update_app_boosts (self, game->app_paths, game->app_paths);
+    }
+  else
+    {
+      if (!g_hash_table_steal_extended (self->games, GINT_TO_POINTER (pid),
+                                        NULL, (gpointer *) &game))
+        return;
+
+      /* Keep the paths around to drop the boosts of all units together. */
+      old_paths = g_steal_pointer (&game->app_paths);
+      g_free (game);
+
+      if (g_hash_table_size (self->games) == 0)
+        g_clear_handle_id (&self->rescan_id, g_source_remove);
+
+      update_app_boosts (self, old_paths, old_paths);
+    }
+}
+
+/**
+ * reconcile_games:
+ * @self: RGameMonitor
+ * @games: (nullable): The current set of games as returned by ListGames
+ *
+ * Brings the tracked games in line with the full set known to GameMode, so
+ * that games which started or stopped while either side was not running
+ * are picked up. %NULL unregisters all games.
+ */
+static void
+reconcile_games (RGameMonitor *self, GVariant *games)
+{
+  g_autoptr(GHashTable) current = NULL;
+  g_autoptr(GPtrArray) unregistered = NULL;
+  GHashTableIter iter;
+  GVariantIter game_iter;
+  gpointer pid;
+  gint32 game_pid;
+  guint i;
+
+  current = g_hash_table_new (NULL, NULL);
+  if (games)
+    {
+      g_variant_iter_init (&game_iter, games);
+      while (g_variant_iter_next (&game_iter, "(io)", &game_pid, NULL))
+        {
+          if (game_pid > 0)
+            g_hash_table_add (current, GINT_TO_POINTER (game_pid));
+        }
+    }
+
+  unregistered = g_ptr_array_new ();
+  g_hash_table_iter_init (&iter, self->games);
+  while (g_hash_table_iter_next (&iter, &pid, NULL))
+    {
+      if (!g_hash_table_contains (current, pid))
+        g_ptr_array_add (unregistered, pid);
+    }
+
+  for (i = 0; i < unregistered->len; i++)
+    r_game_monitor_boost_game_from_pid (self, GPOINTER_TO_INT (unregistered->pdata[i]), FALSE);
+
+  g_hash_table_iter_init (&iter, current);
+  while (g_hash_table_iter_next (&iter, &pid, NULL))
+    r_game_monitor_boost_game_from_pid (self, GPOINTER_TO_INT (pid), TRUE);
+
+  g_debug ("Reconciled GameMode games: %u registered, %u unregistered",
+           g_hash_table_size (self->games), unregistered->len);
+}
+
+static void
+list_games_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) ret = NULL;
+  g_autoptr(GVariant) games = NULL;
+  RGameMonitor *self;
+
+  ret = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
+  if (!ret)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_debug ("Could not list GameMode games: %s", error->message);
+      return;
+    }
+
+  self = R_GAME_MONITOR (user_data);
+  if (!g_variant_is_of_type (ret, G_VARIANT_TYPE ("(a(io))")))
+    return;
+
+  games = g_variant_get_child_value (ret, 0);
+  reconcile_games (self, games);
+}
+
+static void
+list_games (RGameMonitor *self)
+{
+  g_autofree gchar *owner = NULL;
+
+  owner = g_dbus_proxy_get_name_owner (self->proxy);
+  if (!owner)
+    return;
+
+  g_dbus_proxy_call (self->proxy, "ListGames", NULL,
+                     G_DBUS_CALL_FLAGS_NO_AUTO_START, 1000,
+                     self->cancellable, list_games_cb, self);
+}
+
+static void
+gamemode_name_owner_changed (G_GNUC_UNUSED GObject    *object,
+                             G_GNUC_UNUSED GParamSpec *pspec,
+                             gpointer                  user_data)
+{
+  RGameMonitor *self = R_GAME_MONITOR (user_data);
+  g_autofree gchar *owner = NULL;
+
+  owner = g_dbus_proxy_get_name_owner (self->proxy);
+  if (owner)
+    {
+      g_debug ("GameMode appeared, reconciling games");
+      list_games (self);
+    }
+  else
+    {
+      /* Games are re-registered if GameMode comes back. */
+      g_debug ("GameMode disappeared, unregistering all games");
+      reconcile_games (self, NULL);
+    }
+}
+
 static void
 gamemode_on_signal_received (G_GNUC_UNUSED GDBusProxy *proxy,
                              G_GNUC_UNUSED gchar      *sender_name,
@@ -93,7 +609,11 @@ r_game_monitor_start (RGameMonitor *self, RAppMonitor *monitor)
 void
 r_game_monitor_stop (RGameMonitor *self)
 {
+  g_cancellable_cancel (self->cancellable);
   g_clear_object (&self->proxy);
+  g_clear_handle_id (&self->rescan_id, g_source_remove);
+  g_hash_table_remove_all (self->games);
+  self->app_monitor = NULL;
 }
 
 static void
@@ -120,6 +640,13 @@ gamemode_bus_proxy_ready_cb (G_GNUC_UNUSED GObject *source, GAsyncResult *res,
                     "g-signal",
                     G_CALLBACK (gamemode_on_signal_received),
                     self);
+  g_signal_connect (self->proxy,
+                    "notify::g-name-owner",
+                    G_CALLBACK (gamemode_name_owner_changed),
+                    self);
+
+  /* Pick up games that were started before us. */
+  list_games (self);
 }
 
 static void
@@ -133,11 +660,14 @@ r_game_monitor_class_init (RGameMonitorClass *klass)
 static void
 r_game_monitor_init (RGameMonitor *self)
 {
+  self->cancellable = g_cancellable_new ();
+  self->games = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) game_free);
+
   g_dbus_proxy_new_for_bus (G_BUS_TYPE_SESSION,
                             G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START
                             | G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
                             NULL, "com.feralinteractive.GameMode",
                             "/com/feralinteractive/GameMode",
-                            "com.feralinteractive.GameMode", NULL,
+                            "com.feralinteractive.GameMode", self->cancellable,
                             gamemode_bus_proxy_ready_cb, self);
 }
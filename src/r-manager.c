@@ -1,20 +1,61 @@
 //* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <sys/inotify.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <gio/gio.h>
 #include "r-manager.h"
+#include "r-psi-monitor.h"
 #include "r-sd-login.h"
+#include "r-trace.h"
+#include "r-usage-sampler.h"
 #include "utils.h"
 #include "uresourced-config.h"
 
 #define WEIGHT_IGNORE G_MININT
 
+#define USER_SLICE_CGROUP_PATH "/sys/fs/cgroup/user.slice"
+
+#define RAM_CHECK_INTERVAL_SEC 30
+#define RAM_CHANGE_THRESHOLD_PERCENT 1
+
+/* Adaptive memory protection: PSI triggers fire on 100ms of stall within a
+ * second, pressure is then evaluated periodically until it has been calm for
+ * a while. Each evaluation moves the protection by a tenth of its range. */
+#define ADAPTIVE_TRIGGER_STALL_USEC 100000
+#define ADAPTIVE_TRIGGER_WINDOW_USEC 1000000
+#define ADAPTIVE_EVAL_INTERVAL_MSEC 2000
+#define ADAPTIVE_CALM_ROUNDS 15
+#define ADAPTIVE_STEP 0.1
+#define INOTIFY_EVENT_BUF_LEN                                                 \
+  (10 * (sizeof (struct inotify_event) + NAME_MAX + 1))
+
 typedef struct {
   gint    cpu_weight;
   gint    io_weight;
   guint64 memory_min;
   guint64 memory_low;
+  gdouble uclamp_min;
 } RAllocation;
 
+/* Desired and last sent allocation of a unit, updates are only sent for
+ * properties that differ. */
+typedef struct {
+  RAllocation desired;
+  RAllocation sent;
+  gboolean    sent_valid;
+  gboolean    dirty;
+  /* Drop the state after the next flush (the unit is going away) */
+  gboolean    forget;
+} RUnitState;
+
+typedef struct {
+  RManager *manager;
+  gchar    *unit;
+} RUnitCall;
+
 struct _RManager
 {
   GObject parent_instance;
@@ -34,91 +75,248 @@ struct _RManager
   guint64     max_users_memory_low;
   guint64     session_memory_min;
   guint64     session_memory_low;
+  /* Set once a utilisation clamp was configured */
+  gboolean    uclamp_used;
 
   RAllocation active_user;
   RAllocation inactive_user;
 
+  /* Fair-share mode: the user.slice protection is split among the active
+   * users, uid -> RAllocation with the user's share */
+  gboolean    fair_share;
+  gint        fair_share_local_weight;
+  gint        fair_share_remote_weight;
+  GHashTable *fair_shares;
+
+  /* Adaptive protection of the active user, the configured ActiveUser
+   * values are the lower bound. */
+  RPsiMonitor *psi;
+  gboolean     adaptive_memory;
+  guint64      adaptive_base_min;
+  guint64      adaptive_base_low;
+  guint64      adaptive_max_min;
+  guint64      adaptive_max_low;
+  gdouble      adaptive_stall_threshold;
+  gdouble      adaptive_level;
+  guint        adaptive_eval_id;
+  guint        adaptive_calm_rounds;
+  guint64      user_stall_total;
+  guint64      system_stall_total;
+  gint64       stall_sample_time;
+
+  /* Usage sampling of user.slice and the user-UID.slice units */
+  RUsageSampler *usage;
+  guint          usage_interval_sec;
+  guint          usage_n_samples;
+  /* The configuration the sampler was created with */
+  guint          usage_sampler_interval_sec;
+  guint          usage_sampler_n_samples;
+  guint          usage_sample_id;
+
   /* Fixed session_slice configuration for drop-in */
   RAllocation session_slice;
+
+  GKeyFile     *config;
+  /* NULL to use the built-in defaults */
+  gchar        *config_path;
+  GFileMonitor *config_monitor;
+  guint         config_reload_id;
+  guint         ram_check_id;
+
+  /* Watches for the user daemon appearing in user@UID.service */
+  gint          inotify_fd;
+  GIOChannel   *inotify_channel;
+  guint         inotify_watch_id;
+  gint          user_slice_wd;
+  /* wd -> uid of the user-UID.slice and user@UID.service watches */
+  GHashTable   *user_wds;
+
+  /* unit name -> RUnitState */
+  GHashTable   *units;
+  /* Names of units with queued updates, in the order they were queued */
+  GPtrArray    *dirty_units;
+  gboolean      forget_pending;
+  guint         flush_id;
+
+  /* SetUnitProperties calls that have not returned yet */
+  guint         n_unit_calls_in_flight;
+
+  /* Records the logind state, not owned */
+  RTraceWriter *trace;
+  /* Replaces the cgroup lookup when replaying a trace */
+  GArray       *systemd_graphical_users;
+
+  /* Statistics */
+  guint64       n_unit_updates;
+  guint64       n_unit_calls;
+  guint64       n_unit_calls_failed;
 };
 
 G_DEFINE_TYPE (RManager, r_manager, G_TYPE_OBJECT)
 
 static gboolean
-user_has_systemd_graphical (uid_t uid)
+allocation_equal (const RAllocation *a, const RAllocation *b)
+{
+  return a->cpu_weight == b->cpu_weight &&
+         a->io_weight == b->io_weight &&
+         a->memory_min == b->memory_min &&
+         a->memory_low == b->memory_low &&
+         a->uclamp_min == b->uclamp_min;
+}
+
+static gboolean
+user_has_systemd_graphical (RManager *self, uid_t uid)
 {
   g_autofree char *cg_path = NULL;
 
-  cg_path = g_strdup_printf ("/sys/fs/cgroup/user.slice/user-%1$i.slice/user@%1$i.service/uresourced.service", uid);
+  if (self->systemd_graphical_users)
+    return g_array_binary_search (self->systemd_graphical_users, &uid, uid_cmp, NULL);
+
+  cg_path = g_strdup_printf (USER_SLICE_CGROUP_PATH "/user-%1$i.slice/user@%1$i.service/uresourced.service", uid);
   g_debug ("Testing existance of %s: %i", cg_path, g_file_test (cg_path, G_FILE_TEST_IS_DIR));
 
   return g_file_test (cg_path, G_FILE_TEST_IS_DIR);
 }
 
+static void
+unit_call_free (RUnitCall *call)
+{
+  g_free (call->unit);
+  g_free (call);
+}
+
 static void
 set_unit_resources_cb (GObject *source_object,
                        GAsyncResult *res,
                        gpointer user_data)
 {
   GDBusConnection *connection = G_DBUS_CONNECTION (source_object);
-  RManager *self = R_MANAGER (user_data);
+  RUnitCall *call = user_data;
+  RManager *self = call->manager;
   g_autoptr(GError) error = NULL;
   g_autoptr(GVariant) var = NULL;
 
   var = g_dbus_connection_call_finish (connection, res, &error);
   if (error)
     {
-      g_warning ("Failed to set resource properties on unit: %s", error->message);
+      RUnitState *state;
+
+      g_warning ("Failed to set resource properties on unit %s: %s", call->unit, error->message);
+      self->n_unit_calls_failed += 1;
+
+      /* We do not know what the unit has now, send everything next time. */
+      state = g_hash_table_lookup (self->units, call->unit);
+      if (state)
+        state->sent_valid = FALSE;
     }
 
   self->pending_calls -= 1;
+  self->n_unit_calls_in_flight -= 1;
+  unit_call_free (call);
+}
+
+/* Weights that were never set are reported as -1. */
+static GVariant *
+allocation_to_variant (const RAllocation *allocation)
+{
+  return g_variant_new ("(iittd)",
+                        allocation->cpu_weight == WEIGHT_IGNORE ? -1 : allocation->cpu_weight,
+                        allocation->io_weight == WEIGHT_IGNORE ? -1 : allocation->io_weight,
+                        allocation->memory_min,
+                        allocation->memory_low,
+                        allocation->uclamp_min);
 }
 
 static void
-set_unit_resources (RManager    *self,
-                    const char  *unit,
-                    RAllocation *allocation)
+emit_allocation_changed (RManager *self, const char *unit, const RAllocation *allocation)
+{
+  if (!self->dbus_obj)
+    return;
+
+  g_dbus_connection_emit_signal (self->connection,
+                                 NULL,
+                                 "/org/freedesktop/UResourced",
+                                 "org.freedesktop.UResourced",
+                                 "AllocationChanged",
+                                 g_variant_new ("(s@(iittd))", unit, allocation_to_variant (allocation)),
+                                 NULL);
+}
+
+/**
+ * send_unit_resources:
+ * @self: RManager
+ * @unit: The unit name
+ * @state: The state of the unit
+ *
+ * Sends the properties of the desired allocation that differ from what was
+ * sent before.
+ *
+ * Returns: %TRUE if a call was made
+ */
+static gboolean
+send_unit_resources (RManager *self, const char *unit, RUnitState *state)
 {
   GVariantBuilder builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("(sba(sv))"));
-  g_autofree char *cpu_weight = NULL;
-  g_autofree char *io_weight = NULL;
+  const RAllocation *allocation = &state->desired;
+  g_autoptr(GString) changes = NULL;
+  RAllocation sent;
+  RUnitCall *call;
+
+  changes = g_string_new (NULL);
 
   g_variant_builder_add (&builder, "s", unit);
   g_variant_builder_add (&builder, "b", TRUE);
   g_variant_builder_open (&builder, G_VARIANT_TYPE ("a(sv)"));
 
-  g_variant_builder_add (&builder, "(sv)", "MemoryMin", g_variant_new_uint64 (allocation->memory_min));
-  g_variant_builder_add (&builder, "(sv)", "MemoryLow", g_variant_new_uint64 (allocation->memory_low));
-  if (allocation->cpu_weight != WEIGHT_IGNORE)
+  if (!state->sent_valid || state->sent.memory_min != allocation->memory_min)
     {
-      g_variant_builder_add (&builder, "(sv)", "CPUWeight", g_variant_new_uint64 (allocation->cpu_weight));
-      cpu_weight = g_strdup_printf ("%d", allocation->cpu_weight);
+      g_variant_builder_add (&builder, "(sv)", "MemoryMin", g_variant_new_uint64 (allocation->memory_min));
+      g_string_append_printf (changes, ", MemoryMin: %" G_GUINT64_FORMAT, allocation->memory_min);
     }
-  else
+  if (!state->sent_valid || state->sent.memory_low != allocation->memory_low)
+    {
+      g_variant_builder_add (&builder, "(sv)", "MemoryLow", g_variant_new_uint64 (allocation->memory_low));
+      g_string_append_printf (changes, ", MemoryLow: %" G_GUINT64_FORMAT, allocation->memory_low);
+    }
+  if (allocation->cpu_weight != WEIGHT_IGNORE &&
+      (!state->sent_valid || state->sent.cpu_weight != allocation->cpu_weight))
     {
-      cpu_weight = g_strdup ("-");
+      g_variant_builder_add (&builder, "(sv)", "CPUWeight", g_variant_new_uint64 (allocation->cpu_weight));
+      g_string_append_printf (changes, ", CPUWeight: %d", allocation->cpu_weight);
     }
-  if (allocation->io_weight != WEIGHT_IGNORE)
+  if (allocation->io_weight != WEIGHT_IGNORE &&
+      (!state->sent_valid || state->sent.io_weight != allocation->io_weight))
     {
       g_variant_builder_add (&builder, "(sv)", "IOWeight", g_variant_new_uint64 (allocation->io_weight));
-      io_weight = g_strdup_printf ("%d", allocation->io_weight);
+      g_string_append_printf (changes, ", IOWeight: %d", allocation->io_weight);
     }
-  else
+
+  g_variant_builder_close (&builder);
+
+  if (changes->len == 0)
     {
-      io_weight = g_strdup ("-");
+      g_variant_builder_clear (&builder);
+      return FALSE;
     }
 
+  /* Weights that are ignored keep whatever was set before. */
+  sent = *allocation;
+  if (sent.cpu_weight == WEIGHT_IGNORE)
+    sent.cpu_weight = state->sent_valid ? state->sent.cpu_weight : WEIGHT_IGNORE;
+  if (sent.io_weight == WEIGHT_IGNORE)
+    sent.io_weight = state->sent_valid ? state->sent.io_weight : WEIGHT_IGNORE;
+  state->sent = sent;
+  state->sent_valid = TRUE;
 
-  g_variant_builder_close (&builder);
+  g_message ("Setting resources on %s (%s)", unit, changes->str + 2);
 
-  g_message ("Setting resources on %s (MemoryMin: %" G_GUINT64_FORMAT ", MemoryLow: %" G_GUINT64_FORMAT ", CPUWeight: %s, IOWeight: %s)",
-             unit,
-             allocation->memory_min,
-             allocation->memory_low,
-             cpu_weight,
-             io_weight);
+  call = g_new0 (RUnitCall, 1);
+  call->manager = self;
+  call->unit = g_strdup (unit);
+
+  /* The replay mock is a peer-to-peer connection without bus names. */
   g_dbus_connection_call (self->connection,
-                          "org.freedesktop.systemd1",
+                          g_dbus_connection_get_unique_name (self->connection) ? "org.freedesktop.systemd1" : NULL,
                           "/org/freedesktop/systemd1",
                           "org.freedesktop.systemd1.Manager",
                           "SetUnitProperties",
@@ -128,8 +326,175 @@ set_unit_resources (RManager    *self,
                           1000,
                           NULL,
                           set_unit_resources_cb,
-                          self);
+                          call);
   self->pending_calls += 1;
+  self->n_unit_calls += 1;
+  self->n_unit_calls_in_flight += 1;
+
+  emit_allocation_changed (self, unit, &state->sent);
+
+  return TRUE;
+}
+
+/**
+ * flush_unit_resources:
+ * @self: RManager
+ *
+ * Sends all queued unit updates. Everything that changed while handling one
+ * logind change (or reload) is coalesced into a single pass, units that
+ * ended up with the allocation they already have are skipped. Units are
+ * sent in the order they were last queued, so that user.slice is still
+ * raised before and lowered after the user units even if the direction
+ * changed within one pass.
+ */
+static void
+flush_unit_resources (RManager *self)
+{
+  guint n_dirty = 0;
+  guint n_sent = 0;
+  guint i;
+
+  g_clear_handle_id (&self->flush_id, g_source_remove);
+
+  if (!self->connection)
+    return;
+
+  n_dirty = self->dirty_units->len;
+  for (i = 0; i < self->dirty_units->len; i++)
+    {
+      const char *unit = g_ptr_array_index (self->dirty_units, i);
+      RUnitState *state;
+
+      state = g_hash_table_lookup (self->units, unit);
+      state->dirty = FALSE;
+      if (send_unit_resources (self, unit, state))
+        n_sent += 1;
+    }
+  g_ptr_array_set_size (self->dirty_units, 0);
+
+  if (self->forget_pending)
+    {
+      GHashTableIter iter;
+      gpointer value;
+
+      g_hash_table_iter_init (&iter, self->units);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          if (((RUnitState *) value)->forget)
+            g_hash_table_iter_remove (&iter);
+        }
+      self->forget_pending = FALSE;
+    }
+
+  if (n_dirty > 0)
+    g_debug ("Flushed %u unit updates with %u calls (total: %" G_GUINT64_FORMAT " updates, %" G_GUINT64_FORMAT " calls, %" G_GUINT64_FORMAT " failed)",
+             n_dirty, n_sent, self->n_unit_updates, self->n_unit_calls, self->n_unit_calls_failed);
+}
+
+static gboolean
+flush_unit_resources_cb (gpointer user_data)
+{
+  RManager *self = R_MANAGER (user_data);
+
+  self->flush_id = 0;
+  flush_unit_resources (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+set_unit_resources (RManager    *self,
+                    const char  *unit,
+                    RAllocation *allocation)
+{
+  RUnitState *state;
+
+  state = g_hash_table_lookup (self->units, unit);
+  if (!state)
+    {
+      state = g_new0 (RUnitState, 1);
+      g_hash_table_insert (self->units, g_strdup (unit), state);
+    }
+
+  state->desired = *allocation;
+  state->forget = FALSE;
+  if (state->dirty)
+    {
+      guint index;
+
+      /* Re-queued, move it to the end to keep the latest ordering. */
+      if (g_ptr_array_find_with_equal_func (self->dirty_units, unit, g_str_equal, &index))
+        g_ptr_array_remove_index (self->dirty_units, index);
+    }
+  state->dirty = TRUE;
+  g_ptr_array_add (self->dirty_units, g_strdup (unit));
+  self->n_unit_updates += 1;
+
+  if (!self->flush_id)
+    self->flush_id = g_idle_add (flush_unit_resources_cb, self);
+}
+
+/* The units of a user that logged out are garbage collected by systemd and
+ * come back with their defaults. */
+static void
+forget_user_units (RManager *self, uid_t uid)
+{
+  g_autofree char *user_slice = NULL;
+  g_autofree char *user_service = NULL;
+  RUnitState *state;
+
+  user_slice = g_strdup_printf ("user-%i.slice", uid);
+  user_service = g_strdup_printf ("user@%i.service", uid);
+
+  state = g_hash_table_lookup (self->units, user_slice);
+  if (state)
+    state->forget = TRUE;
+  state = g_hash_table_lookup (self->units, user_service);
+  if (state)
+    state->forget = TRUE;
+
+  self->forget_pending = TRUE;
+  if (!self->flush_id)
+    self->flush_id = g_idle_add (flush_unit_resources_cb, self);
+}
+
+/**
+ * set_cgroup_uclamp_min:
+ * @self: RManager
+ * @cgroup: Path of the cgroup below /sys/fs/cgroup
+ * @uclamp_min: Minimum utilisation in percent
+ *
+ * The user daemon can only set cpu.uclamp.min inside the user manager. As
+ * the effective value is capped by all ancestors, the slices above it need
+ * to be raised here. systemd has no property for this, so cgroupfs is
+ * written directly.
+ */
+static void
+set_cgroup_uclamp_min (RManager *self, const char *cgroup, gdouble uclamp_min)
+{
+  g_autofree char *path = NULL;
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  if (!self->uclamp_used)
+    return;
+
+  path = g_build_filename ("/sys/fs/cgroup", cgroup, NULL);
+  g_ascii_formatd (buf, sizeof (buf), "%.2f", uclamp_min);
+
+  g_message ("Setting resources on %s (CPUUClampMin: %s)", cgroup, buf);
+  write_cgroup_attribute (path, "cpu.uclamp.min", buf);
+}
+
+static guint64
+get_user_slice_memory_min (RManager *self, guint active_users)
+{
+  return MIN (active_users * self->active_user.memory_min, self->max_users_memory_min);
+}
+
+static guint64
+get_user_slice_memory_low (RManager *self, guint active_users)
+{
+  return MIN (active_users * self->active_user.memory_low, self->max_users_memory_low);
 }
 
 static void
@@ -141,10 +506,86 @@ set_user_slice_resources (RManager *self, gint active_users)
 
   alloc.io_weight = WEIGHT_IGNORE;
   alloc.cpu_weight = WEIGHT_IGNORE;
-  alloc.memory_min = MIN (active_users * self->active_user.memory_min, self->max_users_memory_min);
-  alloc.memory_low = MIN (active_users * self->active_user.memory_low, self->max_users_memory_low);
+  alloc.memory_min = get_user_slice_memory_min (self, active_users);
+  alloc.memory_low = get_user_slice_memory_low (self, active_users);
 
   set_unit_resources (self, "user.slice", &alloc);
+  set_cgroup_uclamp_min (self, "user.slice", active_users > 0 ? self->active_user.uclamp_min : 0);
+}
+
+/**
+ * update_fair_shares:
+ * @self: RManager
+ * @graphical_users: The active users
+ *
+ * Splits the memory protection of user.slice among the active users in
+ * proportion to their weight (local or remote sessions). The remainder of
+ * the integer division is handed out byte by byte, so that the shares add
+ * up to exactly the allocation of user.slice.
+ */
+static void
+update_fair_shares (RManager *self, GArray *graphical_users)
+{
+  guint64 budget_min, budget_low;
+  guint64 rest_min, rest_low;
+  guint64 total_weight = 0;
+  guint i;
+
+  g_hash_table_remove_all (self->fair_shares);
+  if (!self->fair_share || graphical_users->len == 0)
+    return;
+
+  for (i = 0; i < graphical_users->len; i++)
+    {
+      uid_t uid = g_array_index (graphical_users, uid_t, i);
+
+      total_weight += r_sd_login_user_is_remote (self->login, uid) ?
+                      self->fair_share_remote_weight :
+                      self->fair_share_local_weight;
+    }
+
+  budget_min = get_user_slice_memory_min (self, graphical_users->len);
+  budget_low = get_user_slice_memory_low (self, graphical_users->len);
+  rest_min = budget_min;
+  rest_low = budget_low;
+
+  for (i = 0; i < graphical_users->len; i++)
+    {
+      uid_t uid = g_array_index (graphical_users, uid_t, i);
+      RAllocation *share;
+      guint64 weight;
+
+      weight = r_sd_login_user_is_remote (self->login, uid) ?
+               self->fair_share_remote_weight :
+               self->fair_share_local_weight;
+
+      share = g_new (RAllocation, 1);
+      *share = self->active_user;
+      share->memory_min = budget_min / total_weight * weight + budget_min % total_weight * weight / total_weight;
+      share->memory_low = budget_low / total_weight * weight + budget_low % total_weight * weight / total_weight;
+      rest_min -= share->memory_min;
+      rest_low -= share->memory_low;
+
+      g_hash_table_insert (self->fair_shares, GUINT_TO_POINTER (uid), share);
+    }
+
+  /* At most one byte per user is left over. */
+  for (i = 0; i < graphical_users->len && (rest_min > 0 || rest_low > 0); i++)
+    {
+      RAllocation *share;
+
+      share = g_hash_table_lookup (self->fair_shares, GUINT_TO_POINTER (g_array_index (graphical_users, uid_t, i)));
+      if (rest_min > 0)
+        {
+          share->memory_min += 1;
+          rest_min -= 1;
+        }
+      if (rest_low > 0)
+        {
+          share->memory_low += 1;
+          rest_low -= 1;
+        }
+    }
 }
 
 static void
@@ -152,23 +593,41 @@ set_user_resources (RManager *self, uid_t uid, gboolean active)
 {
   g_autofree char *user_slice = NULL;
   g_autofree char *user_service = NULL;
+  g_autofree char *user_slice_cgroup = NULL;
+  g_autofree char *user_service_cgroup = NULL;
+  RAllocation *active_user;
+  gdouble uclamp_min;
 
   g_debug ("User %d is now %s", uid, active ? "active" : "inactive");
 
+  active_user = g_hash_table_lookup (self->fair_shares, GUINT_TO_POINTER (uid));
+  if (!active_user)
+    active_user = &self->active_user;
+
   user_slice = g_strdup_printf ("user-%i.slice", uid);
   user_service = g_strdup_printf ("user@%i.service", uid);
 
+  /* Raise the slice before the service, lower it after. */
+  uclamp_min = active ? self->active_user.uclamp_min : self->inactive_user.uclamp_min;
+  user_slice_cgroup = g_strdup_printf ("user.slice/%s", user_slice);
+  user_service_cgroup = g_strdup_printf ("user.slice/%s/%s", user_slice, user_service);
+  if (active)
+    set_cgroup_uclamp_min (self, user_slice_cgroup, uclamp_min);
+  set_cgroup_uclamp_min (self, user_service_cgroup, uclamp_min);
+  if (!active)
+    set_cgroup_uclamp_min (self, user_slice_cgroup, uclamp_min);
+
   if (active)
     {
-      set_unit_resources (self, user_slice, &self->active_user);
+      set_unit_resources (self, user_slice, active_user);
 
       /* Only delegate memory allocation to user manager if the user appears
        * to run their graphical session using systemd.
        * Otherwise most memory should be inside the session scope. Which is
        * elsewhere in the hierarchy.
        */
-      if (user_has_systemd_graphical (uid))
-        set_unit_resources (self, user_service, &self->active_user);
+      if (user_has_systemd_graphical (self, uid))
+        set_unit_resources (self, user_service, active_user);
       else
         set_unit_resources (self, user_service, &self->inactive_user);
     }
@@ -179,9 +638,342 @@ set_user_resources (RManager *self, uid_t uid, gboolean active)
     }
 }
 
+static void
+add_user_cgroup_watch (RManager *self, uid_t uid, const char *path)
+{
+  gint wd;
+
+  wd = inotify_add_watch (self->inotify_fd, path, IN_CREATE | IN_DELETE | IN_ONLYDIR);
+  if (wd < 0)
+    return;
+
+  g_debug ("Watching %s using wd %d", path, wd);
+  g_hash_table_insert (self->user_wds, GINT_TO_POINTER (wd), GUINT_TO_POINTER (uid));
+}
+
+/**
+ * watch_user_cgroups:
+ * @self: RManager
+ * @uid: The user
+ *
+ * Watches user-UID.slice and user@UID.service (as far as they exist) so that
+ * the user daemon starting or stopping in the user manager is noticed right
+ * away. Missing directories are picked up once they are created.
+ */
+static void
+watch_user_cgroups (RManager *self, uid_t uid)
+{
+  g_autofree char *user_slice_path = NULL;
+  g_autofree char *user_service_path = NULL;
+
+  if (self->inotify_fd < 0)
+    return;
+
+  user_slice_path = g_strdup_printf (USER_SLICE_CGROUP_PATH "/user-%i.slice", uid);
+  user_service_path = g_strdup_printf ("%s/user@%i.service", user_slice_path, uid);
+
+  add_user_cgroup_watch (self, uid, user_slice_path);
+  add_user_cgroup_watch (self, uid, user_service_path);
+}
+
+static void
+unwatch_user_cgroups (RManager *self, uid_t uid)
+{
+  GHashTableIter iter;
+  gpointer wd, value;
+
+  if (self->inotify_fd < 0)
+    return;
+
+  g_hash_table_iter_init (&iter, self->user_wds);
+  while (g_hash_table_iter_next (&iter, &wd, &value))
+    {
+      if (GPOINTER_TO_UINT (value) != uid)
+        continue;
+
+      inotify_rm_watch (self->inotify_fd, GPOINTER_TO_INT (wd));
+      g_hash_table_iter_remove (&iter);
+    }
+}
+
+static gboolean
+user_is_graphical (RManager *self, uid_t uid)
+{
+  return g_array_binary_search (self->graphical_users, &uid, uid_cmp, NULL);
+}
+
+/* Whether users run the user daemon changes without logind noticing, so it
+ * is recorded with the logind state. */
+static void
+trace_logind_state (RManager *self, GArray *all_users, GArray *graphical_users)
+{
+  g_autoptr(GArray) remote_users = NULL;
+  g_autoptr(GArray) systemd_graphical_users = NULL;
+  guint i;
+
+  if (!self->trace)
+    return;
+
+  remote_users = g_array_new (FALSE, FALSE, sizeof (uid_t));
+  for (i = 0; i < graphical_users->len; i++)
+    {
+      uid_t uid = g_array_index (graphical_users, uid_t, i);
+
+      if (r_sd_login_user_is_remote (self->login, uid))
+        g_array_append_val (remote_users, uid);
+    }
+
+  systemd_graphical_users = g_array_new (FALSE, FALSE, sizeof (uid_t));
+  for (i = 0; i < all_users->len; i++)
+    {
+      uid_t uid = g_array_index (all_users, uid_t, i);
+
+      if (user_has_systemd_graphical (self, uid))
+        g_array_append_val (systemd_graphical_users, uid);
+    }
+
+  r_trace_writer_add_logind (self->trace, all_users, graphical_users,
+                             remote_users, systemd_graphical_users);
+}
+
+static void
+handle_user_cgroup_event (RManager *self, struct inotify_event *event)
+{
+  gpointer value;
+  uid_t uid;
+
+  if (event->mask & IN_IGNORED)
+    {
+      g_hash_table_remove (self->user_wds, GINT_TO_POINTER (event->wd));
+      return;
+    }
+
+  if (event->len == 0 || !(event->mask & (IN_CREATE | IN_DELETE)))
+    return;
+
+  if (event->wd == self->user_slice_wd)
+    {
+      gchar *end;
+
+      /* A slice of a user we already know about appeared. */
+      if (!g_str_has_prefix (event->name, "user-") || !(event->mask & IN_CREATE))
+        return;
+
+      uid = g_ascii_strtoull (event->name + strlen ("user-"), &end, 10);
+      if (g_str_equal (end, ".slice") &&
+          g_array_binary_search (self->all_users, &uid, uid_cmp, NULL))
+        watch_user_cgroups (self, uid);
+
+      return;
+    }
+
+  if (!g_hash_table_lookup_extended (self->user_wds, GINT_TO_POINTER (event->wd), NULL, &value))
+    return;
+  uid = GPOINTER_TO_UINT (value);
+
+  if (g_str_has_prefix (event->name, "user@") && (event->mask & IN_CREATE))
+    {
+      /* The user daemon may already be running by the time we watch. */
+      watch_user_cgroups (self, uid);
+      trace_logind_state (self, self->all_users, self->graphical_users);
+      if (user_is_graphical (self, uid))
+        set_user_resources (self, uid, TRUE);
+    }
+  else if (g_str_equal (event->name, "uresourced.service"))
+    {
+      g_debug ("User daemon of user %d %s", uid, (event->mask & IN_CREATE) ? "started" : "stopped");
+      trace_logind_state (self, self->all_users, self->graphical_users);
+      if (user_is_graphical (self, uid))
+        set_user_resources (self, uid, TRUE);
+    }
+}
+
+static gboolean
+received_inotify_data (GIOChannel  *channel,
+                       GIOCondition cond G_GNUC_UNUSED,
+                       gpointer     user_data)
+{
+  RManager *self = R_MANAGER (user_data);
+  gchar buffer[INOTIFY_EVENT_BUF_LEN];
+  GIOStatus status;
+  gsize bytes_read;
+  gchar *p;
+
+  status = g_io_channel_read_chars (channel, buffer, sizeof (buffer) - 1,
+                                    &bytes_read, NULL);
+
+  if (status != G_IO_STATUS_NORMAL && status != G_IO_STATUS_AGAIN)
+    {
+      self->inotify_watch_id = 0;
+      return G_SOURCE_REMOVE;
+    }
+
+  if (status == G_IO_STATUS_NORMAL)
+    {
+      for (p = buffer; p < buffer + bytes_read;)
+        {
+          struct inotify_event *event = (struct inotify_event *) p;
+
+          handle_user_cgroup_event (self, event);
+          p += sizeof (struct inotify_event) + event->len;
+        }
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+start_user_cgroup_monitor (RManager *self)
+{
+  self->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (self->inotify_fd < 0)
+    {
+      g_warning ("Could not watch user cgroups, relying on the user daemon to call Update: %m");
+      return;
+    }
+
+  self->user_slice_wd = inotify_add_watch (self->inotify_fd, USER_SLICE_CGROUP_PATH,
+                                           IN_CREATE | IN_ONLYDIR);
+  if (self->user_slice_wd < 0)
+    g_warning ("Could not watch " USER_SLICE_CGROUP_PATH ": %m");
+
+  self->inotify_channel = g_io_channel_unix_new (self->inotify_fd);
+  g_io_channel_set_close_on_unref (self->inotify_channel, TRUE);
+  g_io_channel_set_encoding (self->inotify_channel, NULL, NULL);
+  g_io_channel_set_buffered (self->inotify_channel, FALSE);
+
+  self->inotify_watch_id = g_io_add_watch (self->inotify_channel,
+                                           G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+                                           received_inotify_data, self);
+}
+
+static void
+stop_user_cgroup_monitor (RManager *self)
+{
+  g_clear_handle_id (&self->inotify_watch_id, g_source_remove);
+  g_hash_table_remove_all (self->user_wds);
+
+  /* The channel owns the fd. */
+  if (self->inotify_channel)
+    {
+      g_io_channel_shutdown (self->inotify_channel, FALSE, NULL);
+      g_clear_pointer (&self->inotify_channel, g_io_channel_unref);
+    }
+  else if (self->inotify_fd >= 0)
+    {
+      close (self->inotify_fd);
+    }
+  self->inotify_fd = -1;
+  self->user_slice_wd = -1;
+}
+
+static void
+usage_track_user (RManager *self, uid_t uid)
+{
+  g_autofree char *user_slice = NULL;
+  g_autofree char *path = NULL;
+
+  if (!self->usage)
+    return;
+
+  user_slice = g_strdup_printf ("user-%i.slice", uid);
+  path = g_strdup_printf (USER_SLICE_CGROUP_PATH "/%s", user_slice);
+  r_usage_sampler_add_cgroup (self->usage, user_slice, path);
+}
+
+static void
+usage_untrack_user (RManager *self, uid_t uid)
+{
+  g_autofree char *user_slice = NULL;
+
+  if (!self->usage)
+    return;
+
+  user_slice = g_strdup_printf ("user-%i.slice", uid);
+  r_usage_sampler_remove_cgroup (self->usage, user_slice);
+}
+
+static gboolean
+usage_sample_cb (gpointer user_data)
+{
+  RManager *self = R_MANAGER (user_data);
+
+  r_usage_sampler_sample (self->usage);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/**
+ * usage_sampler_setup:
+ * @self: RManager
+ *
+ * (Re-)creates the usage sampler if sampling was enabled or its
+ * configuration changed. The history is dropped in that case.
+ */
+static void
+usage_sampler_setup (RManager *self)
+{
+  guint i;
+
+  if (self->usage_sampler_interval_sec == self->usage_interval_sec &&
+      self->usage_sampler_n_samples == self->usage_n_samples)
+    return;
+
+  g_clear_handle_id (&self->usage_sample_id, g_source_remove);
+  g_clear_pointer (&self->usage, r_usage_sampler_free);
+
+  self->usage_sampler_interval_sec = self->usage_interval_sec;
+  self->usage_sampler_n_samples = self->usage_n_samples;
+  if (self->usage_interval_sec == 0)
+    return;
+
+  g_debug ("Sampling usage every %u seconds, keeping %u samples",
+           self->usage_interval_sec, self->usage_n_samples);
+
+  self->usage = r_usage_sampler_new (self->usage_n_samples);
+  r_usage_sampler_add_cgroup (self->usage, "user.slice", USER_SLICE_CGROUP_PATH);
+  for (i = 0; i < self->all_users->len; i++)
+    usage_track_user (self, g_array_index (self->all_users, uid_t, i));
+
+  r_usage_sampler_sample (self->usage);
+  self->usage_sample_id = g_timeout_add_seconds (self->usage_interval_sec, usage_sample_cb, self);
+}
+
+static GVariant *
+uid_array_to_variant (GArray *uids)
+{
+  return g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32,
+                                    uids->data, uids->len, sizeof (uid_t));
+}
+
+static void
+emit_users_changed (RManager *self, gboolean all_changed, gboolean graphical_changed)
+{
+  GVariantBuilder builder;
+
+  if (!self->dbus_obj || (!all_changed && !graphical_changed))
+    return;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  if (all_changed)
+    g_variant_builder_add (&builder, "{sv}", "Users", uid_array_to_variant (self->all_users));
+  if (graphical_changed)
+    g_variant_builder_add (&builder, "{sv}", "ActiveUsers", uid_array_to_variant (self->graphical_users));
+
+  g_dbus_connection_emit_signal (self->connection,
+                                 NULL,
+                                 "/org/freedesktop/UResourced",
+                                 "org.freedesktop.DBus.Properties",
+                                 "PropertiesChanged",
+                                 g_variant_new ("(sa{sv}as)", "org.freedesktop.UResourced", &builder, NULL),
+                                 NULL);
+}
+
 static void
 updat_user_allocations (RManager *self, gboolean force_active)
 {
+  gboolean all_changed;
+  gboolean graphical_changed;
   GArray *all_users;
   GArray *graphical_users;
   guint i;
@@ -191,6 +983,13 @@ updat_user_allocations (RManager *self, gboolean force_active)
   /* Users are "graphical" if they have at least one active graphical session. */
   r_sd_login_get_users (self->login, &all_users, &graphical_users);
 
+  trace_logind_state (self, all_users, graphical_users);
+
+  /* All shares change with the number of active users. */
+  update_fair_shares (self, graphical_users);
+  if (self->fair_share)
+    force_active = TRUE;
+
   /* Sync up user slice if resources might have increased */
   if (graphical_users->len > self->graphical_users->len)
     set_user_slice_resources (self, graphical_users->len);
@@ -211,6 +1010,12 @@ updat_user_allocations (RManager *self, gboolean force_active)
     {
       uid_t uid = g_array_index (all_users, uid_t, i);
 
+      if (!g_array_binary_search (self->all_users, &uid, uid_cmp, NULL))
+        {
+          watch_user_cgroups (self, uid);
+          usage_track_user (self, uid);
+        }
+
       if (g_array_binary_search (graphical_users, &uid, uid_cmp, NULL))
         continue;
 
@@ -231,12 +1036,28 @@ updat_user_allocations (RManager *self, gboolean force_active)
   if (graphical_users->len < self->graphical_users->len)
     set_user_slice_resources (self, graphical_users->len);
 
+  for (i = 0; i < self->all_users->len; i++)
+    {
+      uid_t uid = g_array_index (self->all_users, uid_t, i);
+
+      if (!g_array_binary_search (all_users, &uid, uid_cmp, NULL))
+        {
+          unwatch_user_cgroups (self, uid);
+          usage_untrack_user (self, uid);
+          forget_user_units (self, uid);
+        }
+    }
+
   /* Finally, store the current state. */
+  graphical_changed = !uid_array_equal (self->graphical_users, graphical_users);
   g_clear_pointer (&self->graphical_users, g_array_unref);
   self->graphical_users = g_array_copy (graphical_users);
 
+  all_changed = !uid_array_equal (self->all_users, all_users);
   g_clear_pointer (&self->all_users, g_array_unref);
   self->all_users = g_array_copy (all_users);
+
+  emit_users_changed (self, all_changed, graphical_changed);
 }
 
 static void
@@ -256,52 +1077,225 @@ r_manager_finalize (GObject *object)
 {
   RManager *self = (RManager *)object;
 
+  g_clear_handle_id (&self->config_reload_id, g_source_remove);
+  g_clear_handle_id (&self->flush_id, g_source_remove);
+  g_clear_handle_id (&self->ram_check_id, g_source_remove);
+  g_clear_handle_id (&self->adaptive_eval_id, g_source_remove);
+  g_clear_object (&self->psi);
+  g_clear_handle_id (&self->usage_sample_id, g_source_remove);
+  g_clear_pointer (&self->usage, r_usage_sampler_free);
+  g_clear_pointer (&self->fair_shares, g_hash_table_destroy);
+  g_clear_pointer (&self->config, g_key_file_unref);
+  g_clear_pointer (&self->config_path, g_free);
+  g_clear_pointer (&self->systemd_graphical_users, g_array_unref);
+  stop_user_cgroup_monitor (self);
+  g_clear_pointer (&self->user_wds, g_hash_table_destroy);
+  g_clear_object (&self->config_monitor);
   g_clear_object (&self->connection);
+  g_clear_pointer (&self->dirty_units, g_ptr_array_unref);
+  g_clear_pointer (&self->units, g_hash_table_destroy);
   g_clear_object (&self->login);
   g_clear_pointer (&self->all_users, g_array_unref);
   g_clear_pointer (&self->graphical_users, g_array_unref);
 
-  /* Currently we rely on things to be flushed before destroyed, which really is fair ... */
-  g_assert (self->pending_calls == 0);
+  /* Currently we rely on things to be flushed before destroyed, which really is fair ... */
+  g_assert (self->pending_calls == 0);
+
+  G_OBJECT_CLASS (r_manager_parent_class)->finalize (object);
+}
+
+static void
+r_manager_class_init (RManagerClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = r_manager_finalize;
+
+  g_signal_new ("quit",
+                R_TYPE_MANAGER, G_SIGNAL_RUN_LAST,
+                0,
+                NULL, NULL,
+                NULL,
+                G_TYPE_NONE, 0);
+}
+
+static void
+r_manager_init (RManager *self)
+{
+  self->pending_calls = 0;
+  self->graphical_users = g_array_new (FALSE, FALSE, sizeof(uid_t));
+  self->all_users = g_array_new (FALSE, FALSE, sizeof(uid_t));
+  self->units = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->dirty_units = g_ptr_array_new_with_free_func (g_free);
+  self->user_wds = g_hash_table_new (NULL, NULL);
+  self->fair_shares = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+  self->inotify_fd = -1;
+  self->user_slice_wd = -1;
+  self->config_path = g_strdup (SYSCONFDIR "/uresourced.conf");
+
+  /* Neutral/no-protection values. */
+  self->active_user.io_weight = WEIGHT_IGNORE;
+  self->active_user.cpu_weight = WEIGHT_IGNORE;
+
+  self->inactive_user.io_weight = 100;
+  self->inactive_user.cpu_weight = 100;
+
+  self->session_slice.io_weight = WEIGHT_IGNORE;
+  self->session_slice.cpu_weight = WEIGHT_IGNORE;
+
+  /* Get the amount of available RAM, check_available_ram() tracks changes */
+  self->available_ram = get_available_ram ();
+  g_debug ("Detected %" G_GUINT64_FORMAT " bytes of RAM", self->available_ram);
+}
+
+/* Applies the current adaptive level to the active user allocation */
+static void
+adaptive_memory_update_allocation (RManager *self)
+{
+  if (!self->adaptive_memory)
+    self->adaptive_level = 0;
+
+  self->active_user.memory_min = self->adaptive_base_min +
+    (guint64) (self->adaptive_level * (self->adaptive_max_min - self->adaptive_base_min));
+  self->active_user.memory_low = self->adaptive_base_low +
+    (guint64) (self->adaptive_level * (self->adaptive_max_low - self->adaptive_base_low));
+}
+
+static void
+adaptive_memory_sample (RManager *self)
+{
+  if (!r_psi_read_some_total (USER_SLICE_CGROUP_PATH "/memory.pressure", &self->user_stall_total))
+    self->user_stall_total = 0;
+  if (!r_psi_read_some_total ("/sys/fs/cgroup/system.slice/memory.pressure", &self->system_stall_total))
+    self->system_stall_total = 0;
+  self->stall_sample_time = g_get_monotonic_time ();
+}
+
+/**
+ * adaptive_memory_evaluate:
+ * @user_data: RManager
+ *
+ * Compares the share of time user.slice and system.slice were stalled on
+ * memory since the last evaluation. If user.slice is the one stalling, the
+ * protection of the active user grows towards the configured maximum, if
+ * system.slice is, it shrinks towards the ActiveUser values. The total for
+ * user.slice remains capped by MaxMemoryMin/MaxMemoryLow.
+ *
+ * Returns: %G_SOURCE_REMOVE once pressure has been calm for a while
+ */
+static gboolean
+adaptive_memory_evaluate (gpointer user_data)
+{
+  RManager *self = R_MANAGER (user_data);
+  guint64 user_stall_total = self->user_stall_total;
+  guint64 system_stall_total = self->system_stall_total;
+  gint64 sample_time = self->stall_sample_time;
+  gdouble user_stall, system_stall;
+  gdouble old_level = self->adaptive_level;
+  gdouble elapsed;
+  guint i;
+
+  adaptive_memory_sample (self);
+  elapsed = MAX (self->stall_sample_time - sample_time, 1);
+
+  /* In percent of the elapsed time, counters may reset with the cgroup. */
+  user_stall = self->user_stall_total >= user_stall_total ?
+               (self->user_stall_total - user_stall_total) * 100.0 / elapsed : 0;
+  system_stall = self->system_stall_total >= system_stall_total ?
+                 (self->system_stall_total - system_stall_total) * 100.0 / elapsed : 0;
+
+  if (user_stall >= self->adaptive_stall_threshold && user_stall >= system_stall)
+    self->adaptive_level = MIN (self->adaptive_level + ADAPTIVE_STEP, 1.0);
+  else if (system_stall >= self->adaptive_stall_threshold && system_stall > user_stall)
+    self->adaptive_level = MAX (self->adaptive_level - ADAPTIVE_STEP, 0.0);
+
+  if (user_stall < self->adaptive_stall_threshold && system_stall < self->adaptive_stall_threshold)
+    self->adaptive_calm_rounds += 1;
+  else
+    self->adaptive_calm_rounds = 0;
+
+  if (self->adaptive_level != old_level)
+    {
+      adaptive_memory_update_allocation (self);
+
+      g_message ("Adapting active user protection to MemoryMin: %" G_GUINT64_FORMAT ", MemoryLow: %" G_GUINT64_FORMAT " (user.slice stall: %.1f%%, system.slice stall: %.1f%%)",
+                 self->active_user.memory_min, self->active_user.memory_low,
+                 user_stall, system_stall);
 
-  G_OBJECT_CLASS (r_manager_parent_class)->finalize (object);
+      if (self->connection)
+        {
+          update_fair_shares (self, self->graphical_users);
+          set_user_slice_resources (self, self->graphical_users->len);
+          for (i = 0; i < self->graphical_users->len; i++)
+            set_user_resources (self, g_array_index (self->graphical_users, uid_t, i), TRUE);
+        }
+    }
+
+  if (self->adaptive_calm_rounds >= ADAPTIVE_CALM_ROUNDS)
+    {
+      g_debug ("Memory pressure calmed down, adaptive protection level is %.2f", self->adaptive_level);
+      self->adaptive_eval_id = 0;
+      return G_SOURCE_REMOVE;
+    }
+
+  return G_SOURCE_CONTINUE;
 }
 
 static void
-r_manager_class_init (RManagerClass *klass)
+psi_triggered_cb (RManager    *self,
+                  const gchar *path)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
-
-  object_class->finalize = r_manager_finalize;
+  self->adaptive_calm_rounds = 0;
+  if (self->adaptive_eval_id)
+    return;
 
-  g_signal_new ("quit",
-                R_TYPE_MANAGER, G_SIGNAL_RUN_LAST,
-                0,
-                NULL, NULL,
-                NULL,
-                G_TYPE_NONE, 0);
+  g_debug ("Memory pressure on %s, evaluating adaptive protection", path);
+  adaptive_memory_sample (self);
+  self->adaptive_eval_id = g_timeout_add (ADAPTIVE_EVAL_INTERVAL_MSEC, adaptive_memory_evaluate, self);
 }
 
+/**
+ * adaptive_memory_setup:
+ * @self: RManager
+ *
+ * Registers the PSI triggers when adaptive protection is configured and
+ * drops them (resetting the protection to its lower bound) when it is not.
+ */
 static void
-r_manager_init (RManager *self)
+adaptive_memory_setup (RManager *self)
 {
-  self->pending_calls = 0;
-  self->graphical_users = g_array_new (FALSE, FALSE, sizeof(uid_t));
-  self->all_users = g_array_new (FALSE, FALSE, sizeof(uid_t));
+  const char *paths[] = {
+    "/proc/pressure/memory",
+    USER_SLICE_CGROUP_PATH "/memory.pressure",
+    "/sys/fs/cgroup/system.slice/memory.pressure",
+  };
+  guint i;
 
-  /* Neutral/no-protection values. */
-  self->active_user.io_weight = WEIGHT_IGNORE;
-  self->active_user.cpu_weight = WEIGHT_IGNORE;
+  if (!self->adaptive_memory)
+    {
+      g_clear_handle_id (&self->adaptive_eval_id, g_source_remove);
+      g_clear_object (&self->psi);
+      return;
+    }
 
-  self->inactive_user.io_weight = 100;
-  self->inactive_user.cpu_weight = 100;
+  if (self->psi)
+    return;
 
-  self->session_slice.io_weight = WEIGHT_IGNORE;
-  self->session_slice.cpu_weight = WEIGHT_IGNORE;
+  self->psi = r_psi_monitor_new ();
+  g_signal_connect_object (self->psi, "triggered",
+                           G_CALLBACK (psi_triggered_cb),
+                           self, G_CONNECT_SWAPPED);
 
-  /* Get the amount of available RAM (we assume this never changes after start) */
-  self->available_ram = get_available_ram ();
-  g_debug ("Detected %" G_GUINT64_FORMAT " bytes of RAM", self->available_ram);
+  for (i = 0; i < G_N_ELEMENTS (paths); i++)
+    {
+      g_autoptr(GError) error = NULL;
+
+      if (!r_psi_monitor_add_trigger (self->psi, paths[i],
+                                      ADAPTIVE_TRIGGER_STALL_USEC,
+                                      ADAPTIVE_TRIGGER_WINDOW_USEC,
+                                      &error))
+        g_warning ("Adaptive memory protection: %s", error->message);
+    }
 }
 
 static guint64
@@ -312,53 +1306,12 @@ config_get_memory (RManager *self,
                    GError **error)
 {
   g_autofree char* value_string = NULL;
-  guint64 res;
-  char *end = NULL;
 
   value_string = g_key_file_get_string (file, group_name, key, error);
   if (!value_string)
     return 0;
 
-  res = g_ascii_strtoll (value_string, &end, 10);
-  if (end == value_string)
-    {
-      g_set_error_literal (error,
-                           G_KEY_FILE_ERROR,
-                           G_KEY_FILE_ERROR_INVALID_VALUE,
-                           "Could not parse memory key");
-      return 0;
-    }
-
-  if (end && *end)
-    {
-      switch (*end)
-        {
-          case 'K':
-            res = res * 1024;
-            break;
-          case 'M':
-            res = res * 1024 * 1024;
-            break;
-          case 'G':
-            res = res * 1024 * 1024 * 1024;
-            break;
-          case 'T':
-            res = res * 1024 * 1024 * 1024 * 1024;
-            break;
-          case '%':
-            res = MIN(100, res) * self->available_ram / 100;
-            break;
-
-          default:
-            g_set_error (error,
-                         G_KEY_FILE_ERROR,
-                         G_KEY_FILE_ERROR_INVALID_VALUE,
-                         "Unknown unit %c", *end);
-            return 0;
-        }
-    }
-
-  return res;
+  return parse_size (value_string, self->available_ram, error);
 }
 
 static inline void
@@ -379,18 +1332,13 @@ check_clear_error (GError **error, const char *group, const char *key)
 }
 
 static void
-read_config (RManager *self)
+parse_config (RManager *self)
 {
-  g_autoptr(GKeyFile) file = NULL;
+  GKeyFile *file = self->config;
   g_autoptr(GError) error = NULL;
 
-  file = g_key_file_new ();
-
-  if (!g_key_file_load_from_file (file, SYSCONFDIR "/uresourced.conf", G_KEY_FILE_NONE, &error))
-    {
-      g_warning ("Could not read configuration file: %s", error->message);
-      return;
-    }
+  if (!file)
+    return;
 
   self->max_users_memory_min = config_get_memory (self, file, "Global", "MaxMemoryMin", &error);
   check_clear_error (&error, "Global", "MaxMemoryMin");
@@ -412,6 +1360,68 @@ read_config (RManager *self)
   self->active_user.io_weight = g_key_file_get_integer (file, "ActiveUser", "IOWeight", &error);
   check_clear_error (&error, "ActiveUser", "IOWeight");
 
+  self->active_user.uclamp_min = CLAMP (g_key_file_get_double (file, "ActiveUser", "UClampMin", &error), 0, 100);
+  check_clear_error (&error, "ActiveUser", "UClampMin");
+  if (self->active_user.uclamp_min > 0)
+    self->uclamp_used = TRUE;
+
+  /* Adaptive protection on top of the ActiveUser allocation */
+  self->adaptive_base_min = self->active_user.memory_min;
+  self->adaptive_base_low = self->active_user.memory_low;
+
+  self->adaptive_max_min = config_get_memory (self, file, "AdaptiveMemory", "MaxMemoryMin", &error);
+  check_clear_error (&error, "AdaptiveMemory", "MaxMemoryMin");
+  self->adaptive_max_min = MAX (self->adaptive_max_min, self->adaptive_base_min);
+
+  self->adaptive_max_low = config_get_memory (self, file, "AdaptiveMemory", "MaxMemoryLow", &error);
+  check_clear_error (&error, "AdaptiveMemory", "MaxMemoryLow");
+  self->adaptive_max_low = MAX (self->adaptive_max_low, self->adaptive_base_low);
+
+  self->adaptive_stall_threshold = g_key_file_get_double (file, "AdaptiveMemory", "StallThreshold", &error);
+  if (error)
+    {
+      check_clear_error (&error, "AdaptiveMemory", "StallThreshold");
+      self->adaptive_stall_threshold = 5;
+    }
+  self->adaptive_stall_threshold = CLAMP (self->adaptive_stall_threshold, 0.1, 100);
+
+  self->adaptive_memory = self->adaptive_max_min > self->adaptive_base_min ||
+                          self->adaptive_max_low > self->adaptive_base_low;
+
+  self->usage_interval_sec = g_key_file_get_integer (file, "Usage", "SampleIntervalSec", &error);
+  if (error)
+    {
+      check_clear_error (&error, "Usage", "SampleIntervalSec");
+      self->usage_interval_sec = 10;
+    }
+
+  self->usage_n_samples = g_key_file_get_integer (file, "Usage", "Samples", &error);
+  if (error)
+    {
+      check_clear_error (&error, "Usage", "Samples");
+      self->usage_n_samples = 60;
+    }
+  self->usage_n_samples = CLAMP (self->usage_n_samples, 1, 10000);
+
+  self->fair_share = g_key_file_get_boolean (file, "FairShare", "Enable", &error);
+  check_clear_error (&error, "FairShare", "Enable");
+
+  self->fair_share_local_weight = g_key_file_get_integer (file, "FairShare", "LocalWeight", &error);
+  if (error)
+    {
+      check_clear_error (&error, "FairShare", "LocalWeight");
+      self->fair_share_local_weight = 100;
+    }
+  self->fair_share_local_weight = CLAMP (self->fair_share_local_weight, 1, 10000);
+
+  self->fair_share_remote_weight = g_key_file_get_integer (file, "FairShare", "RemoteWeight", &error);
+  if (error)
+    {
+      check_clear_error (&error, "FairShare", "RemoteWeight");
+      self->fair_share_remote_weight = 100;
+    }
+  self->fair_share_remote_weight = CLAMP (self->fair_share_remote_weight, 1, 10000);
+
   /* "Fixed" SessionSlice allocation inside the user */
   self->session_slice.memory_min = config_get_memory (self, file, "SessionSlice", "MemoryMin", &error);
   if (error)
@@ -440,6 +1450,34 @@ read_config (RManager *self)
       check_clear_error (&error, "SessionSlice", "IOWeight");
       self->session_slice.io_weight = self->active_user.io_weight;
     }
+
+  adaptive_memory_update_allocation (self);
+}
+
+static void
+read_config (RManager *self)
+{
+  g_autoptr(GKeyFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+
+  file = g_key_file_new ();
+
+  if (self->config_path &&
+      !g_key_file_load_from_file (file, self->config_path, G_KEY_FILE_NONE, &error))
+    {
+      g_warning ("Could not read configuration file: %s", error->message);
+
+      /* A removed configuration file means no allocations, keep the last
+       * good configuration on parse errors. */
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        return;
+    }
+
+  /* Kept around to recompute percentages when the amount of RAM changes */
+  g_clear_pointer (&self->config, g_key_file_unref);
+  self->config = g_steal_pointer (&file);
+
+  parse_config (self);
 }
 
 static void
@@ -486,28 +1524,207 @@ decrease_pending_calls (RManager *self)
   self->pending_calls -= 1;
 }
 
+static GVariant *
+usage_sample_to_variant (const RUsageSample *sample)
+{
+  return g_variant_new ("(xtttt)",
+                        sample->timestamp,
+                        sample->memory_current,
+                        sample->cpu_usage_usec,
+                        sample->io_read_bytes,
+                        sample->io_write_bytes);
+}
+
+static void
+handle_get_usage (RManager              *self,
+                  GVariant              *parameters,
+                  GDBusMethodInvocation *invocation)
+{
+  g_autoptr(GArray) samples = NULL;
+  GVariantBuilder builder;
+  const char *slice;
+  guint i;
+
+  g_variant_get (parameters, "(&s)", &slice);
+
+  if (self->usage)
+    samples = r_usage_sampler_get_samples (self->usage, slice);
+  if (!samples)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                             "No usage samples for %s", slice);
+      return;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(xtttt)"));
+  for (i = 0; i < samples->len; i++)
+    g_variant_builder_add_value (&builder, usage_sample_to_variant (&g_array_index (samples, RUsageSample, i)));
+
+  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(a(xtttt))", &builder));
+}
+
+/* The last allocation sent for a unit, falls back to the queued one. */
+static const RAllocation *
+lookup_unit_allocation (RManager *self, const char *unit)
+{
+  RUnitState *state;
+
+  state = g_hash_table_lookup (self->units, unit);
+  if (!state)
+    return NULL;
+
+  return state->sent_valid ? &state->sent : &state->desired;
+}
+
+static void
+handle_get_user (RManager              *self,
+                 GVariant              *parameters,
+                 GDBusMethodInvocation *invocation)
+{
+  g_autofree char *user_slice = NULL;
+  g_autofree char *user_service = NULL;
+  const RAllocation *allocation;
+  GVariantBuilder builder;
+  guint32 uid;
+
+  g_variant_get (parameters, "(u)", &uid);
+
+  if (!g_array_binary_search (self->all_users, &uid, uid_cmp, NULL))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                             "User %u has no sessions", uid);
+      return;
+    }
+
+  user_slice = g_strdup_printf ("user-%u.slice", uid);
+  user_service = g_strdup_printf ("user@%u.service", uid);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(iittd)}"));
+  if ((allocation = lookup_unit_allocation (self, user_slice)))
+    g_variant_builder_add (&builder, "{s@(iittd)}", user_slice, allocation_to_variant (allocation));
+  if ((allocation = lookup_unit_allocation (self, user_service)))
+    g_variant_builder_add (&builder, "{s@(iittd)}", user_service, allocation_to_variant (allocation));
+
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(bbba{s(iittd)})",
+                                                        g_array_binary_search (self->graphical_users, &uid, uid_cmp, NULL),
+                                                        r_sd_login_user_is_remote (self->login, uid),
+                                                        user_has_systemd_graphical (self, uid),
+                                                        &builder));
+}
+
+static void
+handle_get_allocations (RManager              *self,
+                        GDBusMethodInvocation *invocation)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(iittd)}"));
+
+  g_hash_table_iter_init (&iter, self->units);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_variant_builder_add (&builder, "{s@(iittd)}", key,
+                           allocation_to_variant (lookup_unit_allocation (self, key)));
+
+  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(a{s(iittd)})", &builder));
+}
+
 static void
 handle_dbus_method_call (GDBusConnection       *connection G_GNUC_UNUSED,
                          const char            *sender G_GNUC_UNUSED,
                          const char            *object_path G_GNUC_UNUSED,
                          const char            *interface_name G_GNUC_UNUSED,
-                         const char            *method_name G_GNUC_UNUSED,
-                         GVariant              *parameters G_GNUC_UNUSED,
+                         const char            *method_name,
+                         GVariant              *parameters,
                          GDBusMethodInvocation *invocation,
                          gpointer               user_data)
 {
   RManager *manager = R_MANAGER (user_data);
 
   /* Just trust that GDBus already ensures the correct method calls and types. */
+  if (g_str_equal (method_name, "GetUsage"))
+    {
+      handle_get_usage (manager, parameters, invocation);
+      return;
+    }
+
+  if (g_str_equal (method_name, "GetUser"))
+    {
+      handle_get_user (manager, parameters, invocation);
+      return;
+    }
+
+  if (g_str_equal (method_name, "GetAllocations"))
+    {
+      handle_get_allocations (manager, invocation);
+      return;
+    }
+
   updat_user_allocations (manager, TRUE);
 
   g_dbus_method_invocation_return_value (invocation,
                                          NULL);
 }
 
+static GVariant *
+handle_dbus_get_property (GDBusConnection *connection G_GNUC_UNUSED,
+                          const char      *sender G_GNUC_UNUSED,
+                          const char      *object_path G_GNUC_UNUSED,
+                          const char      *interface_name G_GNUC_UNUSED,
+                          const char      *property_name,
+                          GError         **error,
+                          gpointer         user_data)
+{
+  RManager *manager = R_MANAGER (user_data);
+
+  if (g_str_equal (property_name, "Users"))
+    return uid_array_to_variant (manager->all_users);
+
+  if (g_str_equal (property_name, "ActiveUsers"))
+    return uid_array_to_variant (manager->graphical_users);
+
+  if (g_str_equal (property_name, "PendingCalls"))
+    return g_variant_new_uint32 (manager->n_unit_calls_in_flight);
+
+  if (g_str_equal (property_name, "QueuedUnits"))
+    return g_variant_new_uint32 (manager->dirty_units->len);
+
+  if (g_str_equal (property_name, "UsageSampleInterval"))
+    return g_variant_new_uint32 (manager->usage ? manager->usage_interval_sec : 0);
+
+  if (g_str_equal (property_name, "UsageSlices"))
+    {
+      g_autoptr(GPtrArray) names = NULL;
+      GVariantBuilder builder;
+      guint i;
+
+      g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(xtttt)}"));
+      if (manager->usage)
+        {
+          names = r_usage_sampler_get_names (manager->usage);
+          for (i = 0; i < names->len; i++)
+            {
+              const RUsageSample *sample;
+
+              sample = r_usage_sampler_get_latest (manager->usage, names->pdata[i]);
+              if (sample)
+                g_variant_builder_add (&builder, "{s@(xtttt)}", names->pdata[i], usage_sample_to_variant (sample));
+            }
+        }
+
+      return g_variant_builder_end (&builder);
+    }
+
+  g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_PROPERTY,
+               "Unknown property %s", property_name);
+  return NULL;
+}
+
 static const GDBusInterfaceVTable interface_vtable = {
   .method_call = handle_dbus_method_call,
-  .get_property = NULL,
+  .get_property = handle_dbus_get_property,
   .set_property = NULL,
 };
 
@@ -580,9 +1797,142 @@ name_lost_cb (GDBusConnection *connection G_GNUC_UNUSED,
   g_signal_emit_by_name (manager, "quit");
 }
 
+/**
+ * update_config:
+ * @self: RManager
+ * @reread: Whether to read the configuration file again
+ *
+ * Re-evaluates the configuration and only pushes the allocations that
+ * changed. Note that user managers only pick up a changed session.slice
+ * drop-in after they have been reloaded.
+ */
+static void
+update_config (RManager *self, gboolean reread)
+{
+  RAllocation old_active_user = self->active_user;
+  RAllocation old_session_slice = self->session_slice;
+  guint64 old_max_users_memory_min = self->max_users_memory_min;
+  guint64 old_max_users_memory_low = self->max_users_memory_low;
+  gboolean old_fair_share = self->fair_share;
+  guint i;
+
+  if (reread)
+    read_config (self);
+  else
+    parse_config (self);
+
+  if (self->login)
+    update_fair_shares (self, self->graphical_users);
+
+  adaptive_memory_setup (self);
+  usage_sampler_setup (self);
+
+  if (!allocation_equal (&old_session_slice, &self->session_slice))
+    write_session_user_drop_ins (self);
+
+  /* Everything is pushed once the name has been acquired. */
+  if (!self->connection)
+    return;
+
+  if (old_max_users_memory_min != self->max_users_memory_min ||
+      old_max_users_memory_low != self->max_users_memory_low ||
+      old_active_user.memory_min != self->active_user.memory_min ||
+      old_active_user.memory_low != self->active_user.memory_low ||
+      old_active_user.uclamp_min != self->active_user.uclamp_min)
+    set_user_slice_resources (self, self->graphical_users->len);
+
+  /* Shares also depend on the limits of user.slice and the weights. */
+  if (!allocation_equal (&old_active_user, &self->active_user) ||
+      self->fair_share || old_fair_share)
+    {
+      for (i = 0; i < self->graphical_users->len; i++)
+        set_user_resources (self, g_array_index (self->graphical_users, uid_t, i), TRUE);
+    }
+}
+
+void
+r_manager_reload (RManager *self)
+{
+  g_clear_handle_id (&self->config_reload_id, g_source_remove);
+
+  g_message ("Reloading configuration");
+  update_config (self, TRUE);
+}
+
+/**
+ * check_available_ram:
+ * @user_data: RManager
+ *
+ * Memory hotplug, ballooning and changed container limits alter the amount
+ * of RAM at runtime. Percentages in the configuration are relative to it, so
+ * they are recomputed and the resulting changes pushed when it moved by more
+ * than RAM_CHANGE_THRESHOLD_PERCENT.
+ *
+ * Returns: %G_SOURCE_CONTINUE
+ */
+static gboolean
+check_available_ram (gpointer user_data)
+{
+  RManager *self = R_MANAGER (user_data);
+  guint64 available_ram;
+  guint64 delta;
+
+  available_ram = get_available_ram ();
+  if (available_ram == 0)
+    return G_SOURCE_CONTINUE;
+
+  delta = available_ram > self->available_ram ?
+          available_ram - self->available_ram :
+          self->available_ram - available_ram;
+  if (delta * 100 <= self->available_ram * RAM_CHANGE_THRESHOLD_PERCENT)
+    return G_SOURCE_CONTINUE;
+
+  g_message ("Available RAM changed from %" G_GUINT64_FORMAT " to %" G_GUINT64_FORMAT " bytes, recomputing allocations",
+             self->available_ram, available_ram);
+  self->available_ram = available_ram;
+  update_config (self, FALSE);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+config_reload_cb (gpointer user_data)
+{
+  RManager *self = R_MANAGER (user_data);
+
+  self->config_reload_id = 0;
+  r_manager_reload (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+config_file_changed_cb (GFileMonitor     *monitor G_GNUC_UNUSED,
+                        GFile            *file G_GNUC_UNUSED,
+                        GFile            *other_file G_GNUC_UNUSED,
+                        GFileMonitorEvent event_type,
+                        gpointer          user_data)
+{
+  RManager *self = R_MANAGER (user_data);
+
+  if (event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+      event_type != G_FILE_MONITOR_EVENT_CREATED &&
+      event_type != G_FILE_MONITOR_EVENT_DELETED &&
+      event_type != G_FILE_MONITOR_EVENT_MOVED_IN &&
+      event_type != G_FILE_MONITOR_EVENT_RENAMED)
+    return;
+
+  /* Editors tend to generate several events, wait for things to settle. */
+  g_clear_handle_id (&self->config_reload_id, g_source_remove);
+  self->config_reload_id = g_timeout_add (200, config_reload_cb, self);
+}
+
 void
 r_manager_start (RManager *self)
 {
+  g_autoptr(GFile) config_file = NULL;
+  g_autoptr(GError) error = NULL;
+
   self->login = r_sd_login_new ();
   g_assert (self->login);
 
@@ -590,6 +1940,21 @@ r_manager_start (RManager *self)
 
   write_session_user_drop_ins (self);
 
+  start_user_cgroup_monitor (self);
+  adaptive_memory_setup (self);
+  usage_sampler_setup (self);
+
+  self->ram_check_id = g_timeout_add_seconds (RAM_CHECK_INTERVAL_SEC, check_available_ram, self);
+
+  config_file = g_file_new_for_path (self->config_path);
+  self->config_monitor = g_file_monitor_file (config_file, G_FILE_MONITOR_WATCH_MOVES, NULL, &error);
+  if (self->config_monitor)
+    g_signal_connect_object (self->config_monitor, "changed",
+                             G_CALLBACK (config_file_changed_cb),
+                             self, 0);
+  else
+    g_warning ("Could not monitor configuration file: %s", error->message);
+
   /* Consider the existance of the bus name a "pending call" that we need to
    * wait for to finish. */
   self->pending_calls += 1;
@@ -603,9 +1968,97 @@ r_manager_start (RManager *self)
                                    (GDestroyNotify) decrease_pending_calls);
 }
 
+/**
+ * r_manager_start_replay:
+ * @self: RManager
+ * @login: The RSdLogin the users are replayed into
+ * @connection: Connection to the (mock) systemd
+ * @config_path: (nullable): The configuration file, %NULL to use the
+ *   built-in defaults
+ *
+ * Starts the manager for replaying a trace. Nothing on the system is
+ * watched or changed: neither the drop-ins nor the cgroup, PSI and RAM
+ * monitoring are set up and no bus name is owned. The configuration is
+ * read once, the system configuration is not used.
+ */
+void
+r_manager_start_replay (RManager        *self,
+                        RSdLogin        *login,
+                        GDBusConnection *connection,
+                        const gchar     *config_path)
+{
+  self->login = g_object_ref (login);
+  self->connection = g_object_ref (connection);
+  self->systemd_graphical_users = g_array_new (FALSE, FALSE, sizeof (uid_t));
+
+  g_free (self->config_path);
+  self->config_path = g_strdup (config_path);
+
+  read_config (self);
+
+  g_signal_connect_object (self->login,
+                           "changed",
+                           G_CALLBACK (active_users_changed_cb),
+                           self,
+                           G_CONNECT_SWAPPED);
+  active_users_changed_cb (self);
+}
+
+/**
+ * r_manager_set_systemd_graphical_users:
+ * @self: RManager started with r_manager_start_replay()
+ * @users: Sorted uids of the users running the user daemon
+ *
+ * Replays the user daemon appearing or going away for users with an active
+ * graphical session, like the cgroup monitor does.
+ */
+void
+r_manager_set_systemd_graphical_users (RManager *self,
+                                       GArray   *users)
+{
+  g_autoptr(GArray) old_users = NULL;
+  guint i;
+
+  g_return_if_fail (self->systemd_graphical_users != NULL);
+
+  old_users = g_steal_pointer (&self->systemd_graphical_users);
+  self->systemd_graphical_users = g_array_ref (users);
+
+  for (i = 0; i < self->graphical_users->len; i++)
+    {
+      uid_t uid = g_array_index (self->graphical_users, uid_t, i);
+
+      if (g_array_binary_search (old_users, &uid, uid_cmp, NULL) !=
+          g_array_binary_search (users, &uid, uid_cmp, NULL))
+        set_user_resources (self, uid, TRUE);
+    }
+}
+
+/**
+ * r_manager_record_trace:
+ * @self: RManager
+ * @trace: (nullable): Writer that must outlive the manager
+ *
+ * Records every logind state the allocations are computed for.
+ */
+void
+r_manager_record_trace (RManager     *self,
+                        RTraceWriter *trace)
+{
+  self->trace = trace;
+}
+
 void
 r_manager_stop (RManager *self)
 {
+  g_clear_handle_id (&self->config_reload_id, g_source_remove);
+  g_clear_object (&self->config_monitor);
+  g_clear_handle_id (&self->ram_check_id, g_source_remove);
+  g_clear_handle_id (&self->adaptive_eval_id, g_source_remove);
+  g_clear_object (&self->psi);
+  g_clear_handle_id (&self->usage_sample_id, g_source_remove);
+  stop_user_cgroup_monitor (self);
+
   /* Shutting down gracefully, set as if no user is active (disable protections). */
   for (guint i = 0; i < self->all_users->len; i++)
     {
@@ -614,6 +2067,11 @@ r_manager_stop (RManager *self)
 
   set_user_slice_resources (self, 0);
 
+  /* Send everything now, the connection is gone after this. */
+  flush_unit_resources (self);
+  g_message ("Sent %" G_GUINT64_FORMAT " unit property calls for %" G_GUINT64_FORMAT " updates (%" G_GUINT64_FORMAT " failed)",
+             self->n_unit_calls, self->n_unit_updates, self->n_unit_calls_failed);
+
   g_array_set_size (self->graphical_users, 0);
   g_array_set_size (self->all_users, 0);
 
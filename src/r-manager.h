@@ -2,7 +2,10 @@
 
 #pragma once
 
-#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "r-sd-login.h"
+#include "r-trace.h"
 
 G_BEGIN_DECLS
 
@@ -14,6 +17,16 @@ RManager *r_manager_new (void);
 
 void r_manager_start (RManager *manager);
 void r_manager_stop (RManager *manager);
+void r_manager_reload (RManager *manager);
 void r_manager_flush (RManager *manager);
 
+void r_manager_start_replay (RManager        *manager,
+                             RSdLogin        *login,
+                             GDBusConnection *connection,
+                             const gchar     *config_path);
+void r_manager_set_systemd_graphical_users (RManager *manager,
+                                            GArray   *users);
+void r_manager_record_trace (RManager     *manager,
+                             RTraceWriter *trace);
+
 G_END_DECLS
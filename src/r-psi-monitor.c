@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <glib-unix.h>
+
+#include "r-psi-monitor.h"
+
+typedef struct
+{
+  RPsiMonitor *monitor;
+  gchar       *path;
+  gint         fd;
+  guint        source_id;
+} PsiTrigger;
+
+struct _RPsiMonitor
+{
+  GObject    parent_instance;
+
+  GPtrArray *triggers;
+};
+
+G_DEFINE_TYPE (RPsiMonitor, r_psi_monitor, G_TYPE_OBJECT)
+
+static void
+psi_trigger_free (PsiTrigger *trigger)
+{
+  g_clear_handle_id (&trigger->source_id, g_source_remove);
+  if (trigger->fd >= 0)
+    close (trigger->fd);
+  g_free (trigger->path);
+  g_free (trigger);
+}
+
+RPsiMonitor *
+r_psi_monitor_new (void)
+{
+  return g_object_new (R_TYPE_PSI_MONITOR, NULL);
+}
+
+static void
+r_psi_monitor_finalize (GObject *object)
+{
+  RPsiMonitor *self = (RPsiMonitor *) object;
+
+  g_clear_pointer (&self->triggers, g_ptr_array_unref);
+
+  G_OBJECT_CLASS (r_psi_monitor_parent_class)->finalize (object);
+}
+
+static void
+r_psi_monitor_class_init (RPsiMonitorClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = r_psi_monitor_finalize;
+
+  /* Emitted with the path of the pressure file whose trigger fired */
+  g_signal_new ("triggered",
+                R_TYPE_PSI_MONITOR, G_SIGNAL_RUN_LAST,
+                0,
+                NULL, NULL,
+                NULL,
+                G_TYPE_NONE, 1, G_TYPE_STRING);
+}
+
+static void
+r_psi_monitor_init (RPsiMonitor *self)
+{
+  self->triggers = g_ptr_array_new_with_free_func ((GDestroyNotify) psi_trigger_free);
+}
+
+static gboolean
+psi_trigger_cb (G_GNUC_UNUSED gint fd,
+                GIOCondition       condition,
+                gpointer           user_data)
+{
+  PsiTrigger *trigger = user_data;
+  RPsiMonitor *self = trigger->monitor;
+
+  /* The cgroup went away. */
+  if (condition & G_IO_ERR)
+    {
+      g_debug ("PSI trigger on %s is gone", trigger->path);
+      trigger->source_id = 0;
+      g_ptr_array_remove (self->triggers, trigger);
+      return G_SOURCE_REMOVE;
+    }
+
+  g_signal_emit_by_name (self, "triggered", trigger->path);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/**
+ * r_psi_monitor_add_trigger:
+ * @monitor: RPsiMonitor
+ * @path: A pressure file, e.g. /proc/pressure/memory or a cgroup's
+ *   memory.pressure
+ * @stall_usec: Stall time that fires the trigger
+ * @window_usec: Window the stall time is accumulated in (500ms to 10s)
+ * @error: Return location for a #GError
+ *
+ * Registers a "some" trigger with the kernel. The trigger stays active as
+ * long as the file is kept open, "triggered" is emitted each time the stall
+ * threshold is crossed (at most once per window).
+ *
+ * Returns: %TRUE if the trigger was registered
+ */
+gboolean
+r_psi_monitor_add_trigger (RPsiMonitor *self,
+                           const gchar *path,
+                           guint64      stall_usec,
+                           guint64      window_usec,
+                           GError     **error)
+{
+  g_autofree gchar *trigger_str = NULL;
+  PsiTrigger *trigger;
+  gint fd;
+
+  fd = open (path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    {
+      gint errsv = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Could not open %s: %s", path, g_strerror (errsv));
+      return FALSE;
+    }
+
+  /* Includes the terminating NUL byte as the kernel expects. */
+  trigger_str = g_strdup_printf ("some %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT, stall_usec, window_usec);
+  if (write (fd, trigger_str, strlen (trigger_str) + 1) < 0)
+    {
+      gint errsv = errno;
+
+      close (fd);
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Could not register trigger on %s: %s", path, g_strerror (errsv));
+      return FALSE;
+    }
+
+  trigger = g_new0 (PsiTrigger, 1);
+  trigger->monitor = self;
+  trigger->path = g_strdup (path);
+  trigger->fd = fd;
+  trigger->source_id = g_unix_fd_add (fd, G_IO_PRI | G_IO_ERR, psi_trigger_cb, trigger);
+  g_ptr_array_add (self->triggers, trigger);
+
+  g_debug ("Registered PSI trigger on %s (%s)", path, trigger_str);
+
+  return TRUE;
+}
+
+void
+r_psi_monitor_clear (RPsiMonitor *self)
+{
+  g_ptr_array_set_size (self->triggers, 0);
+}
+
+/**
+ * r_psi_read_some_total:
+ * @path: A pressure file
+ * @total_usec: (out): The accumulated "some" stall time
+ *
+ * Returns: %TRUE if the file could be read and parsed
+ */
+gboolean
+r_psi_read_some_total (const gchar *path, guint64 *total_usec)
+{
+  g_autofree gchar *contents = NULL;
+  const gchar *total;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return FALSE;
+
+  if (!g_str_has_prefix (contents, "some "))
+    return FALSE;
+
+  total = strstr (contents, "total=");
+  if (!total)
+    return FALSE;
+
+  *total_usec = g_ascii_strtoull (total + strlen ("total="), NULL, 10);
+
+  return TRUE;
+}
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define R_TYPE_PSI_MONITOR (r_psi_monitor_get_type ())
+
+G_DECLARE_FINAL_TYPE (RPsiMonitor, r_psi_monitor, R, PSI_MONITOR, GObject)
+
+RPsiMonitor *r_psi_monitor_new (void);
+
+gboolean r_psi_monitor_add_trigger (RPsiMonitor *monitor,
+                                    const gchar *path,
+                                    guint64      stall_usec,
+                                    guint64      window_usec,
+                                    GError     **error);
+void r_psi_monitor_clear (RPsiMonitor *monitor);
+
+gboolean r_psi_read_some_total (const gchar *path,
+                                guint64     *total_usec);
+
+G_END_DECLS
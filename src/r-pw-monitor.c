@@ -2,14 +2,26 @@
 
 #include <glib-object.h>
 #include <glib.h>
+#include <glib-unix.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include <pipewire/pipewire.h>
+#include <pipewire/thread-loop.h>
+#include <pipewire/extensions/profiler.h>
+#include <spa/param/profiler.h>
+#include <spa/pod/parser.h>
 #include <spa/utils/result.h>
 
 #include "r-app-monitor.h"
 #include "r-pw-monitor.h"
+#include "r-timer-wheel.h"
 #include "utils.h"
 
+/* Escalations last seconds, a one second tick is precise enough. */
+#define XRUN_WHEEL_TICK_MS 1000
+
 typedef struct _ProxyData
 {
   RPwMonitor      *data;
@@ -24,8 +36,48 @@ typedef struct _ProxyData
   pw_destroy_t     destroy;
   struct spa_hook  proxy_listener;
   struct spa_hook  object_listener;
+
+  /* Last state that was reported for the node */
+  pid_t            pid;
+  AppBoostFlags    flags;
+  gboolean         running;
+  guint            xruns;
 } ProxyData;
 
+/* Compact state change of a node, passed from the PipeWire side (which may
+ * be a separate thread) to the main loop. Each record carries the full state
+ * of the node, so records for the same node can be coalesced. */
+typedef struct
+{
+  uint32_t      id;
+  pid_t         pid;
+  AppBoostFlags flags;
+  gboolean      running;
+  gboolean      removed;
+  guint         xruns; /* cumulative, attributed to this node */
+} NodeRecord;
+
+/* Single producer (PipeWire thread), single consumer (main loop) ring
+ * buffer. The size must be a power of two. */
+#define NODE_QUEUE_SIZE 256
+
+typedef struct
+{
+  NodeRecord records[NODE_QUEUE_SIZE];
+  gint       head; /* only written by the producer */
+  gint       tail; /* only written by the consumer */
+} NodeQueue;
+
+/* Main loop side state of a node, with the cached application resolution */
+typedef struct
+{
+  pid_t         pid;
+  char         *app_path;
+  AppBoostFlags flags;
+  gboolean      running;
+  guint         xruns;
+} NodeState;
+
 typedef struct _PipeWireSource
 {
   GSource         base;
@@ -37,14 +89,45 @@ struct _RPwMonitor
 {
   GObject             parent_instance;
 
+  /* Either pipewire_source or thread_loop provides pipewire_loop */
+  struct pw_loop     *pipewire_loop;
   PipeWireSource     *pipewire_source;
+  struct pw_thread_loop *thread_loop;
   struct pw_context  *pipewire_context;
   struct pw_core     *pipewire_core;
 
   struct pw_registry *pipewire_registry;
   struct spa_hook     pipewire_registry_listener;
 
+  struct pw_proxy    *profiler;
+  struct spa_hook     profiler_listener;
+  /* PipeWire side: node id -> ProxyData, driver id -> last xrun count */
+  GHashTable         *proxies;
+  GHashTable         *driver_xruns;
+
   RAppMonitor        *app_monitor;
+
+  /* node id -> NodeState */
+  GHashTable         *nodes;
+  /* app path -> AppStreams */
+  GHashTable         *running_apps;
+
+  gint64              xrun_boost_usec;
+  RTimerWheel        *xrun_wheel;
+
+  /* Threaded mode only */
+  NodeQueue          *queue;
+  GArray             *overflow; /* NodeRecord, PipeWire thread only */
+  gint                overflowed;
+  gint                wakeup_pending;
+  int                 wakeup_fd;
+  guint               wakeup_source_id;
+
+  guint               n_bound;
+  guint               n_skipped;
+  guint               n_records;
+  guint               n_overflows;
+  guint               n_escalations;
 };
 
 G_DEFINE_TYPE (RPwMonitor, r_pw_monitor, G_TYPE_OBJECT);
@@ -60,6 +143,11 @@ r_pw_monitor_finalize (GObject *object)
 {
   RPwMonitor *self = (RPwMonitor *) object;
 
+  /* The thread is stopped, so everything is only accessed from here. */
+  if (self->thread_loop)
+    pw_thread_loop_stop (self->thread_loop);
+  g_clear_handle_id (&self->wakeup_source_id, g_source_remove);
+
   if (self->pipewire_registry)
     pw_proxy_destroy ((struct pw_proxy *) self->pipewire_registry);
   g_clear_pointer (&self->pipewire_core, pw_core_disconnect);
@@ -69,74 +157,502 @@ r_pw_monitor_finalize (GObject *object)
       g_source_destroy (&self->pipewire_source->base);
       g_source_unref (&self->pipewire_source->base);
     }
+  g_clear_pointer (&self->thread_loop, pw_thread_loop_destroy);
   pw_deinit ();
 
+  if (self->wakeup_fd >= 0)
+    close (self->wakeup_fd);
+  g_clear_pointer (&self->queue, g_free);
+  g_clear_pointer (&self->overflow, g_array_unref);
+  g_clear_pointer (&self->proxies, g_hash_table_destroy);
+  g_clear_pointer (&self->driver_xruns, g_hash_table_destroy);
+  g_clear_pointer (&self->nodes, g_hash_table_destroy);
+  g_clear_pointer (&self->running_apps, g_hash_table_destroy);
+  g_clear_pointer (&self->xrun_wheel, r_timer_wheel_free);
+
   G_OBJECT_CLASS (r_pw_monitor_parent_class)->finalize (object);
 }
 
+/* The boost flags that are derived from PipeWire nodes */
+static const AppBoostFlags stream_boost_flags[] = {
+  BOOST_AUDIO,
+  BOOST_VIDEO,
+  BOOST_CAPTURE,
+};
+
+/* Number of running nodes per boost flag of one application */
+typedef struct
+{
+  guint running[G_N_ELEMENTS (stream_boost_flags)];
+} AppStreams;
+
+static void
+node_state_free (NodeState *node)
+{
+  g_free (node->app_path);
+  g_free (node);
+}
+
 /**
- * handle_inotify_event:
- * @object: Proxy data
- * @info: Pipewire node info struct
+ * node_set_running:
+ * @self: The monitor
+ * @data: Node state
+ * @running: Whether the node is running
  *
- * Filters incoming node event for pipewire-pulse api,
- * It acts on the following 3 audio states:
- * running - give boost to application (set BOOST_AUDIO flag)
- * idle - reset BOOST_AUDIO flag
- * suspended - reset BOOST_AUDIO flag
+ * Several nodes may belong to the same application. A boost flag of the
+ * application is only changed when the first node with the flag starts or
+ * the last one stops running.
  */
 static void
-node_event_info (void *object, const struct pw_node_info *info)
+node_set_running (RPwMonitor *self, NodeState *data, gboolean running)
 {
-  ProxyData *data = object;
-  g_autofree gchar *client_api = NULL;
-  g_autofree gchar *app_state = NULL;
-  g_autofree gchar *app_path = NULL;
-  pid_t app_pid;
+  AppBoostFlags set = BOOST_NONE;
+  AppBoostFlags cleared = BOOST_NONE;
+  AppStreams *streams;
   RAppInfo *app;
+  gboolean empty = TRUE;
+  guint i;
 
-  info = data->info = pw_node_info_update (data->info, info);
+  if (data->running == running)
+    return;
+  data->running = running;
 
-  if (data->first)
-    data->first = false;
+  if (!data->app_path || data->flags == BOOST_NONE)
+    return;
 
-  app_state = g_strdup (pw_node_state_as_string (info->state));
-  if (info->state == PW_NODE_STATE_ERROR && info->error)
-    g_debug ("Error: %s", info->error);
+  streams = g_hash_table_lookup (self->running_apps, data->app_path);
+  if (!streams)
+    {
+      streams = g_new0 (AppStreams, 1);
+      g_hash_table_insert (self->running_apps, g_strdup (data->app_path), streams);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (stream_boost_flags); i++)
+    {
+      AppBoostFlags flag = stream_boost_flags[i];
+
+      if (data->flags & flag)
+        {
+          if (running && streams->running[i]++ == 0)
+            set |= flag;
+          else if (!running && --streams->running[i] == 0)
+            cleared |= flag;
+        }
+
+      if (streams->running[i] > 0)
+        empty = FALSE;
+    }
 
-  if (info->props == NULL || info->props->n_items == 0)
+  if (empty)
+    g_hash_table_remove (self->running_apps, data->app_path);
+
+  if (set == BOOST_NONE && cleared == BOOST_NONE)
     return;
 
-  client_api = g_strdup (spa_dict_lookup (info->props, "client.api"));
-  if (!client_api || strcmp (client_api, "pipewire-pulse"))
+  /* Stopping, nothing should be boosted anymore anyway */
+  if (!self->app_monitor)
     return;
 
-  app_pid = g_ascii_strtoll (spa_dict_lookup (info->props, "application.process.id"), NULL, 10);
-  app_path = get_unit_cgroup_path_from_pid (app_pid);
-  if (!app_path)
+  app = r_app_monitor_lookup_app (self->app_monitor, data->app_path);
+  if (!app)
+    app = r_app_monitor_get_app_info_from_path (self->app_monitor, data->app_path);
+  if (!app)
     return;
 
-  g_debug ("Audio App PID: %d, Audio state: %s", app_pid, app_state);
+  app->boosted |= set;
+  app->boosted &= ~cleared;
+
+  r_app_monitor_app_info_changed (self->app_monitor, app);
+}
+
+/**
+ * get_stream_boost_flags:
+ * @props: Node properties
+ *
+ * Playback streams get BOOST_AUDIO, video streams (e.g. screen sharing or
+ * video calls) BOOST_VIDEO and recording streams (microphone, camera)
+ * BOOST_CAPTURE. JACK clients do not always set a media class, they are
+ * treated as audio.
+ *
+ * Returns: The boost flags for the node
+ */
+static AppBoostFlags
+get_stream_boost_flags (const struct spa_dict *props)
+{
+  AppBoostFlags flags = BOOST_NONE;
+  const char *media_class;
 
-  app = r_app_monitor_get_app_info_from_path (data->app_monitor, app_path);
+  media_class = spa_dict_lookup (props, PW_KEY_MEDIA_CLASS);
+  if (!media_class)
+    {
+      if (g_strcmp0 (spa_dict_lookup (props, "client.api"), "jack") == 0)
+        flags |= BOOST_AUDIO;
+      return flags;
+    }
+
+  if (!g_str_has_prefix (media_class, "Stream/"))
+    return flags;
+
+  if (g_str_has_suffix (media_class, "/Video"))
+    flags |= BOOST_VIDEO;
+  else if (g_str_has_prefix (media_class, "Stream/Output/") ||
+           g_str_has_prefix (media_class, "Stream/Duplex/"))
+    flags |= BOOST_AUDIO;
+
+  if (g_str_has_prefix (media_class, "Stream/Input/") ||
+      g_str_has_prefix (media_class, "Stream/Duplex/"))
+    flags |= BOOST_CAPTURE;
+
+  return flags;
+}
+
+/**
+ * node_escalate:
+ * @self: The monitor
+ * @node: Node state
+ * @xruns: Number of new xruns
+ *
+ * The graph of a running audio stream reported xruns. Its application gets
+ * BOOST_XRUN on top of its other boosts for XrunBoostSec, every further xrun
+ * extends the escalation.
+ */
+static void
+node_escalate (RPwMonitor *self, NodeState *node, guint xruns)
+{
+  RAppInfo *app;
+
+  if (!self->app_monitor || !node->app_path)
+    return;
+
+  app = r_app_monitor_lookup_app (self->app_monitor, node->app_path);
   if (!app)
     return;
 
-  if (strcmp (app_state, "running") == 0)
+  r_timer_wheel_schedule (self->xrun_wheel, node->app_path,
+                          g_get_monotonic_time () + self->xrun_boost_usec);
+
+  if (app->boosted & BOOST_XRUN)
+    return;
+
+  self->n_escalations += 1;
+  g_info ("Escalating boost of %s after %u xrun(s), escalations: %u",
+          app->name, xruns, self->n_escalations);
+
+  app->boosted |= BOOST_XRUN;
+  r_app_monitor_app_info_changed (self->app_monitor, app);
+}
+
+static void
+xrun_timer_cb (const gchar *app_path, gpointer user_data)
+{
+  RPwMonitor *self = user_data;
+  RAppInfo *app;
+
+  if (!self->app_monitor)
+    return;
+
+  app = r_app_monitor_lookup_app (self->app_monitor, app_path);
+  if (!app || !(app->boosted & BOOST_XRUN))
+    return;
+
+  g_debug ("Escalated boost of %s decayed", app->name);
+
+  app->boosted &= ~BOOST_XRUN;
+  r_app_monitor_app_info_changed (self->app_monitor, app);
+}
+
+/**
+ * node_apply:
+ * @self: The monitor
+ * @record: State change of a node
+ *
+ * Runs in the main loop. The application of a node is resolved and cached
+ * when the node is first seen and again only if its process ID changes.
+ */
+static void
+node_apply (RPwMonitor *self, const NodeRecord *record)
+{
+  NodeState *node;
+
+  node = g_hash_table_lookup (self->nodes, GUINT_TO_POINTER (record->id));
+
+  if (record->removed)
+    {
+      if (node)
+        {
+          node_set_running (self, node, FALSE);
+          g_hash_table_remove (self->nodes, GUINT_TO_POINTER (record->id));
+        }
+      return;
+    }
+
+  if (!node)
+    {
+      node = g_new0 (NodeState, 1);
+      g_hash_table_insert (self->nodes, GUINT_TO_POINTER (record->id), node);
+    }
+
+  if (record->pid != node->pid || record->flags != node->flags)
+    {
+      /* The node now belongs to a different (or no) application. */
+      node_set_running (self, node, FALSE);
+
+      node->flags = record->flags;
+      if (record->pid != node->pid)
+        {
+          g_clear_pointer (&node->app_path, g_free);
+          node->pid = record->pid;
+          if (node->pid > 0)
+            node->app_path = get_unit_cgroup_path_from_pid (node->pid);
+        }
+    }
+
+  node_set_running (self, node, record->running && node->app_path != NULL);
+
+  if (record->xruns != node->xruns)
+    {
+      guint xruns = record->xruns - node->xruns;
+
+      node->xruns = record->xruns;
+      if (node->running)
+        node_escalate (self, node, xruns);
+    }
+}
+
+/* Returns %FALSE if the queue is full */
+static gboolean
+node_queue_push (NodeQueue *queue, const NodeRecord *record)
+{
+  guint head = g_atomic_int_get (&queue->head);
+  guint tail = g_atomic_int_get (&queue->tail);
+
+  if (head - tail >= NODE_QUEUE_SIZE)
+    return FALSE;
+
+  queue->records[head & (NODE_QUEUE_SIZE - 1)] = *record;
+  /* Publishes the record to the consumer */
+  g_atomic_int_set (&queue->head, head + 1);
+
+  return TRUE;
+}
+
+static gboolean
+node_queue_pop (NodeQueue *queue, NodeRecord *record)
+{
+  guint tail = g_atomic_int_get (&queue->tail);
+  guint head = g_atomic_int_get (&queue->head);
+
+  if (head == tail)
+    return FALSE;
+
+  *record = queue->records[tail & (NODE_QUEUE_SIZE - 1)];
+  /* Hands the slot back to the producer */
+  g_atomic_int_set (&queue->tail, tail + 1);
+
+  return TRUE;
+}
+
+/* PipeWire thread: move records that did not fit earlier into the queue. */
+static void
+flush_overflow (RPwMonitor *self)
+{
+  guint i;
+
+  for (i = 0; i < self->overflow->len; i++)
     {
-      app->boosted |= BOOST_AUDIO;
-      r_app_monitor_app_info_changed (data->app_monitor, app);
+      if (!node_queue_push (self->queue, &g_array_index (self->overflow, NodeRecord, i)))
+        break;
     }
-  else if (strcmp (app_state, "idle") == 0)
+
+  g_array_remove_range (self->overflow, 0, i);
+}
+
+static void
+wakeup_main_loop (RPwMonitor *self)
+{
+  uint64_t one = 1;
+
+  /* Only one eventfd write per batch, the consumer resets the flag. */
+  if (!g_atomic_int_compare_and_exchange (&self->wakeup_pending, 0, 1))
+    return;
+
+  if (write (self->wakeup_fd, &one, sizeof (one)) < 0)
+    g_warning ("Could not wake up main loop: %s", g_strerror (errno));
+}
+
+/**
+ * node_report:
+ * @self: The monitor
+ * @record: State change of a node
+ *
+ * Without a thread the record is applied directly. Otherwise it is queued
+ * for the main loop. If the queue is full, records are kept (coalesced per
+ * node) in an overflow list until the main loop catches up; the order is
+ * preserved as nothing bypasses a non-empty overflow list.
+ */
+static void
+node_report (RPwMonitor *self, const NodeRecord *record)
+{
+  guint i;
+
+  if (!self->thread_loop)
     {
-      app->boosted &= ~BOOST_AUDIO;
-      r_app_monitor_app_info_changed (data->app_monitor, app);
+      node_apply (self, record);
+      return;
     }
-  else if (strcmp (app_state, "suspended") == 0)
+
+  if (self->overflow->len > 0)
+    flush_overflow (self);
+
+  if (self->overflow->len > 0 || !node_queue_push (self->queue, record))
     {
-      app->boosted &= ~BOOST_AUDIO;
-      r_app_monitor_app_info_changed (data->app_monitor, app);
+      for (i = 0; i < self->overflow->len; i++)
+        {
+          if (g_array_index (self->overflow, NodeRecord, i).id == record->id)
+            break;
+        }
+
+      if (i < self->overflow->len)
+        g_array_index (self->overflow, NodeRecord, i) = *record;
+      else
+        g_array_append_val (self->overflow, *record);
+
+      self->n_overflows += 1;
+      g_atomic_int_set (&self->overflowed, 1);
     }
+
+  wakeup_main_loop (self);
+}
+
+static int
+flush_overflow_invoke (G_GNUC_UNUSED struct spa_loop *loop,
+                       G_GNUC_UNUSED bool             async,
+                       G_GNUC_UNUSED uint32_t         seq,
+                       G_GNUC_UNUSED const void      *data,
+                       G_GNUC_UNUSED size_t           size,
+                       void                          *user_data)
+{
+  RPwMonitor *self = user_data;
+
+  flush_overflow (self);
+  if (self->overflow->len > 0)
+    g_atomic_int_set (&self->overflowed, 1);
+
+  wakeup_main_loop (self);
+
+  return 0;
+}
+
+static gboolean
+node_queue_dispatch (gint                       fd,
+                     G_GNUC_UNUSED GIOCondition condition,
+                     gpointer                   user_data)
+{
+  RPwMonitor *self = user_data;
+  NodeRecord record;
+  uint64_t count;
+
+  if (read (fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+    g_warning ("Could not read wakeup counter: %s", g_strerror (errno));
+
+  g_atomic_int_set (&self->wakeup_pending, 0);
+
+  while (node_queue_pop (self->queue, &record))
+    {
+      self->n_records += 1;
+      node_apply (self, &record);
+    }
+
+  /* Space is available again, let the thread move the rest over. */
+  if (g_atomic_int_compare_and_exchange (&self->overflowed, 1, 0))
+    pw_loop_invoke (self->pipewire_loop, flush_overflow_invoke, 0, NULL, 0, false, self);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/**
+ * get_node_record:
+ * @data: Proxy data
+ * @info: Pipewire node info struct
+ * @props_changed: Whether the properties changed since the last record
+ * @record: (out): The resulting state
+ *
+ * Only parses the node properties, so this is cheap and safe to run on the
+ * PipeWire thread. Unchanged properties are not parsed again, the process ID
+ * and boost flags of the last record are reused.
+ */
+static void
+get_node_record (ProxyData                 *data,
+                 const struct pw_node_info *info,
+                 gboolean                   props_changed,
+                 NodeRecord                *record)
+{
+  const struct spa_dict *props = info->props;
+  const char *app_pid = NULL;
+
+  record->id = data->id;
+  record->pid = data->pid;
+  record->flags = data->flags;
+  record->removed = FALSE;
+  record->xruns = data->xruns;
+
+  if (props_changed)
+    {
+      record->pid = 0;
+      record->flags = BOOST_NONE;
+
+      if (props != NULL && props->n_items > 0)
+        {
+          app_pid = spa_dict_lookup (props, PW_KEY_APP_PROCESS_ID);
+          record->flags = get_stream_boost_flags (props);
+        }
+
+      if (app_pid && record->flags != BOOST_NONE)
+        record->pid = g_ascii_strtoll (app_pid, NULL, 10);
+    }
+
+  record->running = record->pid > 0 && info->state == PW_NODE_STATE_RUNNING;
+}
+
+/**
+ * node_event_info:
+ * @object: Proxy data
+ * @info: Pipewire node info struct
+ *
+ * Boosts the application of a client stream while the node is running.
+ * Anything else (idle, suspended, ...) resets the boost. Only changes of the
+ * process ID, the boost flags or between running and not running are passed
+ * on.
+ */
+static void
+node_event_info (void *object, const struct pw_node_info *info)
+{
+  ProxyData *data = object;
+  NodeRecord record;
+  gboolean props_changed;
+
+  props_changed = data->first || (info->change_mask & PW_NODE_CHANGE_MASK_PROPS);
+  info = data->info = pw_node_info_update (data->info, info);
+
+  if (data->first)
+    data->first = false;
+
+  if (info->state == PW_NODE_STATE_ERROR && info->error)
+    g_debug ("Error: %s", info->error);
+
+  get_node_record (data, info, props_changed, &record);
+  if (record.pid == data->pid && record.flags == data->flags &&
+      record.running == data->running)
+    return;
+
+  g_debug ("Stream App PID: %d, Boost flags: %d, Stream state: %s", record.pid,
+           (int) record.flags, pw_node_state_as_string (info->state));
+
+  data->pid = record.pid;
+  data->flags = record.flags;
+  data->running = record.running;
+
+  node_report (data->data, &record);
 }
 
 static const struct pw_node_events node_events
@@ -154,6 +670,10 @@ static void
 destroy_proxy (void *data)
 {
   ProxyData *pd = data;
+  NodeRecord record = { .id = pd->id, .removed = TRUE };
+
+  g_hash_table_remove (pd->data->proxies, GUINT_TO_POINTER (pd->id));
+  node_report (pd->data, &record);
 
   if (!pd->info)
     return;
@@ -170,18 +690,221 @@ static const struct pw_proxy_events proxy_events = {
   .destroy = destroy_proxy,
 };
 
+/**
+ * is_stream_node:
+ * @props: Global properties of the node
+ *
+ * Only client streams can ever be attributed to an application. Device
+ * nodes, filters, loopbacks and the like are recognised from the global
+ * properties so that no proxy needs to be bound for them.
+ *
+ * Returns: %TRUE if the node may be a client stream
+ */
+static gboolean
+is_stream_node (const struct spa_dict *props)
+{
+  const char *media_class;
+
+  /* Without properties we cannot tell, so bind it. */
+  if (props == NULL || props->n_items == 0)
+    return TRUE;
+
+  if (spa_dict_lookup (props, PW_KEY_DEVICE_ID) ||
+      !spa_dict_lookup (props, PW_KEY_CLIENT_ID))
+    return FALSE;
+
+  media_class = spa_dict_lookup (props, PW_KEY_MEDIA_CLASS);
+  if (media_class && !g_str_has_prefix (media_class, "Stream/"))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * process_profiler_object:
+ * @self: The monitor
+ * @object: One profiler sample, i.e. one cycle of a driver
+ *
+ * A sample contains the xrun counter of the driver and a block for every
+ * follower in its graph. When the counter increased, the new xruns are
+ * attributed to all running audio streams of the graph.
+ */
+static void
+process_profiler_object (RPwMonitor *self, const struct spa_pod_object *object)
+{
+  g_autoptr(GArray) followers = NULL;
+  const struct spa_pod_prop *prop;
+  gboolean have_info = FALSE;
+  gpointer last_xruns;
+  uint32_t driver_id = SPA_ID_INVALID;
+  int32_t xrun_count = 0;
+  guint xruns;
+  guint i;
+
+  followers = g_array_new (FALSE, FALSE, sizeof (uint32_t));
+
+  SPA_POD_OBJECT_FOREACH (object, prop)
+    {
+      int64_t counter;
+      float cpu_load[3];
+      uint32_t id;
+      const char *name;
+
+      switch (prop->key)
+        {
+        case SPA_PROFILER_info:
+          if (spa_pod_parse_struct (&prop->value,
+                                    SPA_POD_Long (&counter),
+                                    SPA_POD_Float (&cpu_load[0]),
+                                    SPA_POD_Float (&cpu_load[1]),
+                                    SPA_POD_Float (&cpu_load[2]),
+                                    SPA_POD_Int (&xrun_count)) >= 0)
+            have_info = TRUE;
+          break;
+
+        case SPA_PROFILER_driverBlock:
+          spa_pod_parse_struct (&prop->value,
+                                SPA_POD_Int (&driver_id),
+                                SPA_POD_String (&name));
+          break;
+
+        case SPA_PROFILER_followerBlock:
+          if (spa_pod_parse_struct (&prop->value,
+                                    SPA_POD_Int (&id),
+                                    SPA_POD_String (&name)) >= 0)
+            g_array_append_val (followers, id);
+          break;
+
+        default:
+          break;
+        }
+    }
+
+  if (!have_info || driver_id == SPA_ID_INVALID)
+    return;
+
+  /* The first sample of a driver only establishes the baseline. */
+  if (!g_hash_table_lookup_extended (self->driver_xruns, GUINT_TO_POINTER (driver_id),
+                                     NULL, &last_xruns))
+    {
+      g_hash_table_insert (self->driver_xruns, GUINT_TO_POINTER (driver_id),
+                           GINT_TO_POINTER (xrun_count));
+      return;
+    }
+
+  if (GPOINTER_TO_INT (last_xruns) == xrun_count)
+    return;
+
+  g_hash_table_insert (self->driver_xruns, GUINT_TO_POINTER (driver_id),
+                       GINT_TO_POINTER (xrun_count));
+
+  /* The counter is reset if the driver is reconfigured. */
+  if (xrun_count < GPOINTER_TO_INT (last_xruns))
+    return;
+
+  xruns = xrun_count - GPOINTER_TO_INT (last_xruns);
+  g_debug ("PipeWire driver %u reported %u xrun(s)", driver_id, xruns);
+
+  for (i = 0; i < followers->len; i++)
+    {
+      uint32_t id = g_array_index (followers, uint32_t, i);
+      NodeRecord record;
+      ProxyData *pd;
+
+      pd = g_hash_table_lookup (self->proxies, GUINT_TO_POINTER (id));
+      if (!pd || !pd->running || !(pd->flags & BOOST_AUDIO))
+        continue;
+
+      pd->xruns += xruns;
+
+      record.id = pd->id;
+      record.pid = pd->pid;
+      record.flags = pd->flags;
+      record.running = pd->running;
+      record.removed = FALSE;
+      record.xruns = pd->xruns;
+      node_report (self, &record);
+    }
+}
+
+static void
+profiler_event_profile (void *data, const struct spa_pod *pod)
+{
+  RPwMonitor *self = data;
+  struct spa_pod *object;
+
+  if (!spa_pod_is_struct (pod))
+    return;
+
+  SPA_POD_STRUCT_FOREACH (pod, object)
+    {
+      if (!spa_pod_is_object_type (object, SPA_TYPE_OBJECT_Profiler))
+        continue;
+
+      process_profiler_object (self, (struct spa_pod_object *) object);
+    }
+}
+
+static const struct pw_profiler_events profiler_events = {
+  PW_VERSION_PROFILER_EVENTS,
+  .profile = profiler_event_profile,
+};
+
+/**
+ * bind_profiler:
+ * @self: The monitor
+ * @id: Global id of the profiler
+ * @type: Interface type
+ *
+ * The profiler (from module-profiler) only does any work while a client
+ * listens, so it is only bound if xrun escalation is enabled.
+ */
+static void
+bind_profiler (RPwMonitor *self, uint32_t id, const char *type)
+{
+  if (self->xrun_boost_usec <= 0 || self->profiler)
+    return;
+
+  self->profiler = pw_registry_bind (self->pipewire_registry, id, type,
+                                     PW_VERSION_PROFILER, 0);
+  if (!self->profiler)
+    {
+      g_warning ("Failed to bind PipeWire profiler");
+      return;
+    }
+
+  pw_proxy_add_object_listener (self->profiler, &self->profiler_listener,
+                                &profiler_events, self);
+
+  g_info ("Monitoring PipeWire xruns through profiler %u", id);
+}
+
 static void
 registry_event_global (void *data, uint32_t id, uint32_t permissions,
                        const char *type, uint32_t version,
-                       G_GNUC_UNUSED const struct spa_dict *props)
+                       const struct spa_dict *props)
 {
   RPwMonitor *self = R_PW_MONITOR (data);
   struct pw_proxy *proxy;
   ProxyData *pd;
 
+  if (g_strcmp0 (type, PW_TYPE_INTERFACE_Profiler) == 0)
+    {
+      bind_profiler (self, id, type);
+      return;
+    }
+
   if (g_strcmp0 (type, PW_TYPE_INTERFACE_Node) != 0)
     return;
 
+  if (!is_stream_node (props))
+    {
+      self->n_skipped += 1;
+      g_debug ("Skipping PipeWire node %u (bound: %u, skipped: %u)",
+               id, self->n_bound, self->n_skipped);
+      return;
+    }
+
   proxy = pw_registry_bind (self->pipewire_registry, id, type, PW_VERSION_NODE,
                             sizeof (ProxyData));
   if (proxy == NULL)
@@ -200,8 +923,17 @@ registry_event_global (void *data, uint32_t id, uint32_t permissions,
   pd->version = version;
   pd->type = strdup (type);
   pd->destroy = (pw_destroy_t) pw_node_info_free;
+  pd->pid = 0;
+  pd->flags = BOOST_NONE;
+  pd->running = FALSE;
+  pd->xruns = 0;
+  g_hash_table_insert (self->proxies, GUINT_TO_POINTER (id), pd);
   pw_proxy_add_object_listener (proxy, &pd->object_listener, &node_events, pd);
   pw_proxy_add_listener (proxy, &pd->proxy_listener, &proxy_events, pd);
+
+  self->n_bound += 1;
+  g_debug ("Bound PipeWire node %u (bound: %u, skipped: %u)",
+           id, self->n_bound, self->n_skipped);
 }
 
 static const struct pw_registry_events registry_events = {
@@ -271,21 +1003,49 @@ create_pipewire_source ()
 void
 r_pw_monitor_start (RPwMonitor *self, RAppMonitor *monitor)
 {
-  if (!self->pipewire_source || !self->pipewire_context || !self->pipewire_core)
+  if (!self->pipewire_loop || !self->pipewire_context || !self->pipewire_core)
     return;
 
   self->app_monitor = monitor;
 
-  g_source_attach (&self->pipewire_source->base, NULL);
+  if (!self->thread_loop)
+    {
+      g_source_attach (&self->pipewire_source->base, NULL);
+      return;
+    }
+
+  self->wakeup_source_id = g_unix_fd_add (self->wakeup_fd, G_IO_IN,
+                                          node_queue_dispatch, self);
+
+  if (pw_thread_loop_start (self->thread_loop) < 0)
+    g_warning ("Failed to start PipeWire thread");
 }
 
 void
 r_pw_monitor_stop (RPwMonitor *self)
 {
-  if (!self->pipewire_source || !self->pipewire_context || !self->pipewire_core)
+  if (!self->pipewire_loop || !self->pipewire_context || !self->pipewire_core)
     return;
 
-  g_source_destroy (&self->pipewire_source->base);
+  if (self->thread_loop)
+    {
+      pw_thread_loop_stop (self->thread_loop);
+      g_clear_handle_id (&self->wakeup_source_id, g_source_remove);
+
+      g_info ("PipeWire records passed to main loop: %u, queue overflows: %u",
+              self->n_records, self->n_overflows);
+    }
+  else
+    {
+      g_source_destroy (&self->pipewire_source->base);
+    }
+
+  g_info ("PipeWire nodes bound: %u, skipped: %u", self->n_bound, self->n_skipped);
+  if (self->profiler)
+    g_info ("PipeWire xrun boost escalations: %u", self->n_escalations);
+
+  r_timer_wheel_clear (self->xrun_wheel);
+  self->app_monitor = NULL;
 }
 
 static void
@@ -296,20 +1056,88 @@ r_pw_monitor_class_init (RPwMonitorClass *klass)
   object_class->finalize = r_pw_monitor_finalize;
 }
 
+/* Only read at startup, none of these can be changed at runtime. */
+static gboolean
+read_config (RPwMonitor *self)
+{
+  g_autoptr(GKeyFile) file = NULL;
+  gint xrun_boost_sec;
+
+  file = g_key_file_new ();
+  if (!load_user_config (file))
+    return FALSE;
+
+  xrun_boost_sec = g_key_file_get_integer (file, "PipeWire", "XrunBoostSec", NULL);
+  self->xrun_boost_usec = (gint64) MAX (xrun_boost_sec, 0) * G_USEC_PER_SEC;
+
+  return g_key_file_get_boolean (file, "PipeWire", "ThreadedLoop", NULL);
+}
+
+/**
+ * create_pipewire_thread:
+ * @self: The monitor
+ *
+ * Sets up a pw_thread_loop. All PipeWire processing happens on its thread
+ * and only NodeRecords are passed to the main loop, through a lock-free
+ * queue and an eventfd to wake it up.
+ *
+ * Returns: %TRUE on success
+ */
+static gboolean
+create_pipewire_thread (RPwMonitor *self)
+{
+  self->wakeup_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (self->wakeup_fd < 0)
+    {
+      g_message ("Failed to create eventfd: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  self->thread_loop = pw_thread_loop_new ("uresourced-pw", NULL);
+  if (!self->thread_loop)
+    return FALSE;
+
+  self->queue = g_new0 (NodeQueue, 1);
+  self->overflow = g_array_new (FALSE, FALSE, sizeof (NodeRecord));
+  self->pipewire_loop = pw_thread_loop_get_loop (self->thread_loop);
+
+  return TRUE;
+}
+
 static void
 r_pw_monitor_init (RPwMonitor *self)
 {
+  self->nodes = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) node_state_free);
+  self->running_apps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->proxies = g_hash_table_new (NULL, NULL);
+  self->driver_xruns = g_hash_table_new (NULL, NULL);
+  self->xrun_wheel = r_timer_wheel_new (XRUN_WHEEL_TICK_MS, xrun_timer_cb, self);
+  self->wakeup_fd = -1;
+
   pw_init (NULL, NULL);
 
-  self->pipewire_source = create_pipewire_source ();
-  if (!self->pipewire_source)
+  /* The thread is not running yet, so no locking is needed for the setup. */
+  if (read_config (self))
     {
-      g_message ("Failed to create PipeWire source");
-      return;
+      if (!create_pipewire_thread (self))
+        {
+          g_message ("Failed to create PipeWire thread");
+          return;
+        }
+    }
+  else
+    {
+      self->pipewire_source = create_pipewire_source ();
+      if (!self->pipewire_source)
+        {
+          g_message ("Failed to create PipeWire source");
+          return;
+        }
+      self->pipewire_loop = self->pipewire_source->pipewire_loop;
     }
 
   self->pipewire_context
-    = pw_context_new (self->pipewire_source->pipewire_loop, NULL, 0);
+    = pw_context_new (self->pipewire_loop, NULL, 0);
   if (!self->pipewire_context)
     {
       g_message ("Failed to create PipeWire context");
@@ -330,4 +1158,6 @@ r_pw_monitor_init (RPwMonitor *self)
   pw_registry_add_listener (self->pipewire_registry,
                             &self->pipewire_registry_listener,
                             &registry_events, self);
+
+  g_info ("PipeWire monitor running %s", self->thread_loop ? "on a separate thread" : "in the main loop");
 }
@@ -0,0 +1,495 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+
+#include "uresourced-config.h"
+#include "r-manager.h"
+#include "r-replay.h"
+#include "r-sd-login.h"
+#include "r-trace.h"
+#include "utils.h"
+
+#ifdef HAVE_APP_MANAGEMENT
+#include "r-app-monitor.h"
+#include "r-app-policy.h"
+#endif
+
+/* The part of the systemd manager API uresourced uses, plus a call to wait
+ * for all earlier calls to be handled. */
+static const gchar mock_systemd_xml[] =
+  "<node>"
+  "  <interface name='org.freedesktop.systemd1.Manager'>"
+  "    <method name='SetUnitProperties'>"
+  "      <arg name='name' direction='in' type='s'/>"
+  "      <arg name='runtime' direction='in' type='b'/>"
+  "      <arg name='properties' direction='in' type='a(sv)'/>"
+  "    </method>"
+  "    <method name='FreezeUnit'>"
+  "      <arg name='name' direction='in' type='s'/>"
+  "    </method>"
+  "    <method name='ThawUnit'>"
+  "      <arg name='name' direction='in' type='s'/>"
+  "    </method>"
+  "  </interface>"
+  "  <interface name='org.freedesktop.UResourced.Replay'>"
+  "    <method name='Sync'/>"
+  "  </interface>"
+  "</node>";
+
+typedef struct
+{
+  GMainLoop       *loop;
+  GPtrArray       *events;
+  guint            next_event;
+  gint64           start;
+  /* Trace time per wall clock time, 0 to not wait at all */
+  gdouble          speed;
+
+  /* The mock systemd and the connection the daemon code uses */
+  GDBusConnection *server;
+  GDBusConnection *client;
+  guint            systemd_obj;
+  guint            replay_obj;
+  gboolean         synced;
+
+  RSdLogin        *login;
+  RManager        *manager;
+#ifdef HAVE_APP_MANAGEMENT
+  RAppMonitor     *app_monitor;
+  RAppPolicy      *app_policy;
+#endif
+
+  /* Statistics */
+  guint            n_events;
+  guint            n_skipped;
+  gint64           total_usec;
+  gint64           max_usec;
+  guint            n_set_unit_properties;
+  guint            n_freeze;
+  guint            n_thaw;
+  guint            n_cgroup_writes;
+} RReplay;
+
+static gdouble
+replay_time_msec (RReplay *replay)
+{
+  return (g_get_monotonic_time () - replay->start) / 1000.0;
+}
+
+static void
+handle_mock_method_call (GDBusConnection       *connection G_GNUC_UNUSED,
+                         const char            *sender G_GNUC_UNUSED,
+                         const char            *object_path G_GNUC_UNUSED,
+                         const char            *interface_name G_GNUC_UNUSED,
+                         const char            *method_name,
+                         GVariant              *parameters,
+                         GDBusMethodInvocation *invocation,
+                         gpointer               user_data)
+{
+  RReplay *replay = user_data;
+
+  if (g_str_equal (method_name, "SetUnitProperties"))
+    {
+      g_autoptr(GVariant) properties = NULL;
+      g_autofree gchar *printed = NULL;
+      const char *unit;
+
+      g_variant_get (parameters, "(&sb@a(sv))", &unit, NULL, &properties);
+      printed = g_variant_print (properties, FALSE);
+      g_print ("%10.3f SetUnitProperties %s %s\n", replay_time_msec (replay), unit, printed);
+      replay->n_set_unit_properties += 1;
+    }
+  else if (g_str_equal (method_name, "FreezeUnit") || g_str_equal (method_name, "ThawUnit"))
+    {
+      const char *unit;
+
+      g_variant_get (parameters, "(&s)", &unit);
+      g_print ("%10.3f %s %s\n", replay_time_msec (replay), method_name, unit);
+      if (g_str_equal (method_name, "FreezeUnit"))
+        replay->n_freeze += 1;
+      else
+        replay->n_thaw += 1;
+    }
+  else
+    {
+      replay->synced = TRUE;
+    }
+
+  g_dbus_method_invocation_return_value (invocation, NULL);
+}
+
+static const GDBusInterfaceVTable mock_vtable = {
+  .method_call = handle_mock_method_call,
+  .get_property = NULL,
+  .set_property = NULL,
+};
+
+static void
+record_cgroup_write (const gchar *path,
+                     const gchar *value,
+                     gpointer     user_data)
+{
+  RReplay *replay = user_data;
+
+  g_print ("%10.3f write %s %s\n", replay_time_msec (replay), path, value);
+  replay->n_cgroup_writes += 1;
+}
+
+static void
+server_ready_cb (GObject      *source G_GNUC_UNUSED,
+                 GAsyncResult *res,
+                 gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  RReplay *replay = user_data;
+
+  replay->server = g_dbus_connection_new_finish (res, &error);
+  if (!replay->server)
+    g_error ("Could not set up mock systemd: %s", error->message);
+}
+
+/**
+ * mock_systemd_setup:
+ * @replay: RReplay
+ * @error: Return location for a #GError
+ *
+ * Connects a mock systemd and the daemon through a socket pair. The mock is
+ * served from the same main context, so a call is handled the next time the
+ * context is iterated.
+ */
+static gboolean
+mock_systemd_setup (RReplay *replay, GError **error)
+{
+  g_autoptr(GDBusNodeInfo) introspection_data = NULL;
+  g_autoptr(GSocket) server_socket = NULL;
+  g_autoptr(GSocket) client_socket = NULL;
+  g_autoptr(GSocketConnection) server_stream = NULL;
+  g_autoptr(GSocketConnection) client_stream = NULL;
+  g_autofree gchar *guid = NULL;
+  int fds[2];
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    {
+      gint errsv = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Could not create socket pair: %s", g_strerror (errsv));
+      return FALSE;
+    }
+
+  server_socket = g_socket_new_from_fd (fds[0], error);
+  if (!server_socket)
+    {
+      close (fds[0]);
+      close (fds[1]);
+      return FALSE;
+    }
+  client_socket = g_socket_new_from_fd (fds[1], error);
+  if (!client_socket)
+    {
+      close (fds[1]);
+      return FALSE;
+    }
+
+  server_stream = g_socket_connection_factory_create_connection (server_socket);
+  client_stream = g_socket_connection_factory_create_connection (client_socket);
+
+  /* The server authenticates in a thread while the client blocks. */
+  guid = g_dbus_generate_guid ();
+  g_dbus_connection_new (G_IO_STREAM (server_stream), guid,
+                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_SERVER,
+                         NULL, NULL, server_ready_cb, replay);
+
+  replay->client = g_dbus_connection_new_sync (G_IO_STREAM (client_stream), NULL,
+                                               G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                                               NULL, NULL, error);
+  if (!replay->client)
+    return FALSE;
+
+  while (!replay->server)
+    g_main_context_iteration (NULL, TRUE);
+
+  introspection_data = g_dbus_node_info_new_for_xml (mock_systemd_xml, NULL);
+  g_assert (introspection_data);
+
+  replay->systemd_obj = g_dbus_connection_register_object (replay->server,
+                                                           "/org/freedesktop/systemd1",
+                                                           introspection_data->interfaces[0],
+                                                           &mock_vtable,
+                                                           replay, NULL, error);
+  if (!replay->systemd_obj)
+    return FALSE;
+
+  replay->replay_obj = g_dbus_connection_register_object (replay->server,
+                                                          "/org/freedesktop/UResourced/Replay",
+                                                          introspection_data->interfaces[1],
+                                                          &mock_vtable,
+                                                          replay, NULL, error);
+
+  return replay->replay_obj != 0;
+}
+
+static void
+sync_cb (GObject      *source,
+         GAsyncResult *res,
+         gpointer      user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GVariant) var = NULL;
+
+  var = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), res, NULL);
+}
+
+/* Waits until the mock handled every call made so far, calls are handled
+ * in the order they were sent. */
+static void
+mock_systemd_sync (RReplay *replay)
+{
+  replay->synced = FALSE;
+  g_dbus_connection_call (replay->client,
+                          NULL,
+                          "/org/freedesktop/UResourced/Replay",
+                          "org.freedesktop.UResourced.Replay",
+                          "Sync",
+                          NULL,
+                          G_VARIANT_TYPE_UNIT,
+                          G_DBUS_CALL_FLAGS_NONE,
+                          -1,
+                          NULL,
+                          sync_cb,
+                          NULL);
+
+  while (!replay->synced)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+mock_systemd_teardown (RReplay *replay)
+{
+  if (replay->server)
+    {
+      if (replay->systemd_obj)
+        g_dbus_connection_unregister_object (replay->server, replay->systemd_obj);
+      if (replay->replay_obj)
+        g_dbus_connection_unregister_object (replay->server, replay->replay_obj);
+      g_dbus_connection_close_sync (replay->server, NULL, NULL);
+    }
+  g_clear_object (&replay->server);
+  g_clear_object (&replay->client);
+}
+
+static gboolean
+dispatch_event (RReplay *replay, const RTraceEvent *event)
+{
+  switch (event->type)
+    {
+    case R_TRACE_EVENT_LOGIND:
+      if (!replay->login)
+        return FALSE;
+
+      r_manager_set_systemd_graphical_users (replay->manager, event->systemd_graphical_users);
+      r_sd_login_set_users (replay->login, event->all_users,
+                            event->graphical_users, event->remote_users);
+      return TRUE;
+
+#ifdef HAVE_APP_MANAGEMENT
+    case R_TRACE_EVENT_APP:
+      {
+        RAppInfo *app;
+
+        if (!replay->app_monitor)
+          return FALSE;
+
+        app = r_app_monitor_add_app (replay->app_monitor, event->path);
+        if (event->inactive_msec < 0)
+          app->timestamp = -1;
+        else
+          app->timestamp = g_get_monotonic_time () - event->inactive_msec * 1000;
+        app->boosted = event->boosted;
+        r_app_monitor_app_info_changed (replay->app_monitor, app);
+        return TRUE;
+      }
+
+    case R_TRACE_EVENT_APP_REMOVED:
+      if (!replay->app_monitor)
+        return FALSE;
+
+      r_app_monitor_remove_app (replay->app_monitor, event->path);
+      return TRUE;
+#endif
+
+    default:
+      return FALSE;
+    }
+}
+
+/**
+ * replay_events_cb:
+ * @user_data: RReplay
+ *
+ * Dispatches all events that are due. The processing time of an event
+ * includes the coalesced updates that run from idle handlers, it ends once
+ * the main context has nothing left to do.
+ */
+static gboolean
+replay_events_cb (gpointer user_data)
+{
+  RReplay *replay = user_data;
+
+  while (replay->next_event < replay->events->len)
+    {
+      const RTraceEvent *event = replay->events->pdata[replay->next_event];
+      gint64 due;
+      gint64 start;
+      gint64 elapsed;
+
+      due = replay->start;
+      if (replay->speed > 0)
+        due += event->time_msec * 1000 / replay->speed;
+      if (due > g_get_monotonic_time ())
+        {
+          g_timeout_add (MAX ((due - g_get_monotonic_time ()) / 1000, 1), replay_events_cb, replay);
+          return G_SOURCE_REMOVE;
+        }
+
+      replay->next_event += 1;
+
+      start = g_get_monotonic_time ();
+      if (!dispatch_event (replay, event))
+        {
+          replay->n_skipped += 1;
+          continue;
+        }
+      while (g_main_context_iteration (NULL, FALSE))
+        ;
+      elapsed = g_get_monotonic_time () - start;
+
+      replay->n_events += 1;
+      replay->total_usec += elapsed;
+      replay->max_usec = MAX (replay->max_usec, elapsed);
+    }
+
+  g_main_loop_quit (replay->loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * r_replay_run:
+ * @filename: The trace file
+ * @config_path: (nullable): The configuration file, %NULL to use the
+ *   built-in defaults
+ * @speed: How much faster than recorded to replay, 0 to dispatch every
+ *   event as soon as the previous one has been handled. Timers of the
+ *   daemon (idle and decay tiers, freezing) still run in real time.
+ * @user_mode: Replay the applications into the session part instead of
+ *   the users into the system part
+ * @error: Return location for a #GError
+ *
+ * Feeds a trace through the allocation logic, the resulting systemd calls
+ * and cgroup writes are printed instead of being made. Events that do not
+ * belong to the replayed part are skipped. The configuration, logind and
+ * cgroup state of the host are not used.
+ *
+ * Returns: %TRUE if the trace was replayed
+ */
+gboolean
+r_replay_run (const gchar *filename,
+              const gchar *config_path,
+              gdouble      speed,
+              gboolean     user_mode,
+              GError     **error)
+{
+  RReplay replay = { 0 };
+  gdouble total_msec;
+  gboolean ret = FALSE;
+
+#ifndef HAVE_APP_MANAGEMENT
+  if (user_mode)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Built without application management");
+      return FALSE;
+    }
+#endif
+
+  if (speed < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid replay speed %g", speed);
+      return FALSE;
+    }
+
+  replay.events = r_trace_load (filename, error);
+  if (!replay.events)
+    return FALSE;
+
+  replay.loop = g_main_loop_new (NULL, FALSE);
+  replay.speed = speed;
+  replay.start = g_get_monotonic_time ();
+
+  if (!mock_systemd_setup (&replay, error))
+    goto out;
+
+  set_cgroup_write_hook (record_cgroup_write, &replay);
+
+  if (!user_mode)
+    {
+      replay.login = r_sd_login_new_static ();
+      replay.manager = r_manager_new ();
+      r_manager_start_replay (replay.manager, replay.login, replay.client, config_path);
+    }
+#ifdef HAVE_APP_MANAGEMENT
+  else
+    {
+      replay.app_monitor = r_app_monitor_new ();
+      replay.app_policy = r_app_policy_new_for_connection (replay.client, config_path);
+      r_app_policy_start (replay.app_policy, replay.app_monitor);
+    }
+#endif
+
+  replay.start = g_get_monotonic_time ();
+  g_idle_add (replay_events_cb, &replay);
+  g_main_loop_run (replay.loop);
+  total_msec = replay_time_msec (&replay);
+
+  /* Shut down like the daemon does, this is part of the output. */
+  if (replay.manager)
+    {
+      r_manager_stop (replay.manager);
+      r_manager_flush (replay.manager);
+    }
+#ifdef HAVE_APP_MANAGEMENT
+  if (replay.app_policy)
+    r_app_policy_stop (replay.app_policy);
+#endif
+  mock_systemd_sync (&replay);
+
+  g_print ("Replayed %u events (%u skipped) in %.1f ms\n",
+           replay.n_events, replay.n_skipped, total_msec);
+  if (replay.n_events > 0)
+    g_print ("Processing time per event: average %.3f ms, maximum %.3f ms\n",
+             replay.total_usec / 1000.0 / replay.n_events, replay.max_usec / 1000.0);
+  g_print ("Calls: %u SetUnitProperties, %u FreezeUnit, %u ThawUnit, %u cgroup writes\n",
+           replay.n_set_unit_properties, replay.n_freeze, replay.n_thaw, replay.n_cgroup_writes);
+
+  ret = TRUE;
+
+out:
+  set_cgroup_write_hook (NULL, NULL);
+  g_clear_object (&replay.manager);
+  g_clear_object (&replay.login);
+#ifdef HAVE_APP_MANAGEMENT
+  g_clear_object (&replay.app_policy);
+  g_clear_object (&replay.app_monitor);
+#endif
+  mock_systemd_teardown (&replay);
+  g_clear_pointer (&replay.events, g_ptr_array_unref);
+  g_clear_pointer (&replay.loop, g_main_loop_unref);
+
+  return ret;
+}
@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean r_replay_run (const gchar *filename,
+                       const gchar *config_path,
+                       gdouble      speed,
+                       gboolean     user_mode,
+                       GError     **error);
+
+G_END_DECLS
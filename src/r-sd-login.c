@@ -3,27 +3,118 @@
 #include "r-sd-login.h"
 #include "utils.h"
 
+#include <gio/gio.h>
 #include <glib-unix.h>
+#include <stdlib.h>
+#include <string.h>
 #include <systemd/sd-login.h>
 
+#define LOGIN1_BUS_NAME "org.freedesktop.login1"
+#define LOGIN1_PATH "/org/freedesktop/login1"
+#define LOGIN1_SESSION_PATH_PREFIX LOGIN1_PATH "/session/"
+#define LOGIN1_MANAGER_INTERFACE "org.freedesktop.login1.Manager"
+#define LOGIN1_SESSION_INTERFACE "org.freedesktop.login1.Session"
+#define LOGIN1_SEAT_INTERFACE "org.freedesktop.login1.Seat"
+
+/* With incremental tracking, full rescans only serve as a consistency check. */
+#define RESCAN_INTERVAL_SEC 300
+
+/* Debouncing of changes: a change is reported after a few milliseconds,
+ * together with everything that arrives until then (e.g. both sessions of a
+ * user switch). If changes keep coming within DEBOUNCE_BURST_GAP_MSEC after
+ * a report, they are coalesced until things are quiet for that long, but
+ * never for more than DEBOUNCE_MAX_DELAY_MSEC after the first of them. */
+#define DEBOUNCE_MIN_DELAY_MSEC 5
+#define DEBOUNCE_BURST_GAP_MSEC 100
+#define DEBOUNCE_MAX_DELAY_MSEC 500
+
+typedef struct
+{
+  uid_t    uid;
+  /* The session is on a seat that can do graphics, or is a remote session
+   * running a display server */
+  gboolean graphical;
+  gboolean active;
+  gboolean remote;
+} SessionInfo;
+
 struct _RSdLogin
 {
   GObject           parent_instance;
 
+  /* Only used if the system bus is not available */
   sd_login_monitor *mon;
   guint             mon_source;
-  guint             mon_delay;
 
+  /* Debouncing, see schedule_changed() */
+  guint             mon_delay;
+  gint64            mon_delay_deadline;
+  gint64            burst_start;
+  gint64            last_event;
+  guint             burst_events;
+  /* The pending report is a burst window, not the fast path */
+  gboolean          in_burst;
+
+  /* Statistics */
+  guint64           n_events;
+  guint64           n_changes;
+  guint             max_burst_events;
+  gint64            total_latency;
+  gint64            max_latency;
+
+  /* Incremental tracking through login1 signals */
+  GDBusConnection  *bus;
+  guint             manager_signal_id;
+  guint             session_signal_id;
+  guint             seat_signal_id;
+  guint             rescan_id;
+  guint             full_rescan_id;
+
+  /* session id -> SessionInfo */
+  GHashTable *sessions;
+  /* Sessions to re-read once the burst of signals is over */
+  GHashTable *dirty_sessions;
+  /* uid -> number of active sessions on graphical seats (all/local) */
+  GHashTable *graphical_counts;
+  GHashTable *local_counts;
 
   /* We only care about which users are active (on any seat). */
   GArray *graphical_users;
   GArray *all_users;
+  /* Graphical users with at least one active local session */
+  GArray *local_users;
+
+  /* The users at the time "changed" was last emitted */
+  GArray *reported_graphical_users;
+  GArray *reported_all_users;
+  GArray *reported_local_users;
 };
 
 G_DEFINE_TYPE (RSdLogin, r_sd_login, G_TYPE_OBJECT)
 
+static void start_monitoring (RSdLogin *self);
+
 RSdLogin *
 r_sd_login_new (void)
+{
+  RSdLogin *self;
+
+  self = g_object_new (R_TYPE_SD_LOGIN, NULL);
+  start_monitoring (self);
+
+  return self;
+}
+
+/**
+ * r_sd_login_new_static:
+ *
+ * Creates an RSdLogin that does not monitor logind, the users are only
+ * changed through r_sd_login_set_users(). Used for replaying traces.
+ *
+ * Returns: (transfer full): A new RSdLogin
+ */
+RSdLogin *
+r_sd_login_new_static (void)
 {
   return g_object_new (R_TYPE_SD_LOGIN, NULL);
 }
@@ -33,11 +124,34 @@ r_sd_login_finalize (GObject *object)
 {
   RSdLogin *self = (RSdLogin *) object;
 
+  if (self->n_changes > 0)
+    g_message ("Coalesced %" G_GUINT64_FORMAT " logind events into %" G_GUINT64_FORMAT " updates (largest burst %u, average latency %.1f ms, maximum %.1f ms)",
+               self->n_events, self->n_changes, self->max_burst_events,
+               self->total_latency / 1000.0 / self->n_changes,
+               self->max_latency / 1000.0);
+
   g_clear_handle_id (&self->mon_delay, g_source_remove);
   g_clear_handle_id (&self->mon_source, g_source_remove);
+  g_clear_handle_id (&self->rescan_id, g_source_remove);
+  g_clear_handle_id (&self->full_rescan_id, g_source_remove);
+  if (self->bus)
+    {
+      g_dbus_connection_signal_unsubscribe (self->bus, self->manager_signal_id);
+      g_dbus_connection_signal_unsubscribe (self->bus, self->session_signal_id);
+      g_dbus_connection_signal_unsubscribe (self->bus, self->seat_signal_id);
+    }
+  g_clear_object (&self->bus);
   g_clear_pointer (&self->mon, sd_login_monitor_unref);
+  g_clear_pointer (&self->sessions, g_hash_table_destroy);
+  g_clear_pointer (&self->dirty_sessions, g_hash_table_destroy);
+  g_clear_pointer (&self->graphical_counts, g_hash_table_destroy);
+  g_clear_pointer (&self->local_counts, g_hash_table_destroy);
   g_clear_pointer (&self->graphical_users, g_array_unref);
   g_clear_pointer (&self->all_users, g_array_unref);
+  g_clear_pointer (&self->local_users, g_array_unref);
+  g_clear_pointer (&self->reported_graphical_users, g_array_unref);
+  g_clear_pointer (&self->reported_all_users, g_array_unref);
+  g_clear_pointer (&self->reported_local_users, g_array_unref);
 
   G_OBJECT_CLASS (r_sd_login_parent_class)->finalize (object);
 }
@@ -59,116 +173,362 @@ freevp (char ***v)
   *v = NULL;
 }
 
-static gboolean
-logind_quiet (gpointer user_data)
+/* Inserts @uid into the sorted @array unless it is already there. */
+static void
+uid_array_insert (GArray *array, uid_t uid)
 {
-  RSdLogin *self = R_SD_LOGIN (user_data);
-  __attribute__((__cleanup__(freevp))) char **seats = NULL;
-  char **seat = NULL;
-  uid_t *all_uids = NULL;
-  int r = 0;
+  guint lo = 0;
+  guint hi = array->len;
 
-  self->mon_delay = 0;
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
 
-  /* Update our user active/inactive state. */
-  g_array_set_size (self->graphical_users, 0);
-  g_array_set_size (self->all_users, 0);
+      if (g_array_index (array, uid_t, mid) < uid)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  if (lo < array->len && g_array_index (array, uid_t, lo) == uid)
+    return;
 
+  g_array_insert_val (array, lo, uid);
+}
+
+static void
+uid_array_remove (GArray *array, uid_t uid)
+{
+  guint index;
 
-  r = sd_get_seats (&seats);
+  if (g_array_binary_search (array, &uid, uid_cmp, &index))
+    g_array_remove_index (array, index);
+}
+
+/* Tracks the number of sessions per user, @users contains all users with
+ * a non-zero count. */
+static void
+count_update (GHashTable *counts, GArray *users, uid_t uid, gint delta)
+{
+  guint count;
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (counts, GUINT_TO_POINTER (uid)));
+  count += delta;
+
+  if (count == 0)
+    {
+      g_hash_table_remove (counts, GUINT_TO_POINTER (uid));
+      uid_array_remove (users, uid);
+      return;
+    }
+
+  g_hash_table_insert (counts, GUINT_TO_POINTER (uid), GUINT_TO_POINTER (count));
+  if (count == 1)
+    uid_array_insert (users, uid);
+}
+
+static void
+session_account (RSdLogin *self, const SessionInfo *info, gint delta)
+{
+  if (!info->graphical || !info->active)
+    return;
+
+  count_update (self->graphical_counts, self->graphical_users, info->uid, delta);
+  if (!info->remote)
+    count_update (self->local_counts, self->local_users, info->uid, delta);
+}
+
+static gboolean
+read_session_info (const char *session, SessionInfo *info)
+{
+  char *seat = NULL;
+  int r;
+
+  r = sd_session_get_uid (session, &info->uid);
   if (r < 0)
     {
-      g_critical ("Failed to get seats: %m");
-      goto err;
+      /* This can happen after sessions disappear (i.e. not just a transient issue). */
+      g_debug ("Failed to get user for session %s, ignoring the session: %s", session, g_strerror (-r));
+      return FALSE;
     }
 
-  /* NOTE: We need to look at all sessions, going through the seat should be
-   *       a reasonable way of doing so.
-   */
-  for (seat = seats; seat && *seat; seat++)
+  r = sd_session_is_active (session);
+  if (r < 0)
     {
-      __attribute__((__cleanup__(freevp))) char **sessions = NULL;
-      char **session = NULL;
+      g_warning ("Failed to get whether session is active, ignoring the session: %s", g_strerror (-r));
+      return FALSE;
+    }
+  info->active = !!r;
+  info->remote = sd_session_is_remote (session) > 0;
 
-      /* We only take graphical seats, and just assume the user will
-       * have a graphical session that should get protection.
-       */
-      r = sd_seat_can_graphical (*seat);
+  /* We only take graphical seats, and just assume the user will
+   * have a graphical session that should get protection.
+   */
+  info->graphical = FALSE;
+  if (sd_session_get_seat (session, &seat) >= 0)
+    {
+      r = sd_seat_can_graphical (seat);
       if (r < 0)
-        {
-          g_warning ("Failed to get whether seat is graphical, ignoring the seat: %m");
-          continue;
-        }
-      if (r == 0)
-        continue;
+        g_warning ("Failed to get whether seat is graphical, ignoring the seat: %s", g_strerror (-r));
+      info->graphical = r > 0;
+      free (seat);
+    }
+  else if (info->remote)
+    {
+      char *type = NULL;
 
-      r = sd_seat_get_sessions (*seat, &sessions, NULL, NULL);
-      if (r < 0)
+      /* Remote sessions have no seat, only their type tells whether they
+       * run a graphical session. */
+      if (sd_session_get_type (session, &type) >= 0)
         {
-          g_warning ("Failed to get sessions for seat, ignoring the seat: %m");
-          continue;
+          info->graphical = g_str_equal (type, "x11") || g_str_equal (type, "wayland");
+          free (type);
         }
+    }
 
-      for (session = sessions; session && *session; session++)
-        {
-          uid_t uid;
-          gboolean is_active;
-
-          r = sd_session_get_uid (*session, &uid);
-          if (r < 0)
-            {
-              /* This can happen after sessions disappear (i.e. not just a transient issue). */
-              g_debug ("Failed to get user for session %s, ignoring the session: %m", *session);
-              continue;
-            }
-
-          r = sd_session_is_active (*session);
-          if (r < 0)
-            {
-              g_warning ("Failed to get whether session is active, ignoring the session: %m");
-              continue;
-            }
-          is_active = !!r;
-
-          if (!is_active)
-            continue;
-
-          /* If we find the user, then they are actually active. */
-          if (!g_array_binary_search (self->graphical_users, &uid, uid_cmp, NULL))
-            {
-              g_array_append_val (self->graphical_users, uid);
-              g_array_sort (self->graphical_users, uid_cmp);
-            }
-        }
+  return TRUE;
+}
+
+static void
+set_session (RSdLogin *self, const char *session, const SessionInfo *info)
+{
+  SessionInfo *old;
+
+  old = g_hash_table_lookup (self->sessions, session);
+  if (old)
+    {
+      session_account (self, old, -1);
+      *old = *info;
+    }
+  else
+    {
+      old = g_new (SessionInfo, 1);
+      *old = *info;
+      g_hash_table_insert (self->sessions, g_strdup (session), old);
+    }
+
+  session_account (self, old, 1);
+}
+
+static void
+remove_session (RSdLogin *self, const char *session)
+{
+  SessionInfo *old;
+
+  old = g_hash_table_lookup (self->sessions, session);
+  if (!old)
+    return;
+
+  session_account (self, old, -1);
+  g_hash_table_remove (self->sessions, session);
+}
+
+static void
+clear_state (RSdLogin *self)
+{
+  g_hash_table_remove_all (self->sessions);
+  g_hash_table_remove_all (self->dirty_sessions);
+  g_hash_table_remove_all (self->graphical_counts);
+  g_hash_table_remove_all (self->local_counts);
+  g_array_set_size (self->graphical_users, 0);
+  g_array_set_size (self->all_users, 0);
+  g_array_set_size (self->local_users, 0);
+}
+
+/**
+ * full_rescan:
+ * @self: RSdLogin
+ *
+ * Re-enumerates all sessions and all users. This costs a couple of file
+ * reads per session, in incremental mode it is only done on startup,
+ * periodically and when a seat changed.
+ *
+ * Returns: %TRUE if the set of users changed
+ */
+static gboolean
+full_rescan (RSdLogin *self)
+{
+  __attribute__((__cleanup__(freevp))) char **sessions = NULL;
+  g_autoptr(GArray) old_graphical_users = NULL;
+  g_autoptr(GArray) old_all_users = NULL;
+  g_autoptr(GArray) old_local_users = NULL;
+  char **session = NULL;
+  uid_t *all_uids = NULL;
+  int r = 0;
+
+  old_graphical_users = g_array_copy (self->graphical_users);
+  old_all_users = g_array_copy (self->all_users);
+  old_local_users = g_array_copy (self->local_users);
+
+  /* Update our user active/inactive state. */
+  clear_state (self);
+
+  /* NOTE: Not going through the seats, remote sessions have none. */
+  r = sd_get_sessions (&sessions);
+  if (r < 0)
+    {
+      g_critical ("Failed to get sessions: %s", g_strerror (-r));
+      goto err;
+    }
+
+  for (session = sessions; session && *session; session++)
+    {
+      SessionInfo info;
+
+      if (read_session_info (*session, &info))
+        set_session (self, *session, &info);
     }
 
   r = sd_get_uids (&all_uids);
   if (r < 0)
     {
-      g_critical ("Failed to get list of all UIDs: %m");
+      g_critical ("Failed to get list of all UIDs: %s", g_strerror (-r));
       goto err;
     }
 
   g_array_append_vals (self->all_users, all_uids, r);
-  free(all_uids);
+  free (all_uids);
 
   g_array_sort (self->all_users, uid_cmp);
-  g_array_sort (self->graphical_users, uid_cmp);
-
-  g_signal_emit_by_name (self, "changed");
 
-  return G_SOURCE_REMOVE;
+  goto out;
 
 err:
+  clear_state (self);
 
-  g_array_set_size (self->graphical_users, 0);
-  g_array_set_size (self->all_users, 0);
+out:
+  return !uid_array_equal (old_graphical_users, self->graphical_users) ||
+         !uid_array_equal (old_all_users, self->all_users) ||
+         !uid_array_equal (old_local_users, self->local_users);
+}
+
+static void
+uid_array_assign (GArray *array, GArray *from)
+{
+  g_array_set_size (array, 0);
+  g_array_append_vals (array, from->data, from->len);
+}
+
+/* Most session property changes (IdleHint, LockedHint, ...) do not change
+ * any of the user sets, those are not reported. Returns %TRUE if the users
+ * differ from the last report and remembers them. */
+static gboolean
+update_reported_users (RSdLogin *self)
+{
+  if (uid_array_equal (self->reported_graphical_users, self->graphical_users) &&
+      uid_array_equal (self->reported_all_users, self->all_users) &&
+      uid_array_equal (self->reported_local_users, self->local_users))
+    return FALSE;
+
+  uid_array_assign (self->reported_graphical_users, self->graphical_users);
+  uid_array_assign (self->reported_all_users, self->all_users);
+  uid_array_assign (self->reported_local_users, self->local_users);
+
+  return TRUE;
+}
+
+static gboolean
+logind_quiet (gpointer user_data)
+{
+  RSdLogin *self = R_SD_LOGIN (user_data);
+  GHashTableIter iter;
+  gpointer key;
+  gint64 latency;
+
+  self->mon_delay = 0;
+
+  if (!self->bus)
+    full_rescan (self);
+
+  g_hash_table_iter_init (&iter, self->dirty_sessions);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      SessionInfo info;
+
+      if (read_session_info (key, &info))
+        set_session (self, key, &info);
+      else
+        remove_session (self, key);
+
+      g_hash_table_iter_remove (&iter);
+    }
+
+  if (!update_reported_users (self))
+    {
+      g_debug ("Handled %u logind change(s) without a change of users", self->burst_events);
+      self->burst_events = 0;
+      return G_SOURCE_REMOVE;
+    }
 
   g_signal_emit_by_name (self, "changed");
 
+  /* Time from the first change to the allocations being updated */
+  latency = g_get_monotonic_time () - self->burst_start;
+  self->n_changes += 1;
+  self->total_latency += latency;
+  self->max_latency = MAX (self->max_latency, latency);
+  self->max_burst_events = MAX (self->max_burst_events, self->burst_events);
+
+  g_debug ("Handled %u logind change(s) after %.1f ms (average %.1f ms, maximum %.1f ms, largest burst %u)",
+           self->burst_events, latency / 1000.0,
+           self->total_latency / 1000.0 / self->n_changes,
+           self->max_latency / 1000.0, self->max_burst_events);
+
+  self->burst_events = 0;
+
   return G_SOURCE_REMOVE;
 }
 
+/**
+ * schedule_changed:
+ * @self: RSdLogin
+ *
+ * Schedules emitting "changed". Changes are reported almost right away,
+ * along with everything arriving before that report. Bursts that go on
+ * after a report (e.g. many logins at once) are coalesced with a bounded
+ * delay so that the timer cannot be postponed indefinitely.
+ */
+static void
+schedule_changed (RSdLogin *self)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 deadline;
+
+  self->n_events += 1;
+
+  if (self->burst_events == 0)
+    {
+      self->burst_start = now;
+      deadline = now + DEBOUNCE_MIN_DELAY_MSEC * 1000;
+
+      /* Still in a burst that was just reported */
+      self->in_burst = self->last_event && now - self->last_event < DEBOUNCE_BURST_GAP_MSEC * 1000;
+      if (self->in_burst)
+        deadline = now + DEBOUNCE_BURST_GAP_MSEC * 1000;
+    }
+  else if (!self->in_burst)
+    {
+      /* Picked up by the report that is about to fire */
+      deadline = self->mon_delay_deadline;
+    }
+  else
+    {
+      deadline = MIN (now + DEBOUNCE_BURST_GAP_MSEC * 1000,
+                      self->burst_start + DEBOUNCE_MAX_DELAY_MSEC * 1000);
+      deadline = MAX (deadline, self->mon_delay_deadline);
+    }
+
+  self->burst_events += 1;
+  self->last_event = now;
+
+  if (self->mon_delay && deadline == self->mon_delay_deadline)
+    return;
+
+  g_clear_handle_id (&self->mon_delay, g_source_remove);
+  self->mon_delay_deadline = deadline;
+  self->mon_delay = g_timeout_add (MAX (deadline - now, 0) / 1000, logind_quiet, self);
+}
+
 static gboolean
 logind_changed (G_GNUC_UNUSED gint         fd,
                 G_GNUC_UNUSED GIOCondition condition,
@@ -177,14 +537,233 @@ logind_changed (G_GNUC_UNUSED gint         fd,
   RSdLogin *self = R_SD_LOGIN (user_data);
 
   sd_login_monitor_flush (self->mon);
+  schedule_changed (self);
 
-  /* Consider everything quiet/settled after 100ms */
-  g_clear_handle_id (&self->mon_delay, g_source_remove);
-  self->mon_delay = g_timeout_add (100, logind_quiet, self);
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+full_rescan_cb (gpointer user_data)
+{
+  RSdLogin *self = R_SD_LOGIN (user_data);
+
+  self->full_rescan_id = 0;
+  if (full_rescan (self))
+    schedule_changed (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+periodic_rescan_cb (gpointer user_data)
+{
+  RSdLogin *self = R_SD_LOGIN (user_data);
+
+  /* Sessions that are waiting to be re-read would show up as missed, try
+   * again next time. */
+  if (g_hash_table_size (self->dirty_sessions) > 0)
+    return G_SOURCE_CONTINUE;
+
+  if (full_rescan (self))
+    {
+      g_warning ("Periodic logind rescan found state that was missed incrementally");
+      schedule_changed (self);
+    }
 
   return G_SOURCE_CONTINUE;
 }
 
+/* Session object paths are the session id escaped like sd_bus_path_encode()
+ * does it: "_" followed by two hex digits for anything that is not
+ * alphanumeric, and for a leading digit. */
+static gchar *
+session_id_from_path (const gchar *path)
+{
+  const gchar *p;
+  GString *id;
+
+  if (!g_str_has_prefix (path, LOGIN1_SESSION_PATH_PREFIX))
+    return NULL;
+
+  id = g_string_new (NULL);
+  for (p = path + strlen (LOGIN1_SESSION_PATH_PREFIX); *p; p++)
+    {
+      if (*p == '_' && g_ascii_isxdigit (p[1]) && g_ascii_isxdigit (p[2]))
+        {
+          g_string_append_c (id, g_ascii_xdigit_value (p[1]) << 4 | g_ascii_xdigit_value (p[2]));
+          p += 2;
+        }
+      else
+        {
+          g_string_append_c (id, *p);
+        }
+    }
+
+  return g_string_free (id, FALSE);
+}
+
+/* logind emits PropertiesChanged (e.g. for Active) before it writes the
+ * session state to /run/systemd/sessions, so the session is only read once
+ * the burst of signals is over, see logind_quiet(). */
+static void
+update_session (RSdLogin *self, const char *session)
+{
+  g_hash_table_add (self->dirty_sessions, g_strdup (session));
+  schedule_changed (self);
+}
+
+static void
+manager_signal_cb (GDBusConnection *connection G_GNUC_UNUSED,
+                   const gchar     *sender_name G_GNUC_UNUSED,
+                   const gchar     *object_path G_GNUC_UNUSED,
+                   const gchar     *interface_name G_GNUC_UNUSED,
+                   const gchar     *signal_name,
+                   GVariant        *parameters,
+                   gpointer         user_data)
+{
+  RSdLogin *self = R_SD_LOGIN (user_data);
+
+  if (g_str_equal (signal_name, "SessionNew") &&
+      g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(so)")))
+    {
+      const gchar *session;
+
+      g_variant_get (parameters, "(&s&o)", &session, NULL);
+      update_session (self, session);
+    }
+  else if (g_str_equal (signal_name, "SessionRemoved") &&
+           g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(so)")))
+    {
+      const gchar *session;
+
+      g_variant_get (parameters, "(&s&o)", &session, NULL);
+      g_hash_table_remove (self->dirty_sessions, session);
+      remove_session (self, session);
+      schedule_changed (self);
+    }
+  else if (g_str_equal (signal_name, "UserNew") &&
+           g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(uo)")))
+    {
+      guint32 uid;
+
+      g_variant_get (parameters, "(u&o)", &uid, NULL);
+      uid_array_insert (self->all_users, uid);
+      schedule_changed (self);
+    }
+  else if (g_str_equal (signal_name, "UserRemoved") &&
+           g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(uo)")))
+    {
+      guint32 uid;
+
+      g_variant_get (parameters, "(u&o)", &uid, NULL);
+      uid_array_remove (self->all_users, uid);
+      schedule_changed (self);
+    }
+}
+
+static void
+session_properties_changed_cb (GDBusConnection *connection G_GNUC_UNUSED,
+                               const gchar     *sender_name G_GNUC_UNUSED,
+                               const gchar     *object_path,
+                               const gchar     *interface_name G_GNUC_UNUSED,
+                               const gchar     *signal_name G_GNUC_UNUSED,
+                               GVariant        *parameters G_GNUC_UNUSED,
+                               gpointer         user_data)
+{
+  RSdLogin *self = R_SD_LOGIN (user_data);
+  g_autofree gchar *session = NULL;
+
+  /* Only Active matters, but re-reading a single session is cheap. */
+  session = session_id_from_path (object_path);
+  if (session)
+    update_session (self, session);
+}
+
+static void
+seat_properties_changed_cb (GDBusConnection *connection G_GNUC_UNUSED,
+                            const gchar     *sender_name G_GNUC_UNUSED,
+                            const gchar     *object_path G_GNUC_UNUSED,
+                            const gchar     *interface_name G_GNUC_UNUSED,
+                            const gchar     *signal_name G_GNUC_UNUSED,
+                            GVariant        *parameters,
+                            gpointer         user_data)
+{
+  RSdLogin *self = R_SD_LOGIN (user_data);
+  g_autoptr(GVariant) changed = NULL;
+  g_autoptr(GVariant) can_graphical = NULL;
+
+  /* A seat becoming (un)able to do graphics affects all of its sessions,
+   * which is rare enough to just rescan. The active session switching is
+   * reported on the sessions themselves. */
+  changed = g_variant_get_child_value (parameters, 1);
+  can_graphical = g_variant_lookup_value (changed, "CanGraphical", NULL);
+  if (!can_graphical)
+    return;
+
+  if (!self->full_rescan_id)
+    self->full_rescan_id = g_idle_add (full_rescan_cb, self);
+}
+
+/**
+ * start_incremental:
+ * @self: RSdLogin
+ *
+ * Subscribes to the login1 signals, so that each change only costs reading
+ * the state of the affected session.
+ *
+ * Returns: %TRUE if the system bus is available
+ */
+static gboolean
+start_incremental (RSdLogin *self)
+{
+  g_autoptr(GError) error = NULL;
+
+  self->bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
+  if (!self->bus)
+    {
+      g_warning ("Could not connect to the system bus, falling back to rescanning logind state: %s",
+                 error->message);
+      return FALSE;
+    }
+
+  self->manager_signal_id =
+    g_dbus_connection_signal_subscribe (self->bus,
+                                        LOGIN1_BUS_NAME,
+                                        LOGIN1_MANAGER_INTERFACE,
+                                        NULL,
+                                        LOGIN1_PATH,
+                                        NULL,
+                                        G_DBUS_SIGNAL_FLAGS_NONE,
+                                        manager_signal_cb,
+                                        self, NULL);
+
+  self->session_signal_id =
+    g_dbus_connection_signal_subscribe (self->bus,
+                                        LOGIN1_BUS_NAME,
+                                        "org.freedesktop.DBus.Properties",
+                                        "PropertiesChanged",
+                                        NULL,
+                                        LOGIN1_SESSION_INTERFACE,
+                                        G_DBUS_SIGNAL_FLAGS_NONE,
+                                        session_properties_changed_cb,
+                                        self, NULL);
+
+  self->seat_signal_id =
+    g_dbus_connection_signal_subscribe (self->bus,
+                                        LOGIN1_BUS_NAME,
+                                        "org.freedesktop.DBus.Properties",
+                                        "PropertiesChanged",
+                                        NULL,
+                                        LOGIN1_SEAT_INTERFACE,
+                                        G_DBUS_SIGNAL_FLAGS_NONE,
+                                        seat_properties_changed_cb,
+                                        self, NULL);
+
+  self->rescan_id = g_timeout_add_seconds (RESCAN_INTERVAL_SEC, periodic_rescan_cb, self);
+
+  return TRUE;
+}
+
 static void
 r_sd_login_class_init (RSdLoginClass *klass)
 {
@@ -213,23 +792,89 @@ r_sd_login_get_users (RSdLogin *login,
     *graphical_users = login->graphical_users;
 }
 
+/**
+ * r_sd_login_user_is_remote:
+ * @login: RSdLogin
+ * @uid: A graphical user
+ *
+ * Returns: %TRUE if all active sessions of the user are remote
+ */
+gboolean
+r_sd_login_user_is_remote (RSdLogin *login,
+                           uid_t     uid)
+{
+  return !g_array_binary_search (login->local_users, &uid, uid_cmp, NULL);
+}
+
+/**
+ * r_sd_login_set_users:
+ * @login: RSdLogin created with r_sd_login_new_static()
+ * @all_users: Sorted uids of all users with sessions
+ * @graphical_users: Sorted uids of users with an active graphical session
+ * @remote_users: Sorted uids of graphical users without a local session
+ *
+ * Replaces the users and emits "changed".
+ */
+void
+r_sd_login_set_users (RSdLogin *login,
+                      GArray   *all_users,
+                      GArray   *graphical_users,
+                      GArray   *remote_users)
+{
+  guint i;
+
+  g_return_if_fail (login->mon == NULL && login->bus == NULL);
+
+  uid_array_assign (login->all_users, all_users);
+  uid_array_assign (login->graphical_users, graphical_users);
+
+  g_array_set_size (login->local_users, 0);
+  for (i = 0; i < graphical_users->len; i++)
+    {
+      uid_t uid = g_array_index (graphical_users, uid_t, i);
+
+      if (!g_array_binary_search (remote_users, &uid, uid_cmp, NULL))
+        g_array_append_val (login->local_users, uid);
+    }
+
+  g_signal_emit_by_name (login, "changed");
+}
+
 static void
 r_sd_login_init (RSdLogin *self)
 {
-  if (sd_login_monitor_new (NULL, &self->mon) < 0)
-    g_error ("Could not create login monitor!");
-
+  self->sessions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->dirty_sessions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->graphical_counts = g_hash_table_new (NULL, NULL);
+  self->local_counts = g_hash_table_new (NULL, NULL);
   self->graphical_users = g_array_new (FALSE, FALSE, sizeof(uid_t));
   self->all_users = g_array_new (FALSE, FALSE, sizeof(uid_t));
+  self->local_users = g_array_new (FALSE, FALSE, sizeof(uid_t));
+  self->reported_graphical_users = g_array_new (FALSE, FALSE, sizeof(uid_t));
+  self->reported_all_users = g_array_new (FALSE, FALSE, sizeof(uid_t));
+  self->reported_local_users = g_array_new (FALSE, FALSE, sizeof(uid_t));
+}
 
-  /* Note: We ignore the timeout here, this *might* break and if it does,
-   *       it really is on us to fix it.
-   */
-  self->mon_source = g_unix_fd_add (sd_login_monitor_get_fd (self->mon),
-                                    sd_login_monitor_get_events (self->mon),
-                                    logind_changed,
-                                    self);
+static void
+start_monitoring (RSdLogin *self)
+{
+  /* Subscribe before reading the state so that nothing is missed. */
+  if (!start_incremental (self))
+    {
+      if (sd_login_monitor_new (NULL, &self->mon) < 0)
+        g_error ("Could not create login monitor!");
+
+      /* Note: We ignore the timeout here, this *might* break and if it does,
+       *       it really is on us to fix it.
+       */
+      self->mon_source = g_unix_fd_add (sd_login_monitor_get_fd (self->mon),
+                                        sd_login_monitor_get_events (self->mon),
+                                        logind_changed,
+                                        self);
+    }
 
   /* Read current state right away. */
-  logind_quiet (self);
+  full_rescan (self);
+  update_reported_users (self);
+  g_signal_emit_by_name (self, "changed");
 }
@@ -17,9 +17,17 @@ typedef struct
 G_DECLARE_FINAL_TYPE (RSdLogin, r_sd_login, R, SD_LOGIN, GObject)
 
 RSdLogin *r_sd_login_new (void);
+RSdLogin *r_sd_login_new_static (void);
 
 void r_sd_login_get_users (RSdLogin *login,
                            GArray **all_users,
                            GArray **graphical_users);
+gboolean r_sd_login_user_is_remote (RSdLogin *login,
+                                    uid_t     uid);
+
+void r_sd_login_set_users (RSdLogin *login,
+                           GArray   *all_users,
+                           GArray   *graphical_users,
+                           GArray   *remote_users);
 
 G_END_DECLS
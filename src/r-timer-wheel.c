@@ -0,0 +1,230 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include "r-timer-wheel.h"
+
+/*
+ * A hashed timer wheel keyed by string. Deadlines are rounded up to the tick
+ * and hashed into one of N_SLOTS slots. Only a single GSource exists per
+ * wheel and it is armed for the next non-empty slot, so the number of
+ * wakeups does not depend on the number of pending timers.
+ */
+#define N_SLOTS 256
+
+typedef struct
+{
+  gchar *key;
+  gint64 tick;
+  guint  slot;
+  GList  link;
+} Entry;
+
+struct _RTimerWheel
+{
+  gint64          tick_usec;
+  RTimerWheelFunc func;
+  gpointer        user_data;
+
+  GQueue          slots[N_SLOTS];
+  GHashTable     *entries;
+
+  gint64          current_tick;
+  guint           source_id;
+  gint64          source_tick;
+};
+
+static void
+entry_free (Entry *entry)
+{
+  g_free (entry->key);
+  g_free (entry);
+}
+
+RTimerWheel *
+r_timer_wheel_new (guint tick_ms, RTimerWheelFunc func, gpointer user_data)
+{
+  RTimerWheel *wheel;
+  guint i;
+
+  g_return_val_if_fail (tick_ms > 0, NULL);
+
+  wheel = g_new0 (RTimerWheel, 1);
+  wheel->tick_usec = (gint64) tick_ms * 1000;
+  wheel->func = func;
+  wheel->user_data = user_data;
+  wheel->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                          (GDestroyNotify) entry_free);
+  wheel->current_tick = g_get_monotonic_time () / wheel->tick_usec;
+
+  for (i = 0; i < N_SLOTS; i++)
+    g_queue_init (&wheel->slots[i]);
+
+  return wheel;
+}
+
+void
+r_timer_wheel_free (RTimerWheel *wheel)
+{
+  r_timer_wheel_clear (wheel);
+  g_clear_pointer (&wheel->entries, g_hash_table_destroy);
+  g_free (wheel);
+}
+
+static gboolean wheel_dispatch (gpointer user_data);
+
+static void
+wheel_arm (RTimerWheel *wheel, gint64 tick)
+{
+  gint64 delay;
+
+  if (wheel->source_id && wheel->source_tick <= tick)
+    return;
+
+  g_clear_handle_id (&wheel->source_id, g_source_remove);
+
+  delay = MAX (tick * wheel->tick_usec - g_get_monotonic_time (), 0);
+  wheel->source_tick = tick;
+  wheel->source_id = g_timeout_add (delay / 1000 + 1, wheel_dispatch, wheel);
+}
+
+/* Arms the wheel for the next non-empty slot (at most one revolution ahead). */
+static void
+wheel_arm_next (RTimerWheel *wheel)
+{
+  gint64 tick;
+
+  for (tick = wheel->current_tick + 1; tick <= wheel->current_tick + N_SLOTS; tick++)
+    {
+      if (!g_queue_is_empty (&wheel->slots[tick % N_SLOTS]))
+        {
+          wheel_arm (wheel, tick);
+          return;
+        }
+    }
+}
+
+static void
+wheel_remove (RTimerWheel *wheel, Entry *entry)
+{
+  g_queue_unlink (&wheel->slots[entry->slot], &entry->link);
+  g_hash_table_remove (wheel->entries, entry->key);
+}
+
+static gboolean
+wheel_dispatch (gpointer user_data)
+{
+  RTimerWheel *wheel = user_data;
+  g_autoptr(GPtrArray) fired = NULL;
+  gint64 now_tick;
+  gint64 tick;
+  guint i;
+
+  wheel->source_id = 0;
+
+  fired = g_ptr_array_new_with_free_func (g_free);
+  now_tick = g_get_monotonic_time () / wheel->tick_usec;
+
+  /* Catch up on every tick since the last dispatch, visiting each slot at
+   * most once. */
+  tick = MAX (wheel->current_tick + 1, now_tick - N_SLOTS + 1);
+  for (; tick <= now_tick; tick++)
+    {
+      GList *l = wheel->slots[tick % N_SLOTS].head;
+
+      while (l)
+        {
+          Entry *entry = l->data;
+
+          l = l->next;
+          if (entry->tick > now_tick)
+            continue;
+
+          g_ptr_array_add (fired, g_strdup (entry->key));
+          wheel_remove (wheel, entry);
+        }
+    }
+
+  wheel->current_tick = MAX (wheel->current_tick, now_tick);
+
+  /* Callbacks may reschedule (or cancel) timers. */
+  for (i = 0; i < fired->len; i++)
+    wheel->func (g_ptr_array_index (fired, i), wheel->user_data);
+
+  wheel_arm_next (wheel);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * r_timer_wheel_schedule:
+ * @wheel: RTimerWheel
+ * @key: Timer key
+ * @deadline: Monotonic time in microseconds
+ *
+ * Schedules (or reschedules) the timer for @key. Deadlines in the past fire
+ * on the next tick.
+ */
+void
+r_timer_wheel_schedule (RTimerWheel *wheel, const gchar *key, gint64 deadline)
+{
+  Entry *entry;
+  gint64 tick;
+
+  tick = (deadline + wheel->tick_usec - 1) / wheel->tick_usec;
+  tick = MAX (tick, wheel->current_tick + 1);
+
+  entry = g_hash_table_lookup (wheel->entries, key);
+  if (entry)
+    {
+      if (entry->tick == tick)
+        return;
+
+      g_queue_unlink (&wheel->slots[entry->slot], &entry->link);
+    }
+  else
+    {
+      entry = g_new0 (Entry, 1);
+      entry->key = g_strdup (key);
+      entry->link.data = entry;
+      g_hash_table_insert (wheel->entries, entry->key, entry);
+    }
+
+  entry->tick = tick;
+  entry->slot = tick % N_SLOTS;
+  g_queue_push_tail_link (&wheel->slots[entry->slot], &entry->link);
+
+  wheel_arm (wheel, tick);
+}
+
+void
+r_timer_wheel_cancel (RTimerWheel *wheel, const gchar *key)
+{
+  Entry *entry;
+
+  entry = g_hash_table_lookup (wheel->entries, key);
+  if (entry)
+    wheel_remove (wheel, entry);
+
+  /* An armed source without entries simply fires once and stops. */
+}
+
+void
+r_timer_wheel_clear (RTimerWheel *wheel)
+{
+  guint i;
+
+  g_clear_handle_id (&wheel->source_id, g_source_remove);
+
+  for (i = 0; i < N_SLOTS; i++)
+    {
+      while (!g_queue_is_empty (&wheel->slots[i]))
+        g_queue_unlink (&wheel->slots[i], wheel->slots[i].head);
+    }
+
+  g_hash_table_remove_all (wheel->entries);
+}
+
+guint
+r_timer_wheel_get_size (RTimerWheel *wheel)
+{
+  return g_hash_table_size (wheel->entries);
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef void (*RTimerWheelFunc) (const gchar *key,
+                                 gpointer     user_data);
+
+typedef struct _RTimerWheel RTimerWheel;
+
+RTimerWheel *r_timer_wheel_new (guint           tick_ms,
+                                RTimerWheelFunc func,
+                                gpointer        user_data);
+void r_timer_wheel_free (RTimerWheel *wheel);
+
+void r_timer_wheel_schedule (RTimerWheel *wheel,
+                             const gchar *key,
+                             gint64       deadline);
+void r_timer_wheel_cancel (RTimerWheel *wheel,
+                           const gchar *key);
+void r_timer_wheel_clear (RTimerWheel *wheel);
+guint r_timer_wheel_get_size (RTimerWheel *wheel);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RTimerWheel, r_timer_wheel_free)
+
+G_END_DECLS
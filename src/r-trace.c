@@ -0,0 +1,314 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <gio/gio.h>
+
+#include "r-trace.h"
+#include "utils.h"
+
+/*
+ * A trace is a text file with one input event per line, prefixed with the
+ * milliseconds since the start of the trace. Lines starting with # are
+ * comments. Lists of uids are comma separated, "-" is the empty list.
+ *
+ *   <msec> logind <all users> <graphical users> <remote users> <systemd graphical users>
+ *   <msec> app <inactive msec|active> <boost flags> <cgroup path>
+ *   <msec> removed <cgroup path>
+ *
+ * Systemd graphical users run the user daemon in their user manager, which
+ * is otherwise looked up in the cgroup hierarchy of the host.
+ *
+ * Applications are recorded with the state the monitors (inotify/xattr,
+ * PipeWire, GameMode) derived, not with the raw events of each source.
+ */
+#define TRACE_HEADER "# uresourced trace 2\n"
+
+struct _RTraceWriter
+{
+  FILE   *file;
+  gint64  start;
+};
+
+void
+r_trace_event_free (RTraceEvent *event)
+{
+  g_clear_pointer (&event->all_users, g_array_unref);
+  g_clear_pointer (&event->graphical_users, g_array_unref);
+  g_clear_pointer (&event->remote_users, g_array_unref);
+  g_clear_pointer (&event->systemd_graphical_users, g_array_unref);
+  g_free (event->path);
+  g_free (event);
+}
+
+static GArray *
+parse_uid_list (const gchar *str, GError **error)
+{
+  g_autoptr(GArray) uids = NULL;
+  g_auto(GStrv) items = NULL;
+  guint i;
+
+  uids = g_array_new (FALSE, FALSE, sizeof (uid_t));
+  if (g_str_equal (str, "-"))
+    return g_steal_pointer (&uids);
+
+  items = g_strsplit (str, ",", -1);
+  for (i = 0; items[i]; i++)
+    {
+      guint64 value;
+      uid_t uid;
+
+      if (!g_ascii_string_to_unsigned (items[i], 10, 0, G_MAXUINT32, &value, error))
+        return NULL;
+
+      uid = value;
+      g_array_append_val (uids, uid);
+    }
+
+  g_array_sort (uids, uid_cmp);
+
+  return g_steal_pointer (&uids);
+}
+
+static RTraceEvent *
+parse_event (const gchar *line, GError **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_auto(GStrv) fields = NULL;
+  g_auto(GStrv) args = NULL;
+  RTraceEvent *event;
+  guint n_args;
+
+  /* Paths are the rest of the line, so split the arguments per event. */
+  fields = g_strsplit (line, " ", 3);
+  if (g_strv_length (fields) < 3)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Too few fields");
+      return NULL;
+    }
+
+  event = g_new0 (RTraceEvent, 1);
+  event->inactive_msec = -1;
+
+  if (!g_ascii_string_to_signed (fields[0], 10, 0, G_MAXINT64, &event->time_msec, &local_error))
+    goto fail;
+
+  if (g_str_equal (fields[1], "logind"))
+    {
+      args = g_strsplit (fields[2], " ", -1);
+      n_args = g_strv_length (args);
+      if (n_args != 4)
+        goto invalid;
+
+      event->type = R_TRACE_EVENT_LOGIND;
+      if (!(event->all_users = parse_uid_list (args[0], &local_error)) ||
+          !(event->graphical_users = parse_uid_list (args[1], &local_error)) ||
+          !(event->remote_users = parse_uid_list (args[2], &local_error)) ||
+          !(event->systemd_graphical_users = parse_uid_list (args[3], &local_error)))
+        goto fail;
+    }
+  else if (g_str_equal (fields[1], "app"))
+    {
+      guint64 boosted;
+
+      args = g_strsplit (fields[2], " ", 3);
+      n_args = g_strv_length (args);
+      if (n_args != 3)
+        goto invalid;
+
+      event->type = R_TRACE_EVENT_APP;
+      if (!g_str_equal (args[0], "active") &&
+          !g_ascii_string_to_signed (args[0], 10, 0, G_MAXINT64, &event->inactive_msec, &local_error))
+        goto fail;
+      if (!g_ascii_string_to_unsigned (args[1], 10, 0, G_MAXUINT32, &boosted, &local_error))
+        goto fail;
+      event->boosted = boosted;
+      event->path = g_strdup (args[2]);
+    }
+  else if (g_str_equal (fields[1], "removed"))
+    {
+      event->type = R_TRACE_EVENT_APP_REMOVED;
+      event->path = g_strdup (fields[2]);
+    }
+  else
+    {
+      g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Unknown event %s", fields[1]);
+      goto fail;
+    }
+
+  return event;
+
+invalid:
+  g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "Wrong number of fields for %s", fields[1]);
+fail:
+  r_trace_event_free (event);
+  g_propagate_error (error, g_steal_pointer (&local_error));
+  return NULL;
+}
+
+/**
+ * r_trace_load:
+ * @filename: The trace file
+ * @error: Return location for a #GError
+ *
+ * Returns: (transfer full): The RTraceEvent array ordered by time, %NULL on
+ *   error
+ */
+GPtrArray *
+r_trace_load (const gchar *filename, GError **error)
+{
+  g_autoptr(GPtrArray) events = NULL;
+  g_autofree gchar *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  gint64 last_msec = 0;
+  guint i;
+
+  if (!g_file_get_contents (filename, &contents, NULL, error))
+    return NULL;
+
+  events = g_ptr_array_new_with_free_func ((GDestroyNotify) r_trace_event_free);
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i]; i++)
+    {
+      g_autoptr(GError) local_error = NULL;
+      RTraceEvent *event;
+
+      g_strstrip (lines[i]);
+      if (lines[i][0] == '\0' || lines[i][0] == '#')
+        continue;
+
+      event = parse_event (lines[i], &local_error);
+      if (!event)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "%s:%u: %s", filename, i + 1, local_error->message);
+          return NULL;
+        }
+
+      if (event->time_msec < last_msec)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "%s:%u: Events are not ordered by time", filename, i + 1);
+          r_trace_event_free (event);
+          return NULL;
+        }
+      last_msec = event->time_msec;
+
+      g_ptr_array_add (events, event);
+    }
+
+  return g_steal_pointer (&events);
+}
+
+RTraceWriter *
+r_trace_writer_new (const gchar *filename, GError **error)
+{
+  RTraceWriter *writer;
+  FILE *file;
+
+  file = fopen (filename, "we");
+  if (!file)
+    {
+      gint errsv = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Could not open %s: %s", filename, g_strerror (errsv));
+      return NULL;
+    }
+
+  /* Keep the trace usable if the daemon does not exit cleanly. */
+  setvbuf (file, NULL, _IOLBF, 0);
+  fputs (TRACE_HEADER, file);
+
+  writer = g_new0 (RTraceWriter, 1);
+  writer->file = file;
+  writer->start = g_get_monotonic_time ();
+
+  return writer;
+}
+
+void
+r_trace_writer_free (RTraceWriter *writer)
+{
+  fclose (writer->file);
+  g_free (writer);
+}
+
+static gint64
+trace_time_msec (RTraceWriter *writer)
+{
+  return (g_get_monotonic_time () - writer->start) / 1000;
+}
+
+static void
+append_uid_list (GString *str, GArray *uids)
+{
+  guint i;
+
+  g_string_append_c (str, ' ');
+  if (uids->len == 0)
+    g_string_append_c (str, '-');
+
+  for (i = 0; i < uids->len; i++)
+    g_string_append_printf (str, i > 0 ? ",%u" : "%u", (guint) g_array_index (uids, uid_t, i));
+}
+
+void
+r_trace_writer_add_logind (RTraceWriter *writer,
+                           GArray       *all_users,
+                           GArray       *graphical_users,
+                           GArray       *remote_users,
+                           GArray       *systemd_graphical_users)
+{
+  g_autoptr(GString) line = NULL;
+
+  line = g_string_new (NULL);
+  g_string_printf (line, "%" G_GINT64_FORMAT " logind", trace_time_msec (writer));
+  append_uid_list (line, all_users);
+  append_uid_list (line, graphical_users);
+  append_uid_list (line, remote_users);
+  append_uid_list (line, systemd_graphical_users);
+  g_string_append_c (line, '\n');
+
+  fputs (line->str, writer->file);
+}
+
+/**
+ * r_trace_writer_add_app:
+ * @writer: RTraceWriter
+ * @path: The cgroup path of the application
+ * @timestamp: The monotonic inactive-since timestamp, -1 if active
+ * @boosted: The boost flags
+ *
+ * The timestamp is stored relative to the time of the event, so that the
+ * application has the same age when it is replayed.
+ */
+void
+r_trace_writer_add_app (RTraceWriter *writer,
+                        const gchar  *path,
+                        gint64        timestamp,
+                        guint32       boosted)
+{
+  g_autofree gchar *inactive = NULL;
+
+  if (timestamp == -1)
+    inactive = g_strdup ("active");
+  else
+    inactive = g_strdup_printf ("%" G_GINT64_FORMAT, MAX (g_get_monotonic_time () - timestamp, 0) / 1000);
+
+  fprintf (writer->file, "%" G_GINT64_FORMAT " app %s %u %s\n",
+           trace_time_msec (writer), inactive, boosted, path);
+}
+
+void
+r_trace_writer_add_app_removed (RTraceWriter *writer,
+                                const gchar  *path)
+{
+  fprintf (writer->file, "%" G_GINT64_FORMAT " removed %s\n",
+           trace_time_msec (writer), path);
+}
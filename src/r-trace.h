@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  R_TRACE_EVENT_LOGIND,
+  R_TRACE_EVENT_APP,
+  R_TRACE_EVENT_APP_REMOVED,
+} RTraceEventType;
+
+typedef struct
+{
+  RTraceEventType type;
+  /* Milliseconds since the start of the trace */
+  gint64          time_msec;
+
+  /* R_TRACE_EVENT_LOGIND: sorted uids */
+  GArray         *all_users;
+  GArray         *graphical_users;
+  GArray         *remote_users;
+  GArray         *systemd_graphical_users;
+
+  /* R_TRACE_EVENT_APP and R_TRACE_EVENT_APP_REMOVED */
+  gchar          *path;
+  /* Time since the application became inactive, -1 if it is active */
+  gint64          inactive_msec;
+  guint32         boosted;
+} RTraceEvent;
+
+void r_trace_event_free (RTraceEvent *event);
+
+GPtrArray *r_trace_load (const gchar *filename,
+                         GError     **error);
+
+typedef struct _RTraceWriter RTraceWriter;
+
+RTraceWriter *r_trace_writer_new (const gchar *filename,
+                                  GError     **error);
+void r_trace_writer_free (RTraceWriter *writer);
+
+void r_trace_writer_add_logind (RTraceWriter *writer,
+                                GArray       *all_users,
+                                GArray       *graphical_users,
+                                GArray       *remote_users,
+                                GArray       *systemd_graphical_users);
+void r_trace_writer_add_app (RTraceWriter *writer,
+                             const gchar  *path,
+                             gint64        timestamp,
+                             guint32       boosted);
+void r_trace_writer_add_app_removed (RTraceWriter *writer,
+                                    const gchar  *path);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RTraceWriter, r_trace_writer_free)
+
+G_END_DECLS
@@ -0,0 +1,288 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "r-usage-sampler.h"
+
+/* Large enough for cpu.stat and io.stat of a handful of devices */
+#define READ_BUF_SIZE 4096
+
+typedef struct
+{
+  gchar        *path;
+  gint          dirfd;
+  /* Ring buffer of the last n_samples samples */
+  RUsageSample *samples;
+  guint         head;
+  guint         count;
+} CgroupUsage;
+
+struct _RUsageSampler
+{
+  guint       n_samples;
+  /* name -> CgroupUsage */
+  GHashTable *cgroups;
+};
+
+static void
+cgroup_usage_free (CgroupUsage *usage)
+{
+  if (usage->dirfd >= 0)
+    close (usage->dirfd);
+  g_free (usage->samples);
+  g_free (usage->path);
+  g_free (usage);
+}
+
+static gint
+open_cgroup_dir (const gchar *path)
+{
+  return open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+RUsageSampler *
+r_usage_sampler_new (guint n_samples)
+{
+  RUsageSampler *sampler;
+
+  sampler = g_new0 (RUsageSampler, 1);
+  sampler->n_samples = MAX (n_samples, 1);
+  sampler->cgroups = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify) cgroup_usage_free);
+
+  return sampler;
+}
+
+void
+r_usage_sampler_free (RUsageSampler *sampler)
+{
+  g_clear_pointer (&sampler->cgroups, g_hash_table_destroy);
+  g_free (sampler);
+}
+
+/**
+ * r_usage_sampler_add_cgroup:
+ * @sampler: The sampler
+ * @name: Name to look the samples up with
+ * @path: Path of the cgroup directory
+ *
+ * The directory is opened once and kept open, so that sampling only needs
+ * an openat() relative to it per attribute instead of a full path lookup.
+ * The cgroup does not need to exist yet.
+ */
+void
+r_usage_sampler_add_cgroup (RUsageSampler *sampler,
+                            const gchar   *name,
+                            const gchar   *path)
+{
+  CgroupUsage *usage;
+
+  if (g_hash_table_contains (sampler->cgroups, name))
+    return;
+
+  usage = g_new0 (CgroupUsage, 1);
+  usage->path = g_strdup (path);
+  usage->dirfd = open_cgroup_dir (path);
+  usage->samples = g_new0 (RUsageSample, sampler->n_samples);
+
+  g_hash_table_insert (sampler->cgroups, g_strdup (name), usage);
+}
+
+void
+r_usage_sampler_remove_cgroup (RUsageSampler *sampler,
+                               const gchar   *name)
+{
+  g_hash_table_remove (sampler->cgroups, name);
+}
+
+/* Reads an attribute into @buf, returns FALSE if it does not exist (e.g.
+ * the cgroup was removed). */
+static gboolean
+read_attribute (gint dirfd, const gchar *attribute, gchar *buf, gsize size)
+{
+  ssize_t len;
+  gint fd;
+
+  fd = openat (dirfd, attribute, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return FALSE;
+
+  do
+    len = read (fd, buf, size - 1);
+  while (len < 0 && errno == EINTR);
+  close (fd);
+
+  if (len < 0)
+    return FALSE;
+
+  buf[len] = '\0';
+  return TRUE;
+}
+
+static guint64
+parse_keyed_value (const gchar *contents, const gchar *key)
+{
+  const gchar *p = contents;
+  gsize key_len = strlen (key);
+
+  while ((p = strstr (p, key)))
+    {
+      /* Only match whole keys at the start of a line */
+      if ((p == contents || p[-1] == '\n') && p[key_len] == ' ')
+        return g_ascii_strtoull (p + key_len + 1, NULL, 10);
+      p += key_len;
+    }
+
+  return 0;
+}
+
+/* Sums rbytes= and wbytes= over all devices in io.stat */
+static void
+parse_io_stat (const gchar *contents, guint64 *read_bytes, guint64 *write_bytes)
+{
+  const gchar *p;
+
+  *read_bytes = 0;
+  *write_bytes = 0;
+
+  for (p = contents; (p = strstr (p, "bytes=")); p += strlen ("bytes="))
+    {
+      if (p == contents)
+        continue;
+
+      if (p[-1] == 'r')
+        *read_bytes += g_ascii_strtoull (p + strlen ("bytes="), NULL, 10);
+      else if (p[-1] == 'w')
+        *write_bytes += g_ascii_strtoull (p + strlen ("bytes="), NULL, 10);
+    }
+}
+
+static gboolean
+sample_cgroup (CgroupUsage *usage, RUsageSample *sample)
+{
+  gchar buf[READ_BUF_SIZE];
+
+  /* A cgroup that was removed and created again needs a new dirfd. */
+  if (usage->dirfd < 0 || !read_attribute (usage->dirfd, "memory.current", buf, sizeof (buf)))
+    {
+      if (usage->dirfd >= 0)
+        close (usage->dirfd);
+      usage->dirfd = open_cgroup_dir (usage->path);
+      if (usage->dirfd < 0 || !read_attribute (usage->dirfd, "memory.current", buf, sizeof (buf)))
+        return FALSE;
+    }
+  sample->memory_current = g_ascii_strtoull (buf, NULL, 10);
+
+  if (read_attribute (usage->dirfd, "cpu.stat", buf, sizeof (buf)))
+    sample->cpu_usage_usec = parse_keyed_value (buf, "usage_usec");
+
+  if (read_attribute (usage->dirfd, "io.stat", buf, sizeof (buf)))
+    parse_io_stat (buf, &sample->io_read_bytes, &sample->io_write_bytes);
+
+  return TRUE;
+}
+
+/**
+ * r_usage_sampler_sample:
+ * @sampler: The sampler
+ *
+ * Takes a sample of all cgroups. Cgroups that do not exist at the moment
+ * are skipped.
+ */
+void
+r_usage_sampler_sample (RUsageSampler *sampler)
+{
+  GHashTableIter iter;
+  gpointer value;
+  gint64 now;
+
+  now = g_get_real_time ();
+
+  g_hash_table_iter_init (&iter, sampler->cgroups);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      CgroupUsage *usage = value;
+      RUsageSample sample = { .timestamp = now };
+
+      if (!sample_cgroup (usage, &sample))
+        continue;
+
+      usage->samples[usage->head] = sample;
+      usage->head = (usage->head + 1) % sampler->n_samples;
+      usage->count = MIN (usage->count + 1, sampler->n_samples);
+    }
+}
+
+/**
+ * r_usage_sampler_get_latest:
+ * @sampler: The sampler
+ * @name: Name of the cgroup
+ *
+ * Returns: (nullable): The latest sample, %NULL if there is none
+ */
+const RUsageSample *
+r_usage_sampler_get_latest (RUsageSampler *sampler,
+                            const gchar   *name)
+{
+  CgroupUsage *usage;
+
+  usage = g_hash_table_lookup (sampler->cgroups, name);
+  if (!usage || usage->count == 0)
+    return NULL;
+
+  return &usage->samples[(usage->head + sampler->n_samples - 1) % sampler->n_samples];
+}
+
+/**
+ * r_usage_sampler_get_samples:
+ * @sampler: The sampler
+ * @name: Name of the cgroup
+ *
+ * Returns: (transfer full) (nullable): The RUsageSample history, oldest
+ *   first, %NULL if the cgroup is unknown
+ */
+GArray *
+r_usage_sampler_get_samples (RUsageSampler *sampler,
+                             const gchar   *name)
+{
+  CgroupUsage *usage;
+  GArray *samples;
+  guint first;
+  guint i;
+
+  usage = g_hash_table_lookup (sampler->cgroups, name);
+  if (!usage)
+    return NULL;
+
+  samples = g_array_sized_new (FALSE, FALSE, sizeof (RUsageSample), usage->count);
+  first = (usage->head + sampler->n_samples - usage->count) % sampler->n_samples;
+  for (i = 0; i < usage->count; i++)
+    g_array_append_val (samples, usage->samples[(first + i) % sampler->n_samples]);
+
+  return samples;
+}
+
+/**
+ * r_usage_sampler_get_names:
+ * @sampler: The sampler
+ *
+ * Returns: (transfer container): The names of all cgroups
+ */
+GPtrArray *
+r_usage_sampler_get_names (RUsageSampler *sampler)
+{
+  GHashTableIter iter;
+  GPtrArray *names;
+  gpointer name;
+
+  names = g_ptr_array_new ();
+
+  g_hash_table_iter_init (&iter, sampler->cgroups);
+  while (g_hash_table_iter_next (&iter, &name, NULL))
+    g_ptr_array_add (names, name);
+
+  return names;
+}
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct
+{
+  /* Wall clock time of the sample in microseconds */
+  gint64  timestamp;
+  guint64 memory_current;
+  guint64 cpu_usage_usec;
+  guint64 io_read_bytes;
+  guint64 io_write_bytes;
+} RUsageSample;
+
+typedef struct _RUsageSampler RUsageSampler;
+
+RUsageSampler *r_usage_sampler_new (guint n_samples);
+void r_usage_sampler_free (RUsageSampler *sampler);
+
+void r_usage_sampler_add_cgroup (RUsageSampler *sampler,
+                                 const gchar   *name,
+                                 const gchar   *path);
+void r_usage_sampler_remove_cgroup (RUsageSampler *sampler,
+                                    const gchar   *name);
+void r_usage_sampler_sample (RUsageSampler *sampler);
+
+const RUsageSample *r_usage_sampler_get_latest (RUsageSampler *sampler,
+                                                const gchar   *name);
+GArray *r_usage_sampler_get_samples (RUsageSampler *sampler,
+                                     const gchar   *name);
+GPtrArray *r_usage_sampler_get_names (RUsageSampler *sampler);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RUsageSampler, r_usage_sampler_free)
+
+G_END_DECLS
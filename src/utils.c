@@ -1,6 +1,13 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include "uresourced-config.h"
 #include "utils.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <glib/gstdio.h>
 #include <systemd/sd-login.h>
 
@@ -10,12 +17,21 @@ uid_cmp (gconstpointer a, gconstpointer b)
   return *(uid_t*)a - *(uid_t*)b;
 }
 
+gboolean
+uid_array_equal (GArray *a, GArray *b)
+{
+  return a->len == b->len &&
+         memcmp (a->data, b->data, a->len * sizeof (uid_t)) == 0;
+}
+
 guint64
 get_available_ram ()
 {
   g_autoptr(GError) error = NULL;
   g_autofree char *contents = NULL;
+  g_autofree char *limit = NULL;
   char *mem_total = NULL;
+  guint64 ram;
 
   if (!g_file_get_contents ("/proc/meminfo", &contents, NULL, &error))
     {
@@ -32,7 +48,83 @@ get_available_ram ()
     }
 
   /* The value is given in kB, return bytes. */
-  return g_ascii_strtoull (mem_total + 9, NULL, 10) * 1024;
+  ram = g_ascii_strtoull (mem_total + 9, NULL, 10) * 1024;
+
+  /* Inside a container the root cgroup may be limited further. */
+  if (g_file_get_contents ("/sys/fs/cgroup/memory.max", &limit, NULL, NULL))
+    {
+      g_strstrip (limit);
+      if (!g_str_equal (limit, "max"))
+        {
+          guint64 value = g_ascii_strtoull (limit, NULL, 10);
+
+          if (value > 0 && value < ram)
+            ram = value;
+        }
+    }
+
+  return ram;
+}
+
+/**
+ * parse_size:
+ * @value: A size with an optional K, M, G, T or % suffix
+ * @percent_base: The value that 100% corresponds to, 0 if percentages are
+ *   not allowed
+ * @error: Return location for a #GError
+ *
+ * Returns: The size in bytes, 0 on error
+ */
+guint64
+parse_size (const char *value, guint64 percent_base, GError **error)
+{
+  guint64 res;
+  char *end = NULL;
+
+  res = g_ascii_strtoll (value, &end, 10);
+  if (end == value)
+    {
+      g_set_error_literal (error,
+                           G_KEY_FILE_ERROR,
+                           G_KEY_FILE_ERROR_INVALID_VALUE,
+                           "Could not parse size");
+      return 0;
+    }
+
+  if (end && *end)
+    {
+      switch (*end)
+        {
+          case 'K':
+            res = res * 1024;
+            break;
+          case 'M':
+            res = res * 1024 * 1024;
+            break;
+          case 'G':
+            res = res * 1024 * 1024 * 1024;
+            break;
+          case 'T':
+            res = res * 1024 * 1024 * 1024 * 1024;
+            break;
+          case '%':
+            if (percent_base > 0)
+              {
+                res = MIN(100, res) * percent_base / 100;
+                break;
+              }
+            /* fall through */
+
+          default:
+            g_set_error (error,
+                         G_KEY_FILE_ERROR,
+                         G_KEY_FILE_ERROR_INVALID_VALUE,
+                         "Unknown unit %c", *end);
+            return 0;
+        }
+    }
+
+  return res;
 }
 
 /**
@@ -111,4 +203,195 @@ get_unit_name_from_path (const gchar *path)
     }
 
   return g_steal_pointer (&app_unit_name);
-}
\ No newline at end of file
+}
+
+static RCgroupWriteHook cgroup_write_hook;
+static gpointer cgroup_write_hook_data;
+
+/**
+ * set_cgroup_write_hook:
+ * @hook: (nullable): Function called instead of writing to cgroupfs
+ * @user_data: Data passed to @hook
+ *
+ * Used by the replay mode to record cgroup writes instead of touching the
+ * cgroups of the running system.
+ */
+void
+set_cgroup_write_hook (RCgroupWriteHook hook,
+                       gpointer         user_data)
+{
+  cgroup_write_hook = hook;
+  cgroup_write_hook_data = user_data;
+}
+
+/**
+ * write_cgroup_attribute:
+ * @cgroup_path: Full path to the cgroup directory
+ * @attribute: Name of the cgroup attribute file, e.g. "cpu.idle"
+ * @value: Value to write
+ *
+ * Writes a value into a cgroupfs attribute file. This is only used for
+ * attributes that systemd does not expose as unit properties.
+ *
+ * Returns: %TRUE if the value was written
+ */
+gboolean
+write_cgroup_attribute (const gchar *cgroup_path,
+                        const gchar *attribute,
+                        const gchar *value)
+{
+  g_autofree gchar *path = NULL;
+  gssize len;
+  gint fd;
+
+  path = g_build_filename (cgroup_path, attribute, NULL);
+
+  if (cgroup_write_hook)
+    {
+      cgroup_write_hook (path, value, cgroup_write_hook_data);
+      return TRUE;
+    }
+
+  fd = open (path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      g_debug ("Could not open %s: %m", path);
+      return FALSE;
+    }
+
+  len = strlen (value);
+  if (write (fd, value, len) != len)
+    {
+      g_debug ("Could not write %s to %s: %m", value, path);
+      close (fd);
+      return FALSE;
+    }
+
+  close (fd);
+  return TRUE;
+}
+
+/**
+ * load_user_config:
+ * @file: The key file to load into
+ *
+ * Loads uresourced.conf for the user daemon. The file in the user's
+ * configuration directory takes precedence over the system wide one.
+ *
+ * Returns: %TRUE if a configuration file was loaded
+ */
+gboolean
+load_user_config (GKeyFile *file)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *user_config_path = NULL;
+
+  user_config_path = g_strdup_printf ("%s/uresourced.conf", g_get_user_config_dir ());
+
+  if (g_key_file_load_from_file (file, user_config_path, G_KEY_FILE_NONE, NULL))
+    return TRUE;
+
+  g_debug ("Could not read %s, trying default location", user_config_path);
+
+  if (!g_key_file_load_from_file (file, SYSCONFDIR "/uresourced.conf", G_KEY_FILE_NONE, &error))
+    {
+      g_warning ("Could not read default configuration file: %s", error->message);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Maps a device number of a (possibly virtual) file system to the device
+ * of its source using mountinfo, e.g. for btrfs. */
+static dev_t
+get_mount_source_device (dev_t dev)
+{
+  g_autofree char *contents = NULL;
+  g_autofree char *dev_str = NULL;
+  g_auto(GStrv) lines = NULL;
+  char **line;
+
+  if (!g_file_get_contents ("/proc/self/mountinfo", &contents, NULL, NULL))
+    return 0;
+
+  dev_str = g_strdup_printf ("%u:%u", major (dev), minor (dev));
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (line = lines; *line; line++)
+    {
+      g_auto(GStrv) fields = NULL;
+      const char *source;
+      struct stat st;
+
+      fields = g_strsplit (*line, " ", -1);
+      if (g_strv_length (fields) < 3 || !g_str_equal (fields[2], dev_str))
+        continue;
+
+      /* The source follows the separator and the file system type. */
+      source = strstr (*line, " - ");
+      if (!source)
+        continue;
+      source = strchr (source + 3, ' ');
+      if (!source)
+        continue;
+      source++;
+
+      if (g_str_has_prefix (source, "/dev/"))
+        {
+          g_autofree char *source_path = g_strndup (source, strcspn (source, " "));
+
+          if (stat (source_path, &st) == 0 && S_ISBLK (st.st_mode))
+            return st.st_rdev;
+        }
+    }
+
+  return 0;
+}
+
+/**
+ * get_block_device_for_path:
+ * @path: A path on the file system
+ *
+ * Finds the block device the file system of @path is stored on. Partitions
+ * are resolved to the whole disk, as that is where I/O is scheduled.
+ *
+ * Returns: The device node (as /dev/block/MAJOR:MINOR), or %NULL
+ */
+gchar *
+get_block_device_for_path (const gchar *path)
+{
+  g_autofree char *sysfs_path = NULL;
+  g_autofree char *partition_path = NULL;
+  g_autofree char *real_path = NULL;
+  g_autofree char *parent_path = NULL;
+  g_autofree char *parent_dev = NULL;
+  struct stat st;
+  dev_t dev;
+
+  if (stat (path, &st) < 0)
+    return NULL;
+
+  dev = st.st_dev;
+  if (major (dev) == 0)
+    dev = get_mount_source_device (dev);
+  if (dev == 0)
+    return NULL;
+
+  sysfs_path = g_strdup_printf ("/sys/dev/block/%u:%u", major (dev), minor (dev));
+  partition_path = g_build_filename (sysfs_path, "partition", NULL);
+  if (g_file_test (partition_path, G_FILE_TEST_EXISTS))
+    {
+      real_path = realpath (sysfs_path, NULL);
+      if (real_path)
+        {
+          g_autofree char *dirname = g_path_get_dirname (real_path);
+
+          parent_path = g_build_filename (dirname, "dev", NULL);
+          if (g_file_get_contents (parent_path, &parent_dev, NULL, NULL))
+            return g_strdup_printf ("/dev/block/%s", g_strstrip (parent_dev));
+        }
+    }
+
+  return g_strdup_printf ("/dev/block/%u:%u", major (dev), minor (dev));
+}
@@ -4,6 +4,19 @@
 #include <sys/types.h>
 
 int uid_cmp (gconstpointer a, gconstpointer b);
+gboolean uid_array_equal (GArray *a, GArray *b);
 guint64 get_available_ram ();
+guint64 parse_size (const char *value, guint64 percent_base, GError **error);
 gchar *get_unit_cgroup_path_from_pid (pid_t pid);
-gchar *get_unit_name_from_path (const gchar *path);
\ No newline at end of file
+gchar *get_unit_name_from_path (const gchar *path);
+gboolean write_cgroup_attribute (const gchar *cgroup_path,
+                                 const gchar *attribute,
+                                 const gchar *value);
+
+typedef void (*RCgroupWriteHook) (const gchar *path,
+                                  const gchar *value,
+                                  gpointer     user_data);
+void set_cgroup_write_hook (RCgroupWriteHook hook,
+                            gpointer         user_data);
+gboolean load_user_config (GKeyFile *file);
+gchar *get_block_device_for_path (const gchar *path);